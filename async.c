@@ -0,0 +1,257 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "async.h"
+#include "log.h"
+
+/*
+ * The MariaDB client library (Connector/C, or libmysqlclient of MariaDB)
+ * can run a query as a mysql_real_query_start() and as many
+ * mysql_real_query_cont() as it takes: each returns what the connection
+ * waits for, so one thread can wait in poll() for many connections and
+ * have queries on all of them in flight at once.  With another client
+ * library, async_run() just runs the queries one after the other.
+ */
+
+int async_available(void)
+{
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Set a connection up for async_run(): the non-blocking calls need a
+ * context of their own on each connection.  The usual blocking calls go
+ * on working as before.
+ *
+ * @param mysql connection, after mysql_init() and before mysql_real_connect()
+ */
+void async_prepare(MYSQL *mysql)
+{
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    mysql_options(mysql, MYSQL_OPT_NONBLOCK, 0);
+#endif
+}
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+/** Continue operation i of ops with what is ready for it, 0 to start it; return what it waits for next, 0 once finished */
+typedef int (*async_step)(void *ops, int i, int ready);
+
+/** What poll() waits for, for a connection waiting for status */
+static short async_events(int status)
+{
+    short events = 0;
+
+    if (status & MYSQL_WAIT_READ)
+	events |= POLLIN;
+    if (status & MYSQL_WAIT_WRITE)
+	events |= POLLOUT;
+    if (status & MYSQL_WAIT_EXCEPT)
+	events |= POLLPRI;
+    return events;
+}
+
+/** What happened, for the continuing call, to a connection poll() returned revents for */
+static int async_ready(short revents, int status, int timed_out)
+{
+    int ready = 0;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR))
+	ready |= MYSQL_WAIT_READ;
+    if (revents & POLLOUT)
+	ready |= MYSQL_WAIT_WRITE;
+    if (revents & POLLPRI)
+	ready |= MYSQL_WAIT_EXCEPT;
+    if (!ready && timed_out && (status & MYSQL_WAIT_TIMEOUT))
+	ready |= MYSQL_WAIT_TIMEOUT;
+    return ready;
+}
+
+/**
+ * Start n operations, one on each connection, and drive them until each
+ * has finished, waiting in poll() for whichever connections they wait for.
+ */
+static void async_drive(void *ops, int n, MYSQL **mysql, async_step step)
+{
+    struct pollfd pfd[ASYNC_MAX_CONNS];
+    int status[ASYNC_MAX_CONNS], slot[ASYNC_MAX_CONNS];
+    int i, k, pending, timeout, ret;
+    unsigned int ms;
+
+    for (i = 0; i < n; i++)
+	status[i] = step(ops, i, 0);
+
+    for (;;) {
+	pending = 0;
+	timeout = -1;
+	for (i = 0; i < n; i++) {
+	    if (!status[i])
+		continue;
+	    pfd[pending].fd = mysql_get_socket(mysql[i]);
+	    pfd[pending].events = async_events(status[i]);
+	    pfd[pending].revents = 0;
+	    slot[pending++] = i;
+	    if (status[i] & MYSQL_WAIT_TIMEOUT) {
+		ms = mysql_get_timeout_value_ms(mysql[i]);
+		if (timeout < 0 || ms < (unsigned int)timeout)
+		    timeout = ms;
+	    }
+	}
+	if (!pending)
+	    break;
+
+	ret = poll(pfd, pending, timeout);
+	if (ret < 0 && errno != EINTR) {
+	    log_printf(LOG_ERROR, "%s(): poll(): %s\n", __func__, strerror(errno));
+	    ret = 0;	/* let the library find out what is wrong */
+	}
+	for (k = 0; k < pending; k++) {
+	    int ready = async_ready(pfd[k].revents, status[slot[k]], ret == 0);
+
+	    if (ready)
+		status[slot[k]] = step(ops, slot[k], ready);
+	}
+    }
+}
+
+/** async_step of async_run() */
+static int async_query_step(void *ops, int i, int ready)
+{
+    struct async_query *q = (struct async_query *)ops + i;
+
+    if (!ready)
+	return mysql_real_query_start(&q->err, q->mysql, q->sql, q->len);
+    return mysql_real_query_cont(&q->err, q->mysql, ready);
+}
+
+/** async_step of async_run_stmts(): execute, then store the rows */
+static int async_stmt_step(void *ops, int i, int ready)
+{
+    struct async_stmt *s = (struct async_stmt *)ops + i;
+    int status;
+
+    if (!s->stmt)
+	return 0;		/* failed already */
+    if (!s->storing) {
+	status = ready ? mysql_stmt_execute_cont(&s->err, s->stmt, ready) :
+			 mysql_stmt_execute_start(&s->err, s->stmt);
+	if (status || s->err)
+	    return status;
+	s->storing = 1;
+	ready = 0;
+    }
+    return ready ? mysql_stmt_store_result_cont(&s->err, s->stmt, ready) :
+		   mysql_stmt_store_result_start(&s->err, s->stmt);
+}
+#endif
+
+/**
+ * Run queries that return no rows, each on a connection of its own, and
+ * wait until all have finished.  With the non-blocking API their round
+ * trips overlap; otherwise they run one after the other.  A query that
+ * fails is run again, blocking, which brings back a lost connection (see
+ * MYSQL_OPT_RECONNECT in pool.c), so the queries must be safe to repeat.
+ *
+ * @return 0 if all queries succeeded; -EIO otherwise (logged)
+ * @param q the queries, err set for each
+ * @param n number of queries, at most ASYNC_MAX_CONNS
+ */
+int async_run(struct async_query *q, int n)
+{
+    int i, ret = 0;
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    MYSQL *mysql[ASYNC_MAX_CONNS];
+#endif
+
+    for (i = 0; i < n; i++) {
+	log_printf(LOG_D_SQL, "%s(): conn=%p sql=%.*s...\n", __func__, q[i].mysql, 160, q[i].sql);
+	q[i].err = 1;
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+	mysql[i] = q[i].mysql;
+#endif
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    async_drive(q, n, mysql, async_query_step);
+#endif
+
+    for (i = 0; i < n; i++) {
+	if (q[i].err)
+	    q[i].err = mysql_real_query(q[i].mysql, q[i].sql, q[i].len);
+	if (q[i].err) {
+	    log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(q[i].mysql));
+	    ret = -EIO;
+	}
+    }
+    return ret;
+}
+
+/**
+ * Run prepared statements, each on a connection of its own, and store
+ * their rows client side, so they can be fetched without any more round
+ * trips; wait until all have finished.  With the non-blocking API their
+ * round trips overlap; otherwise they run one after the other.  Unlike
+ * async_run(), a statement that fails is left to the caller, which may
+ * have to prepare it again (see pool_stmt()).
+ *
+ * @return 0 if all statements succeeded; -EIO otherwise (logged)
+ * @param s the statements, err set for each; those that succeeded need mysql_stmt_free_result()
+ * @param n number of statements, at most ASYNC_MAX_CONNS
+ */
+int async_run_stmts(struct async_stmt *s, int n)
+{
+    int i, ret = 0;
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    MYSQL *mysql[ASYNC_MAX_CONNS];
+#endif
+
+    for (i = 0; i < n; i++) {
+	s[i].err = 1;
+	s[i].storing = 0;
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+	mysql[i] = s[i].mysql;
+#endif
+    }
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+    async_drive(s, n, mysql, async_stmt_step);
+#else
+    for (i = 0; i < n; i++)
+	if (s[i].stmt)
+	    s[i].err = mysql_stmt_execute(s[i].stmt) || mysql_stmt_store_result(s[i].stmt);
+#endif
+
+    for (i = 0; i < n; i++) {
+	if (s[i].err) {
+	    log_printf(LOG_ERROR, "%s(): %s\n", __func__,
+		       s[i].stmt ? mysql_stmt_error(s[i].stmt) : "no statement");
+	    ret = -EIO;
+	}
+    }
+    return ret;
+}
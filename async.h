@@ -0,0 +1,40 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** most connections async_run() keeps queries in flight on at once */
+#define ASYNC_MAX_CONNS	16
+
+/** One query of those async_run() runs together; see async.c */
+struct async_query {
+    MYSQL		*mysql;		/**< connection to run it on, a different one for each query */
+    char		*sql;		/**< text of the query, which returns no rows */
+    unsigned long	len;		/**< length of sql */
+    int			err;		/**< set to 0 once it succeeded, non-zero if it failed */
+};
+
+/** One prepared statement of those async_run_stmts() runs together */
+struct async_stmt {
+    MYSQL		*mysql;		/**< connection it was prepared on, a different one for each */
+    MYSQL_STMT		*stmt;		/**< the statement, its parameters bound; NULL counts as failed */
+    int			err;		/**< set to 0 once it ran and its rows are stored, non-zero if it failed */
+    int			storing;	/**< it ran, and its rows are being stored */
+};
+
+/** Non-zero if the client library can run queries without blocking, so async_run() overlaps them */
+int async_available(void);
+
+/** Set a connection up for async_run(), before it connects */
+void async_prepare(MYSQL *mysql);
+
+/** Run queries on several connections, overlapping their round trips where the client library can */
+int async_run(struct async_query *q, int n);
+
+/** Run prepared statements on several connections and store their rows, overlapping their round trips likewise */
+int async_run_stmts(struct async_stmt *s, int n);
@@ -0,0 +1,891 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mysqlfs.h"
+#include "cache.h"
+#include "log.h"
+
+/** Most hash buckets of one cache; larger caches get longer chains rather than overflow the doubling */
+#define CACHE_BUCKETS_MAX	(1U << 24)
+
+/**
+ * One directory entry in the dentry cache.  Entries live on a hash chain
+ * (looked up by parent and name) and on an LRU list (used for eviction once
+ * dcache_max entries are cached).  A negative entry, recording that a name
+ * does not exist, has an inode of -1.
+ */
+struct dcache_entry {
+    struct dcache_entry	*hnext;		/**< next entry on the same hash chain */
+    struct dcache_entry	*lru_prev,	/**< more recently used entry */
+			*lru_next;	/**< less recently used entry */
+    long		parent;		/**< inode of the directory holding the entry */
+    long		inode;		/**< inode the name resolves to, -1 if negative */
+    time_t		expires;	/**< time() after which the entry is stale */
+    char		name[];		/**< name within the parent directory */
+};
+
+static struct dcache_entry **dcache_hash = NULL;
+static unsigned int dcache_hash_mask = 0;
+static struct dcache_entry *dcache_lru_head = NULL, *dcache_lru_tail = NULL;
+static unsigned int dcache_cnt = 0;
+static unsigned int dcache_max = 0;
+static unsigned int dcache_ttl = 0;
+static pthread_mutex_t dcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** FNV-1a over the parent inode and the name */
+static unsigned int dcache_hashfn(long parent, const char *name)
+{
+    unsigned int h = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(parent); i++) {
+	h ^= (parent >> (i * 8)) & 0xff;
+	h *= 16777619u;
+    }
+    while (*name) {
+	h ^= (unsigned char)*name++;
+	h *= 16777619u;
+    }
+
+    return h & dcache_hash_mask;
+}
+
+static void dcache_lru_unlink(struct dcache_entry *ent)
+{
+    if (ent->lru_prev)
+	ent->lru_prev->lru_next = ent->lru_next;
+    else
+	dcache_lru_head = ent->lru_next;
+    if (ent->lru_next)
+	ent->lru_next->lru_prev = ent->lru_prev;
+    else
+	dcache_lru_tail = ent->lru_prev;
+    ent->lru_prev = ent->lru_next = NULL;
+}
+
+static void dcache_lru_push(struct dcache_entry *ent)
+{
+    ent->lru_prev = NULL;
+    ent->lru_next = dcache_lru_head;
+    if (dcache_lru_head)
+	dcache_lru_head->lru_prev = ent;
+    dcache_lru_head = ent;
+    if (!dcache_lru_tail)
+	dcache_lru_tail = ent;
+}
+
+/** Find the hash slot pointing at the entry for (parent, name).  Caller holds dcache_mutex. */
+static struct dcache_entry **dcache_find(long parent, const char *name)
+{
+    struct dcache_entry **pp = &dcache_hash[dcache_hashfn(parent, name)];
+
+    while (*pp) {
+	if ((*pp)->parent == parent && !strcmp((*pp)->name, name))
+	    break;
+	pp = &(*pp)->hnext;
+    }
+
+    return pp;
+}
+
+/** Unhash and free the entry *pp points to.  Caller holds dcache_mutex. */
+static void dcache_drop(struct dcache_entry **pp)
+{
+    struct dcache_entry *ent = *pp;
+
+    *pp = ent->hnext;
+    dcache_lru_unlink(ent);
+    dcache_cnt--;
+    free(ent);
+}
+
+static void dcache_store(long parent, const char *name, long inode, unsigned int ttl)
+{
+    struct dcache_entry **pp, *ent;
+    size_t len;
+
+    if (!dcache_hash)
+	return;
+
+    len = strlen(name);
+    pthread_mutex_lock(&dcache_mutex);
+    pp = dcache_find(parent, name);
+    if ((ent = *pp) != NULL) {
+	dcache_lru_unlink(ent);
+    } else {
+	if (dcache_cnt >= dcache_max)
+	    dcache_drop(dcache_find(dcache_lru_tail->parent, dcache_lru_tail->name));
+
+	ent = malloc(sizeof(struct dcache_entry) + len + 1);
+	if (!ent) {
+	    pthread_mutex_unlock(&dcache_mutex);
+	    return;
+	}
+	ent->parent = parent;
+	memcpy(ent->name, name, len + 1);
+	/* eviction may have changed the chain, so look up the slot again */
+	pp = dcache_find(parent, name);
+	ent->hnext = NULL;
+	*pp = ent;
+	dcache_cnt++;
+    }
+    ent->inode = inode;
+    ent->expires = time(NULL) + ttl;
+    dcache_lru_push(ent);
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+/**
+ * Initialize the dentry cache.  The cache maps a (parent inode, name) pair
+ * to the inode it resolves to, so query_inode_full() can walk a path without
+ * asking the database for components it has already seen.  Entries expire
+ * after ttl seconds so that changes made by other mounts of the same
+ * database are picked up eventually, much like the kernel's entry_timeout.
+ *
+ * @return 0 on success, -ENOMEM if the hash table could not be allocated
+ * @param max_entries maximum number of cached entries; 0 disables the cache
+ * @param ttl seconds a positive entry stays valid
+ */
+int dcache_init(unsigned int max_entries, unsigned int ttl)
+{
+    unsigned int buckets = 1;
+
+    dcache_max = max_entries;
+    dcache_ttl = ttl;
+    if (!max_entries || !ttl)
+	return 0;
+
+    while (buckets < max_entries && buckets < CACHE_BUCKETS_MAX)
+	buckets <<= 1;
+
+    dcache_hash = calloc(buckets, sizeof(struct dcache_entry *));
+    if (!dcache_hash)
+	return -ENOMEM;
+    dcache_hash_mask = buckets - 1;
+
+    log_printf(LOG_D_OTHER, "%s(): %u entries, %u buckets, ttl=%u\n",
+	       __func__, max_entries, buckets, ttl);
+    return 0;
+}
+
+void dcache_cleanup(void)
+{
+    pthread_mutex_lock(&dcache_mutex);
+    while (dcache_lru_head)
+	dcache_drop(dcache_find(dcache_lru_head->parent, dcache_lru_head->name));
+    free(dcache_hash);
+    dcache_hash = NULL;
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+/**
+ * Look up a name in the dentry cache.  Expired entries are dropped and
+ * reported as a miss.
+ *
+ * @return 1 if found, with the inode stored in *inode
+ * @return 0 if nothing is known about the name
+ * @return -ENOENT if the name is known not to exist
+ * @param parent inode of the directory holding the entry
+ * @param name name of the entry within the directory
+ * @param inode where to store the inode on a hit
+ */
+int dcache_lookup(long parent, const char *name, long *inode)
+{
+    struct dcache_entry **pp, *ent;
+    int ret = 0;
+
+    if (!dcache_hash)
+	return 0;
+
+    pthread_mutex_lock(&dcache_mutex);
+    pp = dcache_find(parent, name);
+    if ((ent = *pp) != NULL) {
+	if (ent->expires < time(NULL)) {
+	    dcache_drop(pp);
+	} else if (ent->inode < 0) {
+	    ret = -ENOENT;
+	} else {
+	    *inode = ent->inode;
+	    dcache_lru_unlink(ent);
+	    dcache_lru_push(ent);
+	    ret = 1;
+	}
+    }
+    pthread_mutex_unlock(&dcache_mutex);
+
+    return ret;
+}
+
+void dcache_enter(long parent, const char *name, long inode)
+{
+    dcache_store(parent, name, inode, dcache_ttl);
+}
+
+void dcache_enter_negative(long parent, const char *name)
+{
+    dcache_store(parent, name, -1, MIN(dcache_ttl, DCACHE_NEGATIVE_TTL));
+}
+
+void dcache_invalidate(long parent, const char *name)
+{
+    struct dcache_entry **pp;
+
+    if (!dcache_hash)
+	return;
+
+    pthread_mutex_lock(&dcache_mutex);
+    pp = dcache_find(parent, name);
+    if (*pp)
+	dcache_drop(pp);
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+/**
+ * Cached attributes of one inode.  Like struct dcache_entry, entries are
+ * hashed (by inode) and kept on an LRU list for eviction.
+ */
+struct acache_entry {
+    struct acache_entry	*hnext;		/**< next entry on the same hash chain */
+    struct acache_entry	*lru_prev,	/**< more recently used entry */
+			*lru_next;	/**< less recently used entry */
+    long		inode;		/**< inode the attributes belong to */
+    time_t		expires;	/**< time() after which the entry is stale */
+    struct stat		st;		/**< attributes as query_getattr() returns them */
+};
+
+static struct acache_entry **acache_hash = NULL;
+static unsigned int acache_hash_mask = 0;
+static struct acache_entry *acache_lru_head = NULL, *acache_lru_tail = NULL;
+static unsigned int acache_cnt = 0;
+static unsigned int acache_max = 0;
+static unsigned int acache_ttl = 0;
+static pthread_mutex_t acache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void acache_lru_unlink(struct acache_entry *ent)
+{
+    if (ent->lru_prev)
+	ent->lru_prev->lru_next = ent->lru_next;
+    else
+	acache_lru_head = ent->lru_next;
+    if (ent->lru_next)
+	ent->lru_next->lru_prev = ent->lru_prev;
+    else
+	acache_lru_tail = ent->lru_prev;
+    ent->lru_prev = ent->lru_next = NULL;
+}
+
+static void acache_lru_push(struct acache_entry *ent)
+{
+    ent->lru_prev = NULL;
+    ent->lru_next = acache_lru_head;
+    if (acache_lru_head)
+	acache_lru_head->lru_prev = ent;
+    acache_lru_head = ent;
+    if (!acache_lru_tail)
+	acache_lru_tail = ent;
+}
+
+/** Find the hash slot pointing at the entry for inode.  Caller holds acache_mutex. */
+static struct acache_entry **acache_find(long inode)
+{
+    struct acache_entry **pp = &acache_hash[(unsigned long)inode & acache_hash_mask];
+
+    while (*pp && (*pp)->inode != inode)
+	pp = &(*pp)->hnext;
+
+    return pp;
+}
+
+/** Unhash and free the entry *pp points to.  Caller holds acache_mutex. */
+static void acache_drop(struct acache_entry **pp)
+{
+    struct acache_entry *ent = *pp;
+
+    *pp = ent->hnext;
+    acache_lru_unlink(ent);
+    acache_cnt--;
+    free(ent);
+}
+
+/**
+ * Initialize the attribute cache.  query_getattr() consults it before going
+ * to the database, and the query functions that change an inode update the
+ * cached copy in place through acache_update() rather than dropping it.  As
+ * with the dentry cache, entries expire after ttl seconds to pick up changes
+ * made by other mounts.
+ *
+ * @return 0 on success, -ENOMEM if the hash table could not be allocated
+ * @param max_entries maximum number of cached inodes; 0 disables the cache
+ * @param ttl seconds an entry stays valid
+ */
+int acache_init(unsigned int max_entries, unsigned int ttl)
+{
+    unsigned int buckets = 1;
+
+    acache_max = max_entries;
+    acache_ttl = ttl;
+    if (!max_entries || !ttl)
+	return 0;
+
+    while (buckets < max_entries && buckets < CACHE_BUCKETS_MAX)
+	buckets <<= 1;
+
+    acache_hash = calloc(buckets, sizeof(struct acache_entry *));
+    if (!acache_hash)
+	return -ENOMEM;
+    acache_hash_mask = buckets - 1;
+
+    log_printf(LOG_D_OTHER, "%s(): %u entries, %u buckets, ttl=%u\n",
+	       __func__, max_entries, buckets, ttl);
+    return 0;
+}
+
+void acache_cleanup(void)
+{
+    pthread_mutex_lock(&acache_mutex);
+    while (acache_lru_head)
+	acache_drop(acache_find(acache_lru_head->inode));
+    free(acache_hash);
+    acache_hash = NULL;
+    pthread_mutex_unlock(&acache_mutex);
+}
+
+int acache_lookup(long inode, struct stat *stbuf)
+{
+    struct acache_entry **pp, *ent;
+    int ret = 0;
+
+    if (!acache_hash)
+	return 0;
+
+    pthread_mutex_lock(&acache_mutex);
+    pp = acache_find(inode);
+    if ((ent = *pp) != NULL) {
+	if (ent->expires < time(NULL)) {
+	    acache_drop(pp);
+	} else {
+	    memcpy(stbuf, &ent->st, sizeof(struct stat));
+	    acache_lru_unlink(ent);
+	    acache_lru_push(ent);
+	    ret = 1;
+	}
+    }
+    pthread_mutex_unlock(&acache_mutex);
+
+    return ret;
+}
+
+void acache_enter(long inode, const struct stat *stbuf)
+{
+    struct acache_entry **pp, *ent;
+
+    if (!acache_hash)
+	return;
+
+    pthread_mutex_lock(&acache_mutex);
+    pp = acache_find(inode);
+    if ((ent = *pp) != NULL) {
+	acache_lru_unlink(ent);
+    } else {
+	if (acache_cnt >= acache_max)
+	    acache_drop(acache_find(acache_lru_tail->inode));
+
+	ent = malloc(sizeof(struct acache_entry));
+	if (!ent) {
+	    pthread_mutex_unlock(&acache_mutex);
+	    return;
+	}
+	ent->inode = inode;
+	pp = acache_find(inode);
+	ent->hnext = NULL;
+	*pp = ent;
+	acache_cnt++;
+    }
+    memcpy(&ent->st, stbuf, sizeof(struct stat));
+    ent->expires = time(NULL) + acache_ttl;
+    acache_lru_push(ent);
+    pthread_mutex_unlock(&acache_mutex);
+}
+
+/**
+ * Apply a change the caller has just made in the database to the cached
+ * attributes of an inode, so the next getattr does not have to refetch them.
+ * The expiry time is left alone: the entry is no more trustworthy than it was.
+ *
+ * @param inode inode that was changed
+ * @param fields bitmask of enum acache_fields saying which members of stbuf to copy
+ * @param stbuf new values
+ */
+void acache_update(long inode, int fields, const struct stat *stbuf)
+{
+    struct acache_entry *ent;
+
+    if (!acache_hash)
+	return;
+
+    pthread_mutex_lock(&acache_mutex);
+    if ((ent = *acache_find(inode)) != NULL) {
+	if (fields & ACACHE_MODE)
+	    ent->st.st_mode = stbuf->st_mode;
+	if (fields & ACACHE_UID)
+	    ent->st.st_uid = stbuf->st_uid;
+	if (fields & ACACHE_GID)
+	    ent->st.st_gid = stbuf->st_gid;
+	if (fields & ACACHE_ATIME)
+	    ent->st.st_atime = stbuf->st_atime;
+	if (fields & ACACHE_MTIME)
+	    ent->st.st_mtime = stbuf->st_mtime;
+	if (fields & ACACHE_CTIME)
+	    ent->st.st_ctime = stbuf->st_ctime;
+	if (fields & ACACHE_SIZE)
+	    ent->st.st_size = stbuf->st_size;
+	if ((fields & ACACHE_SIZE_GROW) && stbuf->st_size > ent->st.st_size)
+	    ent->st.st_size = stbuf->st_size;
+    }
+    pthread_mutex_unlock(&acache_mutex);
+}
+
+void acache_invalidate(long inode)
+{
+    struct acache_entry **pp;
+
+    if (!acache_hash)
+	return;
+
+    pthread_mutex_lock(&acache_mutex);
+    pp = acache_find(inode);
+    if (*pp)
+	acache_drop(pp);
+    pthread_mutex_unlock(&acache_mutex);
+}
+
+/** number of independently locked parts of the block cache */
+#define BCACHE_SHARDS	16
+
+/** queues of the 2Q replacement policy; see bcache_enter() */
+enum bcache_queue {
+    BCACHE_A1IN,	/**< blocks seen once recently, first in first out */
+    BCACHE_AM,		/**< blocks seen again after leaving A1in, least recently used first out */
+    BCACHE_A1OUT,	/**< ghosts: keys recently pushed out of A1in, without data */
+    BCACHE_QUEUES
+};
+
+/**
+ * One data block in the block cache.  Like the other caches, entries are
+ * hashed by their key; each is also on exactly one of the 2Q queues.
+ */
+struct bcache_entry {
+    struct bcache_entry	*hnext;		/**< next entry on the same hash chain */
+    struct bcache_entry	*prev,		/**< entry nearer the head of the queue */
+			*next;		/**< entry nearer the tail of the queue */
+    long		inode;		/**< inode the block belongs to */
+    unsigned long	seq;		/**< sequence number of the block */
+    enum bcache_queue	queue;		/**< queue the entry is on */
+    time_t		expires;	/**< time() after which the data is stale */
+    size_t		len;		/**< valid bytes in data */
+    char		*data;		/**< data_block_size bytes; NULL for a ghost */
+};
+
+/** One shard of the block cache, with its own lock, hash table and queues */
+struct bcache_shard {
+    pthread_mutex_t	lock;		/**< protects everything in the shard */
+    struct bcache_entry	**hash;		/**< hash chains */
+    struct bcache_entry	*head[BCACHE_QUEUES],	/**< most recently queued entry */
+			*tail[BCACHE_QUEUES];	/**< next entry to leave the queue */
+    unsigned int	cnt[BCACHE_QUEUES];	/**< entries on the queue */
+};
+
+static struct bcache_shard bcache_shards[BCACHE_SHARDS];
+static int bcache_enabled = 0;
+static unsigned int bcache_hash_mask = 0;
+static unsigned int bcache_max = 0;		/**< blocks with data per shard */
+static unsigned int bcache_max_in = 0;		/**< A1in length beyond which it gives up blocks first */
+static unsigned int bcache_max_out = 0;		/**< ghosts per shard */
+static unsigned int bcache_ttl = 0;
+static unsigned long bcache_hits = 0, bcache_misses = 0;
+
+/** number of generation counters, each shared by the inodes hashing to it; see bcache_generation() */
+#define BCACHE_GENS	256
+
+static unsigned long bcache_gens[BCACHE_GENS];
+
+static unsigned long bcache_hashfn(long inode, unsigned long seq)
+{
+    unsigned long h = (unsigned long)inode * 2654435761u + seq;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct bcache_shard *bcache_shard(unsigned long h)
+{
+    return &bcache_shards[h % BCACHE_SHARDS];
+}
+
+static void bcache_unlink(struct bcache_shard *sh, struct bcache_entry *ent)
+{
+    if (ent->prev)
+	ent->prev->next = ent->next;
+    else
+	sh->head[ent->queue] = ent->next;
+    if (ent->next)
+	ent->next->prev = ent->prev;
+    else
+	sh->tail[ent->queue] = ent->prev;
+    ent->prev = ent->next = NULL;
+    sh->cnt[ent->queue]--;
+}
+
+static void bcache_push(struct bcache_shard *sh, struct bcache_entry *ent,
+			enum bcache_queue queue)
+{
+    ent->queue = queue;
+    ent->prev = NULL;
+    ent->next = sh->head[queue];
+    if (sh->head[queue])
+	sh->head[queue]->prev = ent;
+    sh->head[queue] = ent;
+    if (!sh->tail[queue])
+	sh->tail[queue] = ent;
+    sh->cnt[queue]++;
+}
+
+/** Find the hash slot pointing at the entry for (inode, seq).  Caller holds sh->lock. */
+static struct bcache_entry **bcache_find(struct bcache_shard *sh, unsigned long h,
+					 long inode, unsigned long seq)
+{
+    struct bcache_entry **pp = &sh->hash[(h / BCACHE_SHARDS) & bcache_hash_mask];
+
+    while (*pp && ((*pp)->inode != inode || (*pp)->seq != seq))
+	pp = &(*pp)->hnext;
+
+    return pp;
+}
+
+/** Unhash, dequeue and free an entry.  Caller holds sh->lock. */
+static void bcache_drop(struct bcache_shard *sh, struct bcache_entry *ent)
+{
+    struct bcache_entry **pp;
+
+    pp = bcache_find(sh, bcache_hashfn(ent->inode, ent->seq), ent->inode, ent->seq);
+    *pp = ent->hnext;
+    bcache_unlink(sh, ent);
+    free(ent->data);
+    free(ent);
+}
+
+/**
+ * Take the data buffer of the block that has to go to make room for a new
+ * one.  A1in gives up its oldest block while it is over its share, leaving
+ * the key behind as a ghost on A1out; otherwise the least recently used
+ * block of Am is dropped.  Caller holds sh->lock.
+ *
+ * @return a data_block_size buffer for the caller to reuse
+ */
+static char *bcache_reclaim(struct bcache_shard *sh)
+{
+    struct bcache_entry *ent;
+    char *data;
+
+    if (sh->cnt[BCACHE_A1IN] > bcache_max_in || !sh->tail[BCACHE_AM]) {
+	ent = sh->tail[BCACHE_A1IN];
+	data = ent->data;
+	ent->data = NULL;
+	bcache_unlink(sh, ent);
+	bcache_push(sh, ent, BCACHE_A1OUT);
+	if (sh->cnt[BCACHE_A1OUT] > bcache_max_out)
+	    bcache_drop(sh, sh->tail[BCACHE_A1OUT]);
+    } else {
+	ent = sh->tail[BCACHE_AM];
+	data = ent->data;
+	ent->data = NULL;
+	bcache_drop(sh, ent);
+    }
+
+    return data;
+}
+
+/**
+ * Initialize the block cache.  query_read() serves data blocks from it
+ * before asking the database, and query_write() / query_truncate() drop
+ * the blocks they change.  The cache is split into BCACHE_SHARDS shards by
+ * key so concurrent readers rarely contend for a lock, and each shard is
+ * managed with the 2Q policy: a block read once only displaces other
+ * blocks read once, so a large sequential scan cannot flush out a working
+ * set that is read over and over.  As with the other caches, blocks expire
+ * after ttl seconds to pick up changes made by other mounts.
+ *
+ * @return 0 on success, -ENOMEM if the hash tables could not be allocated
+ * @param max_blocks maximum number of cached blocks; 0 disables the cache
+ * @param ttl seconds a cached block stays valid
+ */
+int bcache_init(unsigned int max_blocks, unsigned int ttl)
+{
+    unsigned int buckets = 1;
+    int i;
+
+    if (!max_blocks || !ttl)
+	return 0;
+
+    bcache_max = MAX(max_blocks / BCACHE_SHARDS, 4);
+    bcache_max_in = bcache_max / 4;
+    bcache_max_out = bcache_max / 2;
+    bcache_ttl = ttl;
+
+    while (buckets < bcache_max + bcache_max_out && buckets < CACHE_BUCKETS_MAX)
+	buckets <<= 1;
+    bcache_hash_mask = buckets - 1;
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	memset(&bcache_shards[i], 0, sizeof(struct bcache_shard));
+	pthread_mutex_init(&bcache_shards[i].lock, NULL);
+	bcache_shards[i].hash = calloc(buckets, sizeof(struct bcache_entry *));
+	if (!bcache_shards[i].hash) {
+	    while (i-- > 0)
+		free(bcache_shards[i].hash);
+	    return -ENOMEM;
+	}
+    }
+    bcache_enabled = 1;
+
+    log_printf(LOG_D_OTHER, "%s(): %u shards of %u blocks, %u buckets, ttl=%u\n",
+	       __func__, BCACHE_SHARDS, bcache_max, buckets, ttl);
+    return 0;
+}
+
+void bcache_cleanup(void)
+{
+    struct bcache_shard *sh;
+    int i, q;
+
+    if (!bcache_enabled)
+	return;
+
+    log_printf(LOG_INFO, "block cache: %lu hits, %lu misses\n",
+	       bcache_hits, bcache_misses);
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	sh = &bcache_shards[i];
+	pthread_mutex_lock(&sh->lock);
+	for (q = 0; q < BCACHE_QUEUES; q++)
+	    while (sh->head[q])
+		bcache_drop(sh, sh->head[q]);
+	free(sh->hash);
+	sh->hash = NULL;
+	pthread_mutex_unlock(&sh->lock);
+    }
+    bcache_enabled = 0;
+}
+
+/**
+ * Look up a data block.  A hit on Am makes the block the most recently
+ * used; a hit on A1in leaves it where it is, as 2Q only promotes blocks
+ * that are asked for again after they left A1in.
+ *
+ * @return length of the block, copied to buf, if cached
+ * @return -1 if not
+ * @param inode inode the block belongs to
+ * @param seq sequence number of the block
+ * @param buf where to copy the block, data_block_size bytes
+ */
+int bcache_lookup(long inode, unsigned long seq, char *buf)
+{
+    unsigned long h;
+    struct bcache_shard *sh;
+    struct bcache_entry **pp, *ent;
+    int ret = -1;
+
+    if (!bcache_enabled)
+	return -1;
+
+    h = bcache_hashfn(inode, seq);
+    sh = bcache_shard(h);
+    pthread_mutex_lock(&sh->lock);
+    pp = bcache_find(sh, h, inode, seq);
+    if ((ent = *pp) != NULL && ent->data) {
+	if (ent->expires < time(NULL)) {
+	    bcache_drop(sh, ent);
+	} else {
+	    memcpy(buf, ent->data, ent->len);
+	    ret = ent->len;
+	    if (ent->queue == BCACHE_AM) {
+		bcache_unlink(sh, ent);
+		bcache_push(sh, ent, BCACHE_AM);
+	    }
+	}
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    if (ret < 0)
+	__sync_fetch_and_add(&bcache_misses, 1);
+    else
+	__sync_fetch_and_add(&bcache_hits, 1);
+
+    return ret;
+}
+
+/**
+ * The generation of the blocks of an inode, which bcache_invalidate()
+ * moves on.  A reader takes it before it reads blocks from the database,
+ * and hands it to bcache_enter(), which drops the blocks if a write
+ * invalidated them in between: the reader may have got the old rows.
+ *
+ * @return the generation
+ * @param inode inode the blocks belong to
+ */
+unsigned long bcache_generation(long inode)
+{
+    return __sync_fetch_and_add(&bcache_gens[(unsigned long)inode % BCACHE_GENS], 0);
+}
+
+/**
+ * Cache a data block just read from the database.  A block whose key is
+ * still remembered on A1out goes straight to Am, anything else new starts
+ * on A1in.  Nothing is cached if the blocks of the inode have been
+ * invalidated since the read began.
+ *
+ * @param inode inode the block belongs to
+ * @param seq sequence number of the block
+ * @param data contents of the block
+ * @param len length of the block, at most data_block_size
+ * @param gen bcache_generation() of the inode before the block was read
+ */
+void bcache_enter(long inode, unsigned long seq, const char *data, size_t len,
+		  unsigned long gen)
+{
+    unsigned long h;
+    struct bcache_shard *sh;
+    struct bcache_entry **pp, *ent;
+    enum bcache_queue queue = BCACHE_A1IN;
+    char *buf = NULL;
+
+    if (!bcache_enabled || len > data_block_size)
+	return;
+
+    h = bcache_hashfn(inode, seq);
+    sh = bcache_shard(h);
+    pthread_mutex_lock(&sh->lock);
+    /* Under the lock: bcache_invalidate() moves the generation on before it takes it */
+    if (bcache_generation(inode) != gen) {
+	pthread_mutex_unlock(&sh->lock);
+	return;
+    }
+    pp = bcache_find(sh, h, inode, seq);
+    if ((ent = *pp) != NULL) {
+	if (ent->data) {
+	    buf = ent->data;
+	    queue = ent->queue;
+	} else {
+	    queue = BCACHE_AM;
+	}
+	bcache_unlink(sh, ent);
+    }
+
+    if (!buf && sh->cnt[BCACHE_A1IN] + sh->cnt[BCACHE_AM] >= bcache_max)
+	buf = bcache_reclaim(sh);
+    if (!buf)
+	buf = malloc(data_block_size);
+
+    if (!ent && buf) {
+	ent = calloc(1, sizeof(struct bcache_entry));
+	if (ent) {
+	    ent->inode = inode;
+	    ent->seq = seq;
+	    /* reclaiming may have changed the chain, so look up the slot again */
+	    pp = bcache_find(sh, h, inode, seq);
+	    *pp = ent;
+	}
+    }
+
+    if (!ent || !buf) {
+	if (ent) {
+	    /* out of memory: keep the ghost, it costs no data */
+	    bcache_push(sh, ent, BCACHE_A1OUT);
+	}
+	free(buf);
+	pthread_mutex_unlock(&sh->lock);
+	return;
+    }
+
+    ent->data = buf;
+    memcpy(ent->data, data, len);
+    ent->len = len;
+    ent->expires = time(NULL) + bcache_ttl;
+    bcache_push(sh, ent, queue);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/**
+ * Forget a range of blocks of an inode, because they are about to change.
+ * Short ranges are looked up block by block; long ones, such as everything
+ * past a truncation point, by walking the queues of every shard.
+ *
+ * @param inode inode the blocks belong to
+ * @param first sequence number of the first block to forget
+ * @param last sequence number of the last block to forget; BCACHE_TO_END for all following
+ */
+void bcache_invalidate(long inode, unsigned long first, unsigned long last)
+{
+    unsigned long h, seq;
+    struct bcache_shard *sh;
+    struct bcache_entry *ent, *next;
+    int i, q;
+
+    if (!bcache_enabled)
+	return;
+
+    /* Readers that began before now must not enter what they read */
+    __sync_fetch_and_add(&bcache_gens[(unsigned long)inode % BCACHE_GENS], 1);
+
+    if (last - first < 4 * BCACHE_SHARDS) {
+	for (seq = first; seq <= last; seq++) {
+	    h = bcache_hashfn(inode, seq);
+	    sh = bcache_shard(h);
+	    pthread_mutex_lock(&sh->lock);
+	    if ((ent = *bcache_find(sh, h, inode, seq)) != NULL)
+		bcache_drop(sh, ent);
+	    pthread_mutex_unlock(&sh->lock);
+	}
+	return;
+    }
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	sh = &bcache_shards[i];
+	pthread_mutex_lock(&sh->lock);
+	for (q = 0; q < BCACHE_QUEUES; q++) {
+	    for (ent = sh->head[q]; ent; ent = next) {
+		next = ent->next;
+		if (ent->inode == inode && ent->seq >= first && ent->seq <= last)
+		    bcache_drop(sh, ent);
+	    }
+	}
+	pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void bcache_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = bcache_hits;
+    *misses = bcache_misses;
+}
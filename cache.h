@@ -0,0 +1,88 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** parent key under which the root directory ("/") is cached; tree.inode starts at 1 so 0 is never a real parent */
+#define DCACHE_ROOT_PARENT	0
+
+/** lifetime in seconds of a negative entry; also how long mysqlfs_lookup() lets the kernel remember a miss */
+#define DCACHE_NEGATIVE_TTL	10
+
+/** Initialize the (parent, name) -> inode cache; max_entries == 0 disables it */
+int dcache_init(unsigned int max_entries, unsigned int ttl);
+
+/** Drop all entries and release the cache */
+void dcache_cleanup(void);
+
+/** Look up a name in a directory: 1 on hit, 0 on miss, -ENOENT on negative hit */
+int dcache_lookup(long parent, const char *name, long *inode);
+
+/** Record that name in parent resolves to inode */
+void dcache_enter(long parent, const char *name, long inode);
+
+/** Record that name does not exist in parent */
+void dcache_enter_negative(long parent, const char *name);
+
+/** Forget whatever is known about name in parent */
+void dcache_invalidate(long parent, const char *name);
+
+/** fields of the cached struct stat that acache_update() should overwrite */
+enum acache_fields {
+    ACACHE_MODE		= 0x0001,	/**< st_mode */
+    ACACHE_UID		= 0x0002,	/**< st_uid */
+    ACACHE_GID		= 0x0004,	/**< st_gid */
+    ACACHE_ATIME	= 0x0008,	/**< st_atime */
+    ACACHE_MTIME	= 0x0010,	/**< st_mtime */
+    ACACHE_CTIME	= 0x0020,	/**< st_ctime */
+    ACACHE_SIZE		= 0x0040,	/**< st_size, set as given */
+    ACACHE_SIZE_GROW	= 0x0080,	/**< st_size, only if the given size is larger */
+};
+
+/** Initialize the inode -> struct stat cache; max_entries == 0 disables it */
+int acache_init(unsigned int max_entries, unsigned int ttl);
+
+/** Drop all entries and release the cache */
+void acache_cleanup(void);
+
+/** Copy the cached attributes of inode to stbuf: 1 on hit, 0 on miss */
+int acache_lookup(long inode, struct stat *stbuf);
+
+/** Cache the attributes of inode */
+void acache_enter(long inode, const struct stat *stbuf);
+
+/** Update the given fields of a cached inode in place; no-op if not cached */
+void acache_update(long inode, int fields, const struct stat *stbuf);
+
+/** Forget the attributes of inode */
+void acache_invalidate(long inode);
+
+/** last block number for bcache_invalidate() that means "through the end of the file" */
+#define BCACHE_TO_END	(~0UL)
+
+/** Initialize the (inode, seq) -> data block cache; max_blocks == 0 disables it */
+int bcache_init(unsigned int max_blocks, unsigned int ttl);
+
+/** Drop all blocks, log the hit rate and release the cache */
+void bcache_cleanup(void);
+
+/** Copy a cached block to buf (data_block_size bytes): its length on hit, -1 on miss */
+int bcache_lookup(long inode, unsigned long seq, char *buf);
+
+/** Generation of the blocks of inode, taken before reading them for bcache_enter() */
+unsigned long bcache_generation(long inode);
+
+/** Cache len bytes of block seq of inode, read since generation gen */
+void bcache_enter(long inode, unsigned long seq, const char *data, size_t len,
+		  unsigned long gen);
+
+/** Forget blocks first to last (inclusive) of inode */
+void bcache_invalidate(long inode, unsigned long first, unsigned long last);
+
+/** Report the number of lookups that hit and missed so far */
+void bcache_stats(unsigned long *hits, unsigned long *misses);
@@ -0,0 +1,213 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file
+ *
+ * Block compression codecs.  Each is compiled in only if configure found its
+ * library; a database may hold blocks of any codec, but only those compiled
+ * in can be read (see query_read()).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+
+static const char *codec_names[CODEC_MAX] = {
+    [CODEC_NONE] = "none",
+    [CODEC_LZ4] = "lz4",
+    [CODEC_ZSTD] = "zstd",
+};
+
+#ifdef HAVE_LIBZSTD
+/* One compression and one decompression context per thread, freed with it:
+ * setting up a context costs more than compressing a small block */
+static pthread_key_t zstd_cctx_key, zstd_dctx_key;
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+
+static void zstd_free_cctx(void *cctx)
+{
+    ZSTD_freeCCtx(cctx);
+}
+
+static void zstd_free_dctx(void *dctx)
+{
+    ZSTD_freeDCtx(dctx);
+}
+
+static void zstd_keys(void)
+{
+    pthread_key_create(&zstd_cctx_key, zstd_free_cctx);
+    pthread_key_create(&zstd_dctx_key, zstd_free_dctx);
+}
+
+static ZSTD_CCtx *zstd_cctx(void)
+{
+    ZSTD_CCtx *cctx;
+
+    pthread_once(&zstd_once, zstd_keys);
+    if ((cctx = pthread_getspecific(zstd_cctx_key)) == NULL &&
+        (cctx = ZSTD_createCCtx()) != NULL)
+        pthread_setspecific(zstd_cctx_key, cctx);
+    return cctx;
+}
+
+static ZSTD_DCtx *zstd_dctx(void)
+{
+    ZSTD_DCtx *dctx;
+
+    pthread_once(&zstd_once, zstd_keys);
+    if ((dctx = pthread_getspecific(zstd_dctx_key)) == NULL &&
+        (dctx = ZSTD_createDCtx()) != NULL)
+        pthread_setspecific(zstd_dctx_key, dctx);
+    return dctx;
+}
+#endif
+
+/**
+ * Find a codec by name.
+ *
+ * @return the codec; -1 if there is none of that name
+ * @param name "none", "lz4" or "zstd"
+ */
+int codec_lookup(const char *name)
+{
+    int codec;
+
+    for (codec = 0; codec < CODEC_MAX; codec++)
+        if (!strcmp(name, codec_names[codec]))
+            return codec;
+    return -1;
+}
+
+/** Name of a codec, for messages */
+const char *codec_name(int codec)
+{
+    return codec >= 0 && codec < CODEC_MAX ? codec_names[codec] : "unknown";
+}
+
+/** Whether a codec was compiled in */
+int codec_available(int codec)
+{
+    switch (codec) {
+    case CODEC_NONE:
+        return 1;
+#ifdef HAVE_LIBLZ4
+    case CODEC_LZ4:
+        return 1;
+#endif
+#ifdef HAVE_LIBZSTD
+    case CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Compress a block.  Data that does not get smaller is not worth decoding
+ * on every read, so the result only counts if it is shorter than the input.
+ *
+ * @return length of the compressed data in dst; 0 if it is not shorter than len, or on error
+ * @param codec codec to use
+ * @param src data to compress
+ * @param len length of src
+ * @param dst where to put the compressed data
+ * @param dst_len room at dst; compression gives up beyond it
+ */
+size_t codec_compress(int codec, const char *src, size_t len, char *dst, size_t dst_len)
+{
+    size_t ret = 0;
+
+    if (len == 0)
+        return 0;
+    dst_len = dst_len < len ? dst_len : len - 1;
+
+    switch (codec) {
+#ifdef HAVE_LIBLZ4
+    case CODEC_LZ4:
+        ret = LZ4_compress_default(src, dst, len, dst_len);
+        break;
+#endif
+#ifdef HAVE_LIBZSTD
+    case CODEC_ZSTD: {
+        ZSTD_CCtx *cctx = zstd_cctx();
+
+        if (!cctx)
+            return 0;
+        ret = ZSTD_compressCCtx(cctx, dst, dst_len, src, len, ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(ret))
+            ret = 0;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    return ret < len ? ret : 0;
+}
+
+/**
+ * Decompress a block.
+ *
+ * @return length of the data in dst; -1 if the codec is not compiled in or the data is corrupt
+ * @param codec codec the data was compressed with
+ * @param src compressed data
+ * @param len length of src
+ * @param dst where to put the data
+ * @param dst_len room at dst
+ */
+long codec_decompress(int codec, const char *src, size_t len, char *dst, size_t dst_len)
+{
+    long ret = -1;
+
+    switch (codec) {
+    case CODEC_NONE:
+        if (len > dst_len)
+            return -1;
+        memcpy(dst, src, len);
+        ret = len;
+        break;
+#ifdef HAVE_LIBLZ4
+    case CODEC_LZ4:
+        ret = LZ4_decompress_safe(src, dst, len, dst_len);
+        if (ret < 0)
+            ret = -1;
+        break;
+#endif
+#ifdef HAVE_LIBZSTD
+    case CODEC_ZSTD: {
+        ZSTD_DCtx *dctx = zstd_dctx();
+        size_t n;
+
+        if (!dctx)
+            return -1;
+        n = ZSTD_decompressDCtx(dctx, dst, dst_len, src, len);
+        ret = ZSTD_isError(n) ? -1 : (long)n;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    return ret;
+}
@@ -0,0 +1,23 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** How the data of a data_blocks row is encoded; stored in its codec column, so never renumber */
+enum codec_id {
+    CODEC_NONE = 0,		/**< raw bytes */
+    CODEC_LZ4 = 1,		/**< LZ4 block format */
+    CODEC_ZSTD = 2,		/**< Zstandard frame */
+    CODEC_MAX
+};
+
+int codec_lookup(const char *name);
+const char *codec_name(int codec);
+int codec_available(int codec);
+size_t codec_compress(int codec, const char *src, size_t len, char *dst, size_t dst_len);
+long codec_decompress(int codec, const char *src, size_t len, char *dst, size_t dst_len);
@@ -0,0 +1,242 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "fsck.h"
+#include "log.h"
+
+/** Inodes checked by one batch of statements (see query_fsck_range()) */
+#define FSCK_RANGE 1024
+
+/** Seconds between two progress reports, which also record the progress in fsck_state */
+#define FSCK_REPORT_SEC 10
+
+/*
+ * The online check runs the inodes up to fsck_end through
+ * query_fsck_range() a range at a time, on fsck_workers threads with a
+ * connection each.  Ranges are handed out in order from fsck_next; all
+ * inodes below the lowest range a worker still checks are done, which is
+ * where the next mount resumes.
+ */
+static pthread_mutex_t fsck_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t fsck_thread;
+static int fsck_running = 0, fsck_stopping = 0, fsck_failed = 0, fsck_resumable = 0;
+static unsigned int fsck_workers = 1;
+static long long fsck_next, fsck_end, fsck_failed_at;
+static long long *fsck_busy;	/**< first inode of the range each worker checks; -1 if none */
+static time_t fsck_reported;
+
+/** The first inode not known to be checked.  Caller holds fsck_mutex. */
+static long long fsck_done()
+{
+    long long done = fsck_next;
+    unsigned int i;
+
+    for (i = 0; i < fsck_workers; i++)
+	if (fsck_busy[i] >= 0 && fsck_busy[i] < done)
+	    done = fsck_busy[i];
+    if (fsck_failed && fsck_failed_at < done)
+	done = fsck_failed_at;
+    return done;
+}
+
+/** Thread body of a worker: check ranges until all are handed out, one fails, or fsck_stop() */
+static void *fsck_worker(void *arg)
+{
+    long long *busy = arg;
+    long long lo, hi, done;
+    MYSQL *mysql;
+    time_t now;
+    int ret, report;
+
+    for (;;) {
+	pthread_mutex_lock(&fsck_mutex);
+	if (fsck_stopping || fsck_failed || fsck_next >= fsck_end) {
+	    pthread_mutex_unlock(&fsck_mutex);
+	    break;
+	}
+	lo = *busy = fsck_next;
+	hi = fsck_next = MIN(lo + FSCK_RANGE, fsck_end);
+	pthread_mutex_unlock(&fsck_mutex);
+
+	/* pool_get(), not pool_tryget(): the check waits its turn with requests */
+	mysql = pool_get();
+	ret = mysql ? query_fsck_range(mysql, lo, hi) : -EIO;
+
+	now = time(NULL);
+	pthread_mutex_lock(&fsck_mutex);
+	*busy = -1;
+	if (ret < 0 && (!fsck_failed || lo < fsck_failed_at)) {
+	    fsck_failed = 1;
+	    fsck_failed_at = lo;
+	}
+	done = fsck_done();
+	report = now - fsck_reported >= FSCK_REPORT_SEC;
+	if (report)
+	    fsck_reported = now;
+	pthread_mutex_unlock(&fsck_mutex);
+
+	if (ret < 0)
+	    log_printf(LOG_ERROR, "fsck: inodes %lld to %lld failed; stopping\n", lo, hi - 1);
+	if (report) {
+	    log_printf(LOG_INFO, "fsck: %lld of %lld inodes checked (%lld%%)\n",
+		       done, fsck_end, done * 100 / fsck_end);
+	    if (mysql && fsck_resumable)
+		query_fsck_save(mysql, done, fsck_end);
+	}
+	if (mysql)
+	    pool_put(mysql);
+    }
+
+    return NULL;
+}
+
+/**
+ * Thread body of the check: take the lock that keeps other mounts from
+ * checking at the same time, resume the pass recorded in fsck_state or
+ * start one, run the workers, and record the outcome.  The lock belongs to
+ * the connection, which is kept until the end.
+ */
+static void *fsck_main(void *arg)
+{
+    pthread_t *threads = NULL;
+    long long next = 0, end = 0;
+    unsigned int i, started = 0;
+    MYSQL *mysql;
+    time_t began;
+    int ret;
+
+    (void)arg;
+
+    mysql = pool_get();
+    if (!mysql)
+	return NULL;
+    ret = query_lock(mysql, "fsck", 1, 0);
+    if (ret <= 0) {
+	if (ret == 0)
+	    log_printf(LOG_INFO, "fsck: another mount is checking\n");
+	pool_put(mysql);
+	return NULL;
+    }
+
+    ret = query_fsck_state(mysql, &next, &end);
+    fsck_resumable = (ret != -ENOSYS);
+    if (ret == 1)
+	log_printf(LOG_INFO, "fsck: resuming at inode %lld of %lld\n", next, end);
+    else if (ret == 0 || ret == -ENOSYS) {
+	next = 0;
+	end = query_fsck_end(mysql);
+	if (end < 0 || (fsck_resumable && query_fsck_save(mysql, next, end) < 0))
+	    goto out;
+	log_printf(LOG_INFO, "fsck: checking inodes up to %lld\n", end - 1);
+    } else
+	goto out;
+
+    threads = calloc(fsck_workers, sizeof(pthread_t));
+    fsck_busy = calloc(fsck_workers, sizeof(long long));
+    if (!threads || !fsck_busy) {
+	log_printf(LOG_ERROR, "fsck: out of memory\n");
+	goto out;
+    }
+
+    began = time(NULL);
+    pthread_mutex_lock(&fsck_mutex);
+    fsck_next = next;
+    fsck_end = end;
+    fsck_reported = began;
+    for (i = 0; i < fsck_workers; i++)
+	fsck_busy[i] = -1;
+    pthread_mutex_unlock(&fsck_mutex);
+
+    for (started = 0; started < fsck_workers; started++)
+	if (pthread_create(&threads[started], NULL, fsck_worker, &fsck_busy[started]))
+	    break;
+    if (!started)
+	log_printf(LOG_ERROR, "fsck: cannot start workers\n");
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+
+    pthread_mutex_lock(&fsck_mutex);
+    next = fsck_done();
+    pthread_mutex_unlock(&fsck_mutex);
+
+    if (next >= end) {
+	if (fsck_resumable)
+	    query_fsck_save(mysql, 0, -1);
+	log_printf(LOG_INFO, "fsck: done, %lld inodes in %lds\n", end, (long)(time(NULL) - began));
+    } else {
+	if (fsck_resumable)
+	    query_fsck_save(mysql, next, end);
+	log_printf(LOG_INFO, "fsck: stopped at inode %lld of %lld%s\n", next, end,
+		   fsck_resumable ? "; the next check resumes there" : "");
+    }
+
+out:
+    free(threads);
+    query_lock(mysql, "fsck", 0, 0);
+    pool_put(mysql);
+
+    return NULL;
+}
+
+/**
+ * Check the filesystem while it serves requests (see query_fsck_range()),
+ * with the steps that need it idle left to the offline check at mount
+ * (fsck=2, see query_fsck()).  Needs one connection of its own besides the
+ * workers'.
+ *
+ * @param workers number of ranges checked at once, each on a connection
+ */
+void fsck_start(unsigned int workers)
+{
+    if (fsck_running)
+	return;
+
+    fsck_workers = MAX(workers, 1);
+    fsck_stopping = 0;
+    fsck_failed = 0;
+    if (pthread_create(&fsck_thread, NULL, fsck_main, NULL) == 0)
+	fsck_running = 1;
+    else
+	log_printf(LOG_WARNING, "%s(): cannot start the check\n", __func__);
+}
+
+void fsck_stop()
+{
+    if (!fsck_running)
+	return;
+
+    pthread_mutex_lock(&fsck_mutex);
+    fsck_stopping = 1;
+    pthread_mutex_unlock(&fsck_mutex);
+    pthread_join(fsck_thread, NULL);
+    free(fsck_busy);
+    fsck_busy = NULL;
+    fsck_running = 0;
+}
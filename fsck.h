@@ -0,0 +1,15 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Start checking the filesystem in the background, over workers connections at once */
+void fsck_start(unsigned int workers);
+
+/** Stop the check, recording how far it got for the next mount to resume */
+void fsck_stop(void);
@@ -0,0 +1,458 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "cache.h"
+#include "gc.h"
+#include "log.h"
+
+/** Seconds the collector sleeps once gc_queue is empty, unless woken by gc_wake() */
+#define GC_IDLE_SEC 60
+
+/** Seconds gc_grow() waits for the collector of any mount to let go of the gc lock */
+#define GC_LOCK_SEC 30
+
+/** End of the range query_drop_data() drops to reach the end of any file */
+#define GC_TO_END ((long long)(~0ULL >> 1))
+
+/**
+ * An inode truncated with data left in gc_queue.  A write that reaches
+ * below from must wait for what the collector has yet to drop there (see
+ * gc_grow()), or the rows of the old file would show through the holes of
+ * the new one.  Deleted inodes need no entry: nothing writes to them again.
+ * Only a hint for this mount: the gc_queue row, read under the gc lock,
+ * says what is left.
+ */
+struct gc_inode {
+    struct gc_inode	*next;
+    long		inode;
+    long long		from;	/**< first block, or byte offset with extents, not yet dropped */
+    int			busy;	/**< a thread is dropping rows of it; others wait on gc_cond */
+};
+
+static struct gc_inode *gc_list = NULL;
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_cond = PTHREAD_COND_INITIALIZER;	/**< signalled when an entry is no longer busy */
+static pthread_cond_t gc_wake_cond;	/**< wakes the collector thread */
+static pthread_t gc_thread;
+static int gc_running = 0, gc_stopping = 0, gc_kicked = 0;
+static unsigned int gc_chunk = 1024, gc_interval = 10;
+
+/** The entry of inode, NULL if none.  Caller holds gc_mutex. */
+static struct gc_inode *gc_find(long inode)
+{
+    struct gc_inode *g;
+
+    for (g = gc_list; g; g = g->next)
+	if (g->inode == inode)
+	    return g;
+    return NULL;
+}
+
+/** The entry of inode, marked busy once no other thread has it; NULL if none.  Caller holds gc_mutex. */
+static struct gc_inode *gc_claim(long inode)
+{
+    struct gc_inode *g;
+
+    while ((g = gc_find(inode)) && g->busy)
+	pthread_cond_wait(&gc_cond, &gc_mutex);
+    if (g)
+	g->busy = 1;
+    return g;
+}
+
+/** Give back an entry taken with gc_claim().  Caller holds gc_mutex. */
+static void gc_release(struct gc_inode *g)
+{
+    g->busy = 0;
+    pthread_cond_broadcast(&gc_cond);
+}
+
+/** Unlink and free an entry taken with gc_claim().  Caller holds gc_mutex. */
+static void gc_remove(struct gc_inode *g)
+{
+    struct gc_inode **pp;
+
+    for (pp = &gc_list; *pp != g; pp = &(*pp)->next)
+	;
+    *pp = g->next;
+    free(g);
+    pthread_cond_broadcast(&gc_cond);
+}
+
+/** Add an entry for inode starting at from.  Caller holds gc_mutex. */
+static struct gc_inode *gc_add(long inode, long long from, int busy)
+{
+    struct gc_inode *g = calloc(1, sizeof(struct gc_inode));
+
+    if (!g)
+	return NULL;
+    g->inode = inode;
+    g->from = from;
+    g->busy = busy;
+    g->next = gc_list;
+    gc_list = g;
+    return g;
+}
+
+/** query_gc_list() filler that adds an entry for each row: the truncations left by an earlier mount */
+static int gc_load(void *ctx, long inode, long long seq)
+{
+    (void)ctx;
+
+    pthread_mutex_lock(&gc_mutex);
+    if (!gc_find(inode) && !gc_add(inode, seq, 0))
+	log_printf(LOG_ERROR, "%s(): out of memory for inode %ld\n", __func__, inode);
+    pthread_mutex_unlock(&gc_mutex);
+    return 0;
+}
+
+/** Row of gc_queue the collector works on next */
+struct gc_row {
+    long	inode;
+    long long	seq;
+    int		found;
+};
+
+/** query_gc_list() filler that takes the first row */
+static int gc_first(void *ctx, long inode, long long seq)
+{
+    struct gc_row *r = ctx;
+
+    r->inode = inode;
+    r->seq = seq;
+    r->found = 1;
+    return 1;
+}
+
+/**
+ * Drop one chunk of the data in gc_queue, of its first row, and move the
+ * row on past it, or delete it once nothing is left.  Rounds are skipped
+ * while another mount collects, and while no connection is free.
+ *
+ * @return 1 if there may be more to drop; 0 if gc_queue is empty, or another mount collects
+ */
+static int gc_round()
+{
+    MYSQL *mysql;
+    struct gc_row r = { 0, 0, 0 };
+    struct gc_inode *g;
+    long long from, next = 0;
+    int ret, dropped, more = 1;
+
+    /* Not pool_get(): collecting can wait, requests cannot */
+    if ((mysql = pool_tryget()) == NULL)
+	return 1;
+    ret = query_lock(mysql, "gc", 1, 0);
+    if (ret <= 0) {
+	pool_put(mysql);
+	return ret < 0;
+    }
+
+    ret = query_gc_list(mysql, 0, 0, 1, gc_first, &r);
+    if (ret < 0 || !r.found) {
+	more = ret < 0;
+	goto out;
+    }
+
+    pthread_mutex_lock(&gc_mutex);
+    g = gc_claim(r.inode);
+    pthread_mutex_unlock(&gc_mutex);
+
+    /* A truncate may have moved the row back since it was listed; once the
+     * entry is ours only one through another mount still can, and the
+     * entry may lag behind what other mounts dropped */
+    r.found = 0;
+    ret = query_gc_list(mysql, 0, r.inode, 1, gc_first, &r);
+    if (ret < 0 || !r.found) {
+	if (g) {
+	    pthread_mutex_lock(&gc_mutex);
+	    gc_release(g);
+	    pthread_mutex_unlock(&gc_mutex);
+	}
+	goto out;
+    }
+    from = r.seq;
+
+    dropped = query_drop_data(mysql, r.inode, from, GC_TO_END, gc_chunk, &next);
+    ret = dropped < 0 ? dropped : query_gc_advance(mysql, r.inode, r.seq, dropped ? next : -1);
+    log_printf(LOG_D_OTHER, "%s(): inode %ld: from %lld => %d, next %lld\n", __func__,
+	       r.inode, from, ret, dropped > 0 ? next : -1LL);
+
+    pthread_mutex_lock(&gc_mutex);
+    if (g && ret == 0 && !dropped)
+	gc_remove(g);
+    else if (g) {
+	if (ret == 0)
+	    g->from = next;
+	gc_release(g);
+    }
+    pthread_mutex_unlock(&gc_mutex);
+
+out:
+    query_lock(mysql, "gc", 0, 0);
+    pool_put(mysql);
+    return more;
+}
+
+/** The timespec of CLOCK_MONOTONIC msec milliseconds from now, for pthread_cond_timedwait() */
+static struct timespec gc_deadline(unsigned long msec)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += msec / 1000;
+    ts.tv_nsec += (msec % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+/**
+ * Thread body of the collector: a round every gc_interval milliseconds
+ * while there is data to drop, otherwise when woken by gc_wake() or every
+ * GC_IDLE_SEC seconds, for what other mounts queued.
+ */
+static void *gc_worker(void *arg)
+{
+    struct timespec deadline;
+    int more = 1;
+
+    (void)arg;
+
+    pthread_mutex_lock(&gc_mutex);
+    while (!gc_stopping) {
+	deadline = gc_deadline(more ? gc_interval : GC_IDLE_SEC * 1000UL);
+	/* Wake-ups only cut an idle wait short; the pause between chunks stays */
+	while (!gc_stopping && (more || !gc_kicked) &&
+	       pthread_cond_timedwait(&gc_wake_cond, &gc_mutex, &deadline) != ETIMEDOUT)
+	    ;
+	if (gc_stopping)
+	    break;
+	gc_kicked = 0;
+
+	pthread_mutex_unlock(&gc_mutex);
+	more = gc_round();
+	pthread_mutex_lock(&gc_mutex);
+    }
+    pthread_mutex_unlock(&gc_mutex);
+
+    return NULL;
+}
+
+/**
+ * Set the pace of the collector.
+ *
+ * @param chunk most blocks (or blocks' worth of extents) dropped by one statement
+ * @param interval milliseconds between two chunks
+ */
+void gc_init(unsigned int chunk, unsigned int interval)
+{
+    gc_chunk = chunk ? chunk : 1;
+    gc_interval = interval;
+}
+
+void gc_start()
+{
+    pthread_condattr_t attr;
+    MYSQL *mysql;
+
+    if (!data_gc || gc_running)
+	return;
+
+    /* Truncations an earlier mount left undone hold back writes as well */
+    mysql = pool_get();
+    if (!mysql || query_gc_list(mysql, 1, 0, 0, gc_load, NULL) < 0)
+	log_printf(LOG_ERROR, "%s(): cannot load gc_queue; files truncated before may show old data when written\n",
+		   __func__);
+    if (mysql)
+	pool_put(mysql);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&gc_wake_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&gc_thread, NULL, gc_worker, NULL) == 0)
+	gc_running = 1;
+    else
+	log_printf(LOG_WARNING, "%s(): cannot start the collector; gc_queue keeps growing\n", __func__);
+}
+
+void gc_stop()
+{
+    struct gc_inode *g;
+
+    if (gc_running) {
+	pthread_mutex_lock(&gc_mutex);
+	gc_stopping = 1;
+	pthread_cond_signal(&gc_wake_cond);
+	pthread_mutex_unlock(&gc_mutex);
+	pthread_join(gc_thread, NULL);
+	pthread_cond_destroy(&gc_wake_cond);
+	gc_running = 0;
+    }
+
+    pthread_mutex_lock(&gc_mutex);
+    while ((g = gc_list)) {
+	gc_list = g->next;
+	free(g);
+    }
+    pthread_mutex_unlock(&gc_mutex);
+}
+
+void gc_wake()
+{
+    pthread_mutex_lock(&gc_mutex);
+    if (gc_running) {
+	gc_kicked = 1;
+	pthread_cond_signal(&gc_wake_cond);
+    }
+    pthread_mutex_unlock(&gc_mutex);
+}
+
+/**
+ * Leave the data of an inode past a truncation to the collector: record it
+ * in gc_queue, and in memory so writes through this mount see it without
+ * a query (see gc_grow()).  Called by query_truncate().
+ *
+ * @return 0 on success; -ENOMEM, or -EIO if the statement fails
+ * @param mysql handle to connection to the database
+ * @param inode inode truncated
+ * @param from first block, or byte offset with extents, past the new end
+ */
+int gc_truncate(MYSQL *mysql, long inode, long long from)
+{
+    struct gc_inode *g;
+    long long old = -1;
+    int ret;
+
+    pthread_mutex_lock(&gc_mutex);
+    g = gc_claim(inode);
+    if (g) {
+	old = g->from;
+	g->from = MIN(g->from, from);
+    } else if ((g = gc_add(inode, from, 1)) == NULL) {
+	pthread_mutex_unlock(&gc_mutex);
+	return -ENOMEM;
+    }
+    pthread_mutex_unlock(&gc_mutex);
+
+    ret = query_gc_queue(mysql, inode, from);
+
+    pthread_mutex_lock(&gc_mutex);
+    if (ret < 0 && old < 0)
+	gc_remove(g);
+    else {
+	if (ret < 0)
+	    g->from = old;
+	gc_release(g);
+    }
+    if (ret == 0 && gc_running) {
+	gc_kicked = 1;
+	pthread_cond_signal(&gc_wake_cond);
+    }
+    pthread_mutex_unlock(&gc_mutex);
+
+    return ret;
+}
+
+/**
+ * Drop at once what a truncate left to the collector below end, so a write
+ * or truncate that moves the end of the file over it reads back zeroes in
+ * the holes rather than the old data.  What is left is known from the list
+ * of this mount, or, as the file may have been truncated through another
+ * mount, for one that grows from its gc_queue row, a lookup by primary
+ * key.  Other calls cost nothing for inodes this mount did not truncate.
+ * The rows are dropped under the gc lock, so not at the same time as by
+ * the collector of any mount.
+ *
+ * @return 0 on success; -EIO if a statement fails
+ * @param mysql handle to connection to the database
+ * @param inode inode about to grow
+ * @param end block, or byte offset with extents, the data will reach
+ * @param extends whether end is past the end of the file, or that is not known
+ */
+int gc_grow(MYSQL *mysql, long inode, long long end, int extends)
+{
+    struct gc_inode *g;
+    struct gc_row r = { 0, 0, 0 };
+    long long next;
+    int ret;
+
+    pthread_mutex_lock(&gc_mutex);
+    g = gc_find(inode);
+    ret = g && g->from < end;
+    pthread_mutex_unlock(&gc_mutex);
+    if (!ret && extends) {
+	if (query_gc_list(mysql, 0, inode, 1, gc_first, &r) < 0)
+	    return -EIO;
+	ret = r.found && r.seq < end;
+    }
+    if (!ret)
+	return 0;
+
+    /* Taken before the entry, as gc_round() does */
+    ret = query_lock(mysql, "gc", 1, GC_LOCK_SEC);
+    if (ret <= 0) {
+	if (ret == 0)
+	    log_printf(LOG_ERROR, "%s(): inode %ld: gc lock still held after %ds\n",
+		       __func__, inode, GC_LOCK_SEC);
+	return -EIO;
+    }
+
+    pthread_mutex_lock(&gc_mutex);
+    g = gc_claim(inode);
+    pthread_mutex_unlock(&gc_mutex);
+
+    /* Read again under the lock: other mounts may have moved it either way */
+    r.found = 0;
+    ret = query_gc_list(mysql, 0, inode, 1, gc_first, &r);
+    if (ret == 0 && r.found && r.seq < end) {
+	ret = query_drop_data(mysql, inode, r.seq, end, 0, &next);
+	if (ret >= 0)
+	    ret = query_gc_advance(mysql, inode, r.seq, end);
+	if (ret == 0 && !data_extent_size)
+	    bcache_invalidate(inode, r.seq, end - 1);
+    }
+
+    pthread_mutex_lock(&gc_mutex);
+    if (g && ret == 0 && !r.found)
+	gc_remove(g);
+    else if (g) {
+	if (ret == 0)
+	    g->from = MAX(r.seq, end);
+	gc_release(g);
+    }
+    pthread_mutex_unlock(&gc_mutex);
+
+    query_lock(mysql, "gc", 0, 0);
+    return ret;
+}
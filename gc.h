@@ -0,0 +1,27 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Set how much data the collector drops at a time, in blocks, and how many milliseconds it pauses in between */
+void gc_init(unsigned int chunk, unsigned int interval);
+
+/** Start the collector thread, if the database has a gc_queue table */
+void gc_start(void);
+
+/** Stop the collector thread, leaving what it has not dropped in gc_queue */
+void gc_stop(void);
+
+/** Wake the collector, e.g. because the data of a deleted file was queued */
+void gc_wake(void);
+
+/** Leave the data of an inode from block from on (byte offset with extents) to the collector */
+int gc_truncate(MYSQL *mysql, long inode, long long from);
+
+/** Drop at once what the collector has yet to drop of an inode below end, before the file grows over it */
+int gc_grow(MYSQL *mysql, long inode, long long end, int extends);
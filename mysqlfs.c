@@ -17,8 +17,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <libgen.h>
-#include <fuse.h>
+#include <time.h>
+#include <fuse_lowlevel.h>
 #ifdef HAVE_MYSQL_MYSQL_H
 #include <mysql/mysql.h>
 #endif
@@ -36,598 +36,1158 @@
 #include "mysqlfs.h"
 #include "query.h"
 #include "pool.h"
+#include "cache.h"
+#include "wbuf.h"
+#include "rahead.h"
+#include "gc.h"
+#include "fsck.h"
+#include "async.h"
+#include "codec.h"
 #include "log.h"
 
-static int mysqlfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *f)
-{
-    int ret;
-    MYSQL *dbconn;
+/*
+ * How long the kernel may trust a name and the attributes of an inode.
+ * Attributes are kept short for better hardlink support: the kernel does
+ * not know which inode an unlinked name pointed to, so cannot invalidate
+ * it -- resulting in an incorrect st_nlink value being reported for any
+ * remaining hardlinks to this inode.  Names that do not exist are trusted
+ * for DCACHE_NEGATIVE_TTL.
+ */
+#define ENTRY_TIMEOUT	60.0	/**< seconds a name -> inode reply is valid */
+#define ATTR_TIMEOUT	10.0	/**< seconds an attribute reply is valid */
 
-    // This is called far too often
-    log_printf(LOG_D_CALL, "mysqlfs_getattr(\"%s\")\n", path);
+/** largest number of entries of a directory listing read from the database at a time */
+#define READDIR_PAGE	1024
 
-    memset(stbuf, 0, sizeof(struct stat));
+/** number of hash buckets of the inode table */
+#define ITABLE_BUCKETS	4096
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+/**
+ * State of an open file, kept in fuse_file_info::fh from mysqlfs_open()
+ * until mysqlfs_release().
+ */
+struct mysqlfs_file {
+    long		inode;		/**< inode of the open file */
+    struct wbuf		*wbuf;		/**< write-back buffer, NULL if buffering is disabled */
+    struct rahead	*rahead;	/**< read-ahead state, NULL if read-ahead is disabled */
+};
 
-    ret = query_getattr(dbconn, path, stbuf);
-    pool_put(dbconn);
+/** the struct mysqlfs_file of an open file */
+#define FH(fi)	((struct mysqlfs_file *)(uintptr_t)(fi)->fh)
 
-    return ret;
-}
+/** One entry of the listing of an open directory */
+struct mysqlfs_dirent {
+    size_t		end;		/**< where the entry ends in mysqlfs_dir::buf */
+    long		inode;		/**< inode of the entry, 0 for "." and ".." */
+};
 
-static int mysqlfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                           off_t offset, struct fuse_file_info *fi,
-                           enum fuse_readdir_flags flags)
-{
-    (void) offset;
-    (void) fi;
-    int ret;
-    MYSQL *dbconn;
-    long inode;
-    struct stat st;
+/**
+ * State of an open directory, kept in fuse_file_info::fh from
+ * mysqlfs_opendir() until mysqlfs_releasedir().  The listing is read from
+ * the database a page of READDIR_PAGE entries at a time, each page
+ * starting after the last name of the one before (see query_readdir()),
+ * and handed out in pieces as large as the kernel asks for.  Entries are
+ * numbered from 1 in order of name, "." and ".." first; the offset the
+ * kernel resumes at is the number of the entry it read last, so stays good
+ * whichever page is loaded, and for readdir and readdirplus alike.
+ */
+struct mysqlfs_dir {
+    long		inode;		/**< inode of the open directory */
+    char		*buf;		/**< entries of the page as fuse_add_direntry() or fuse_add_direntry_plus() lay them out */
+    size_t		len;		/**< bytes of buf in use */
+    size_t		size;		/**< bytes allocated for buf */
+    struct mysqlfs_dirent *ents;	/**< the entries in buf, in order */
+    size_t		nents;		/**< entries in ents */
+    size_t		ents_size;	/**< entries allocated for ents */
+    off_t		first;		/**< number of the entry before the first of the page */
+    char		last[PATH_MAX];	/**< name of the last entry of the page, "" if it is "." or ".." */
+    int			eof;		/**< whether the page ends the directory */
+    int			plus;		/**< whether buf is a readdirplus listing */
+    fuse_req_t		req;		/**< request the listing is read for, while it is */
+    int			err;		/**< -ENOMEM if buf could not grow to the whole page */
+};
 
-    log_printf(LOG_D_CALL, "mysqlfs_readdir(\"%s\")\n", path);
+/** the struct mysqlfs_dir of an open directory */
+#define DH(fi)	((struct mysqlfs_dir *)(uintptr_t)(fi)->fh)
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+/**
+ * An inode the kernel holds a reference to: one handed out by a lookup,
+ * mknod, mkdir, symlink, link or create reply and not yet forgotten.
+ */
+struct itable_entry {
+    long		inode;		/**< inode number in the database */
+    uint64_t		nlookup;	/**< references handed out, less those forgotten */
+    struct itable_entry	*next;		/**< next entry in the hash bucket */
+};
 
-    if (fi && fi->fh)
-        inode = fi->fh;
-    else
-    {
-        inode = query_inode(dbconn, path);
-        if(inode < 0){
-            log_printf(LOG_ERROR, "Error: query_inode()\n");
-            pool_put(dbconn);
-            return inode;
-        }
-    }
+static struct itable_entry *itable[ITABLE_BUCKETS];
+static pthread_mutex_t itable_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    log_printf(LOG_D_CALL, "mysqlfs_readir: inode %ld\n", inode);
-    
-    memset(&st, 0, sizeof st);
-    st.st_ino = 1;
-    st.st_mode = 0777;
-    filler(buf, ".", &st, 0, 0);
-    filler(buf, "..", &st, 0, 0);
+/** inode of the root directory in the database, which the kernel knows as FUSE_ROOT_ID */
+static long root_inode = FUSE_ROOT_ID;
 
-    ret = query_readdir(dbconn, inode, buf, filler, flags);
-    pool_put(dbconn);
+/** The database inode of an inode number the kernel passed in */
+static inline long ll_inode(fuse_ino_t ino)
+{
+    /* The root and whatever has FUSE_ROOT_ID in the database swap numbers */
+    if (ino == FUSE_ROOT_ID)
+        return root_inode;
+    if (ino == (fuse_ino_t)root_inode)
+        return FUSE_ROOT_ID;
+    return ino;
+}
 
-    log_printf(LOG_D_CALL, "mysqlfs_readdir(), return %d\n", ret);
-    return ret;
+/** The inode number the kernel knows a database inode by */
+static inline fuse_ino_t ll_ino(long inode)
+{
+    return ll_inode(inode);
 }
 
-/** FUSE function for mknod(const char *pathname, mode_t mode, dev_t dev); API call.  @see http://linux.die.net/man/2/mknod */
-static int mysqlfs_mknod(const char *path, mode_t mode, dev_t rdev)
+/** Take a reference to an inode for a reply that hands it out to the kernel */
+static void itable_ref(long inode)
 {
-    int ret;
-    MYSQL *dbconn;
-    long parent_inode;
-    char dir_path[PATH_MAX + 1];
+    struct itable_entry *e;
+    unsigned int bucket = (unsigned long)inode % ITABLE_BUCKETS;
 
-    log_printf(LOG_D_CALL, "mysqlfs_mknod(\"%s\", %o): %s\n", path, mode,
-	       S_ISREG(mode) ? "file" :
-	       S_ISDIR(mode) ? "directory" :
-	       S_ISLNK(mode) ? "symlink" :
-	       "other");
+    pthread_mutex_lock(&itable_mutex);
+    for (e = itable[bucket]; e; e = e->next)
+        if (e->inode == inode)
+            break;
+    if (!e && (e = calloc(1, sizeof(*e))) != NULL) {
+        e->inode = inode;
+        e->next = itable[bucket];
+        itable[bucket] = e;
+    }
+    /* Out of memory the inode just goes untracked; forgetting it is a no-op */
+    if (e)
+        e->nlookup++;
+    pthread_mutex_unlock(&itable_mutex);
+}
 
-    if(!(strlen(path) <= PATH_MAX)){
-        log_printf(LOG_ERROR, "Error: Filename too long\n");
-        return -ENAMETOOLONG;
+/**
+ * Drop nlookup references to an inode.  Once the kernel holds none, it will
+ * look the inode up again before using it, so whatever is cached about it
+ * goes too.
+ */
+static void itable_forget(long inode, uint64_t nlookup)
+{
+    struct itable_entry *e, **pe;
+    unsigned int bucket = (unsigned long)inode % ITABLE_BUCKETS;
+
+    pthread_mutex_lock(&itable_mutex);
+    for (pe = &itable[bucket]; (e = *pe) != NULL; pe = &e->next)
+        if (e->inode == inode)
+            break;
+    if (e && e->nlookup > nlookup) {
+        e->nlookup -= nlookup;
+        e = NULL;
+    } else if (e) {
+        *pe = e->next;
     }
-    strncpy(dir_path, path, PATH_MAX);
-    dirname(dir_path);
+    pthread_mutex_unlock(&itable_mutex);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    if (e) {
+        free(e);
+        acache_invalidate(inode);
+        bcache_invalidate(inode, 0, BCACHE_TO_END);
+    }
+}
 
-    parent_inode = query_inode(dbconn, dir_path);
-    if(parent_inode < 0){
-        pool_put(dbconn);
-        return -ENOENT;
+/** Release the inode table; the kernel forgets nothing on unmount */
+static void itable_cleanup(void)
+{
+    struct itable_entry *e;
+    int i;
+
+    for (i = 0; i < ITABLE_BUCKETS; i++) {
+        while ((e = itable[i]) != NULL) {
+            itable[i] = e->next;
+            free(e);
+        }
     }
+}
 
-    ret = query_mknod(dbconn, path, mode, rdev, parent_inode, S_ISREG(mode) || S_ISLNK(mode));
-    if(ret < 0){
-        pool_put(dbconn);
+/** Get the attributes of an inode as the kernel should see them */
+static int ll_getattr(MYSQL *dbconn, long inode, struct stat *stbuf)
+{
+    int ret;
+
+    memset(stbuf, 0, sizeof(struct stat));
+
+    ret = query_getattr(dbconn, inode, stbuf);
+    if (ret < 0)
         return ret;
-    }
 
-    pool_put(dbconn);
+    wbuf_getattr(stbuf);
+    stbuf->st_ino = ll_ino(inode);
     return 0;
 }
 
-static int mysqlfs_mkdir(const char *path, mode_t mode){
+/** Fill in the reply to a request that looked up or created a name for inode */
+static int fill_entry(MYSQL *dbconn, long inode, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = ll_ino(inode);
+    e->attr_timeout = ATTR_TIMEOUT;
+    e->entry_timeout = ENTRY_TIMEOUT;
+    return ll_getattr(dbconn, inode, &e->attr);
+}
+
+/** Reply with a name from fill_entry(), handing out a reference to its inode */
+static void reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+    long inode = ll_inode(e->ino);
+
+    /* Before the reply, a forget of it may follow right away */
+    itable_ref(inode);
+    if (fuse_reply_entry(req, e) != 0)
+        itable_forget(inode, 1);
+}
+
+static void mysqlfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
     int ret;
-    MYSQL *dbconn;
     long inode;
-    char dir_path[PATH_MAX + 1];
+    MYSQL *dbconn;
+    struct fuse_entry_param e;
 
-    log_printf(LOG_D_CALL, "mysqlfs_mkdir(\"%s\", 0%o)\n", path, mode);
-    
-    if(!(strlen(path) <= PATH_MAX)){
-        log_printf(LOG_ERROR, "Error: Filename too long\n");
-        return -ENAMETOOLONG;
+    log_printf(LOG_D_CALL, "mysqlfs_lookup(%ld, \"%s\")\n", ll_inode(parent), name);
+
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
-    strncpy(dir_path, path, PATH_MAX);
-    dirname(dir_path);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    ret = query_lookup(dbconn, ll_inode(parent), name, &inode);
+    if (ret == 0)
+        ret = fill_entry(dbconn, inode, &e);
+    pool_put(dbconn);
 
-    inode = query_inode(dbconn, dir_path);
-    if(inode < 0){
-        pool_put(dbconn);
-        return -ENOENT;
+    if (ret == -ENOENT) {
+        /* Let the kernel remember the miss as long as the dcache does */
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = DCACHE_NEGATIVE_TTL;
+        fuse_reply_entry(req, &e);
+    } else if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        reply_entry(req, &e);
     }
+}
 
-    ret = query_mkdir(dbconn, path, mode, inode);
-    if(ret < 0){
-        log_printf(LOG_ERROR, "Error: query_mkdir()\n");
-        pool_put(dbconn);
-        return ret;
+static void mysqlfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_forget(%ld, %llu)\n", ll_inode(ino),
+               (unsigned long long)nlookup);
+
+    itable_forget(ll_inode(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+static void mysqlfs_forget_multi(fuse_req_t req, size_t count,
+                                 struct fuse_forget_data *forgets)
+{
+    size_t i;
+
+    log_printf(LOG_D_CALL, "mysqlfs_forget_multi(%zu)\n", count);
+
+    for (i = 0; i < count; i++)
+        itable_forget(ll_inode(forgets[i].ino), forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void mysqlfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int ret;
+    MYSQL *dbconn;
+    struct stat st;
+
+    // This is called far too often
+    log_printf(LOG_D_CALL, "mysqlfs_getattr(%ld)\n", ll_inode(ino));
+
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
+    ret = ll_getattr(dbconn, ll_inode(ino), &st);
     pool_put(dbconn);
-    return 0;
+
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_attr(req, &st, ATTR_TIMEOUT);
 }
 
-static int mysqlfs_unlink(const char *path)
+/** FUSE function for chmod(2), chown(2), truncate(2) and utimensat(2), whichever attributes to_set names */
+static void mysqlfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi)
 {
-    int ret;
-    long inode, parent, nlinks;
-    char name[PATH_MAX];
+    int ret = 0;
+    long inode = ll_inode(ino);
     MYSQL *dbconn;
+    struct stat st;
+    struct timespec tv[2];
 
-    log_printf(LOG_D_CALL, "mysqlfs_unlink(\"%s\")\n", path);
+    log_printf(LOG_D_CALL, "mysqlfs_setattr(%ld, 0x%x)\n", inode, to_set);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-    ret = query_inode_full(dbconn, path, name, sizeof(name),
-			   &inode, &parent, &nlinks);
-    if (ret < 0) {
-        if (ret != -ENOENT)
-            log_printf(LOG_ERROR, "Error: query_inode_full(%s): %s\n",
-		       path, strerror(ret));
-	goto err_out;
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        ret = query_chmod(dbconn, inode, attr->st_mode);
+        if (ret < 0)
+            log_printf(LOG_ERROR, "Error: query_chmod()\n");
     }
 
-    ret = query_rmdirentry(dbconn, name, inode, parent);
-    if (ret < 0) {
-        log_printf(LOG_ERROR, "Error: query_rmdirentry()\n");
-	goto err_out;
+    if (ret == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        ret = query_chown(dbconn, inode,
+                          (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1,
+                          (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1);
+        if (ret < 0)
+            log_printf(LOG_ERROR, "Error: query_chown()\n");
     }
 
-    /* Only the last unlink() must set deleted flag. 
-     * This is a shortcut - query_set_deleted() wouldn't
-     * set the flag if there is still an existing direntry
-     * anyway. But we'll save some DB processing here. */
-    if (nlinks > 1)
-        return 0;
-    
-    ret = query_set_deleted(dbconn, inode);
-    if (ret < 0) {
-        log_printf(LOG_ERROR, "Error: query_set_deleted()\n");
-	goto err_out;
+    if (ret == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        /* Buffered data must not land after the truncate */
+        rahead_invalidate(inode);
+        ret = wbuf_flush_inode(dbconn, inode);
+        if (ret == 0)
+            ret = query_truncate(dbconn, inode, attr->st_size);
+        if (ret < 0)
+            log_printf(LOG_ERROR, "Error: query_truncate()\n");
     }
 
-    ret = query_purge_deleted(dbconn, inode);
-    if (ret < 0) {
-        log_printf(LOG_ERROR, "Error: query_purge_deleted()\n");
-	goto err_out;
+    if (ret == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        /* query_utime() sets both, so the one not given stays as it is */
+        ret = query_getattr(dbconn, inode, &st);
+        if (ret == 0) {
+            memset(tv, 0, sizeof(tv));
+            tv[0].tv_sec = !(to_set & FUSE_SET_ATTR_ATIME) ? st.st_atime :
+                           (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(NULL) : attr->st_atime;
+            tv[1].tv_sec = !(to_set & FUSE_SET_ATTR_MTIME) ? st.st_mtime :
+                           (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime;
+            ret = query_utime(dbconn, inode, tv);
+        }
+        if (ret < 0)
+            log_printf(LOG_ERROR, "Error: query_utime()\n");
     }
 
+    if (ret == 0)
+        ret = ll_getattr(dbconn, inode, &st);
     pool_put(dbconn);
 
-    return 0;
-
-err_out:
-    pool_put(dbconn);
-    return ret;
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_attr(req, &st, ATTR_TIMEOUT);
 }
 
-static int mysqlfs_chmod(const char* path, mode_t mode,struct fuse_file_info *fi)
+/**
+ * Create a name in a directory and reply with its entry: mknod(2), mkdir(2)
+ * and, if link is given, symlink(2) with link as the target.
+ */
+static void make_node(fuse_req_t req, long parent, const char *name,
+                      mode_t mode, dev_t rdev, const char *link)
 {
     int ret;
     long inode;
     MYSQL *dbconn;
+    struct fuse_entry_param e;
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
-    log_printf(LOG_D_CALL, "mysql_chmod(\"%s\", 0%3o)\n", path, mode);
-
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
-
-    if (fi && fi->fh)
-        inode = fi->fh;
-    else {
-        inode = query_inode(dbconn, path);
-        if (inode < 0) {
-            pool_put(dbconn);
-            return inode;
-        }
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
-    ret = query_chmod(dbconn, inode, mode);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: query_chmod()\n");
-        pool_put(dbconn);
-        return -EIO;
+    inode = query_mknod(dbconn, name, mode, rdev, parent,
+                        S_ISREG(mode) || S_ISLNK(mode), ctx->uid, ctx->gid, 0);
+    ret = inode < 0 ? inode : 0;
+    if (ret == 0 && link) {
+        ret = query_write(dbconn, inode, link, strlen(link), 0);
+        if (ret > 0) ret = 0;
     }
-
+    if (ret == 0)
+        ret = fill_entry(dbconn, inode, &e);
     pool_put(dbconn);
 
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        reply_entry(req, &e);
+}
+
+/** FUSE function for mknod(const char *pathname, mode_t mode, dev_t dev); API call.  @see http://linux.die.net/man/2/mknod */
+static void mysqlfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_mknod(%ld, \"%s\", %o): %s\n", ll_inode(parent), name, mode,
+	       S_ISREG(mode) ? "file" :
+	       S_ISDIR(mode) ? "directory" :
+	       S_ISLNK(mode) ? "symlink" :
+	       "other");
+
+    make_node(req, ll_inode(parent), name, mode, rdev, NULL);
+}
+
+static void mysqlfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_mkdir(%ld, \"%s\", 0%o)\n", ll_inode(parent), name, mode);
+
+    make_node(req, ll_inode(parent), name, S_IFDIR | mode, 0, NULL);
+}
+
+static void mysqlfs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                            const char *name)
+{
+    log_printf(LOG_D_CALL, "%s(\"%s\" -> %ld, \"%s\")\n", __func__, link, ll_inode(parent), name);
+
+    make_node(req, ll_inode(parent), name, S_IFLNK | 0755, 0, link);
+}
+
+/** Remove a name from a directory, and the inode with the last of its names */
+static int unlink_entry(MYSQL *dbconn, long parent, const char *name)
+{
+    int ret;
+
+    ret = query_unlink(dbconn, parent, name);
+    if (ret < 0 && ret != -ENOENT && ret != -ENOTEMPTY)
+        log_printf(LOG_ERROR, "Error: query_unlink(%ld, %s): %s\n",
+                   parent, name, strerror(-ret));
     return ret;
 }
 
-static int mysqlfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+/** FUSE function for unlink(2) and rmdir(2); query_unlink() refuses a directory that is not empty */
+static void mysqlfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     int ret;
-    long inode;
     MYSQL *dbconn;
 
-    log_printf(LOG_D_CALL, "mysql_chown(\"%s\", %ld, %ld)\n", path, uid, gid);
+    log_printf(LOG_D_CALL, "mysqlfs_unlink(%ld, \"%s\")\n", ll_inode(parent), name);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
-
-    if (fi && fi->fh)
-        inode = fi->fh;
-    else {
-        inode = query_inode(dbconn, path);
-        if (inode < 0) {
-            pool_put(dbconn);
-            return inode;
-        }
-    }
-
-    ret = query_chown(dbconn, inode, uid, gid);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: query_chown()\n");
-        pool_put(dbconn);
-        return -EIO;
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
+    ret = unlink_entry(dbconn, ll_inode(parent), name);
     pool_put(dbconn);
 
-    return ret;
+    fuse_reply_err(req, -ret);
 }
 
-static int mysqlfs_truncate(const char* path, off_t length, 
-                            struct fuse_file_info *fi)
+static void mysqlfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname)
 {
     int ret;
+    long inode = ll_inode(ino);
     MYSQL *dbconn;
-    long inode;
+    struct fuse_entry_param e;
 
-    log_printf(LOG_D_CALL, "mysql_truncate(\"%s\"): len=%lld\n", path, length);
+    log_printf(LOG_D_CALL, "link(%ld, %ld, \"%s\")\n", inode, ll_inode(newparent), newname);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
-
-    if (fi && fi->fh)
-        inode = fi->fh;
-    else {
-        inode = query_inode(dbconn, path);
-        if (inode < 0) {
-            pool_put(dbconn);
-            return inode;
-        }
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
-    ret = query_truncate(dbconn, inode, length);
-    if (ret < 0) {
-        log_printf(LOG_ERROR, "Error: query_length()\n");
-        pool_put(dbconn);
-        return -EIO;
+    /* query_mkdirentry() escapes the name itself */
+    ret = query_mkdirentry(dbconn, inode, newname, ll_inode(newparent));
+    if (ret == 0)
+        ret = fill_entry(dbconn, inode, &e);
+    pool_put(dbconn);
+
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        reply_entry(req, &e);
+}
+
+static void mysqlfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    int ret;
+    long inode = ll_inode(ino);
+    MYSQL *dbconn;
+    char buf[PATH_MAX + 1];
+
+    log_printf(LOG_D_CALL, "%s(%ld)\n", __func__, inode);
+
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
+    ret = query_read(dbconn, inode, buf, PATH_MAX, 0);
     pool_put(dbconn);
 
-    return 0;
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    buf[ret] = '\0';
+    log_printf(LOG_DEBUG, "readlink(%ld): %s [%d]\n", inode, buf, ret);
+    fuse_reply_readlink(req, buf);
 }
 
-static int mysqlfs_utime(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+static void mysqlfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname,
+                           unsigned int flags)
 {
     int ret;
-    long inode;
     MYSQL *dbconn;
 
-    log_printf(LOG_D_CALL, "mysql_utime(\"%s\")\n", path);
+    log_printf(LOG_D_CALL, "%s(%ld, %s -> %ld, %s)\n", __func__,
+               ll_inode(parent), name, ll_inode(newparent), newname);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
-
-    if (fi && fi->fh)
-        inode = fi->fh;
-    else
-    {
-        inode = query_inode(dbconn, path);
-        if (inode < 0) {
-            pool_put(dbconn);
-            return inode;
-        }
+    /* We don't handle the EXCHANGE or NOREPLACE flags */
+    if (flags) {
+        fuse_reply_err(req, EINVAL);
+        return;
     }
 
-    ret = query_utime(dbconn, inode, tv);
-    if (ret < 0) {
-        log_printf(LOG_ERROR, "Error: query_utime()\n");
-        pool_put(dbconn);
-        return -EIO;
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
+    /* query_rename() replaces newname itself, in one transaction */
+    ret = query_rename(dbconn, ll_inode(parent), name, ll_inode(newparent), newname);
+
     pool_put(dbconn);
 
-    return 0;
+    fuse_reply_err(req, -ret);
 }
 
-static int mysqlfs_open(const char *path, struct fuse_file_info *fi)
+/** Count an open of inode, unless query_mknod() already counted it, and set up the struct mysqlfs_file in fi */
+static int open_file(MYSQL *dbconn, long inode, struct fuse_file_info *fi, int counted)
 {
-    MYSQL *dbconn;
-    long inode;
     int ret;
+    struct mysqlfs_file *fh;
 
-    log_printf(LOG_D_CALL, "mysqlfs_open(\"%s\")\n", path);
-
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    if (!counted) {
+        ret = query_inuse_inc(dbconn, inode, 1);
+        if (ret < 0)
+            return ret;
+    }
 
-    inode = query_inode(dbconn, path);
-    if(inode < 0){
-        pool_put(dbconn);
-        return -ENOENT;
+    fh = calloc(1, sizeof(struct mysqlfs_file));
+    if (!fh) {
+        query_inuse_inc(dbconn, inode, -1);
+        return -ENOMEM;
     }
+    fh->inode = inode;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        fh->wbuf = wbuf_new(inode);
+    if ((fi->flags & O_ACCMODE) != O_WRONLY)
+        fh->rahead = rahead_new(inode);
+    fi->fh = (uintptr_t)fh;
 
-    /* Save inode for future use. Lets us skip path->inode translation.  */
-    fi->fh = inode;
+    return 0;
+}
 
-    log_printf(LOG_D_OTHER, "inode(\"%s\") = %d\n", path, fi->fh);
+static void mysqlfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int ret;
+    MYSQL *dbconn;
 
-    ret = query_inuse_inc(dbconn, inode, 1);
-    if (ret < 0) {
-        pool_put(dbconn);
-        return ret;
+    log_printf(LOG_D_CALL, "mysqlfs_open(%ld)\n", ll_inode(ino));
+
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
+    ret = open_file(dbconn, ll_inode(ino), fi, 0);
     pool_put(dbconn);
 
-    return 0;
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_open(req, fi);
 }
 
-static int mysqlfs_read(const char *path, char *buf, size_t size, off_t offset,
-                        struct fuse_file_info *fi)
+/** FUSE function for open(2) with O_CREAT of a name that does not exist: mknod and open in one request */
+static void mysqlfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi)
 {
     int ret;
+    long inode;
     MYSQL *dbconn;
+    struct fuse_entry_param e;
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
-    log_printf(LOG_D_CALL, "mysqlfs_read(\"%s\" %zu@%llu)\n", path, size, offset);
+    log_printf(LOG_D_CALL, "mysqlfs_create(%ld, \"%s\", 0%o)\n", ll_inode(parent), name, mode);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-    ret = query_read(dbconn, fi->fh, buf, size, offset);
+    /* The inode is created open, saving the round trip of counting the open */
+    inode = query_mknod(dbconn, name, mode, 0, ll_inode(parent), 1, ctx->uid, ctx->gid, 1);
+    ret = inode < 0 ? inode : fill_entry(dbconn, inode, &e);
+    if (ret == 0)
+        ret = open_file(dbconn, inode, fi, 1);
+    else if (inode > 0)
+        query_release(dbconn, inode);
     pool_put(dbconn);
 
-    return ret;
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    itable_ref(inode);
+    if (fuse_reply_create(req, &e, fi) != 0)
+        itable_forget(inode, 1);
 }
 
-static int mysqlfs_write(const char *path, const char *buf, size_t size,
-                         off_t offset, struct fuse_file_info *fi)
+static void mysqlfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                         struct fuse_file_info *fi)
 {
     int ret;
     MYSQL *dbconn;
+    char *buf;
 
-    log_printf(LOG_D_CALL, "mysqlfs_write(\"%s\" %zu@%lld)\n", path, size, offset);
+    log_printf(LOG_D_CALL, "mysqlfs_read(%ld %zu@%llu)\n", FH(fi)->inode, size, offset);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    if ((buf = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    ret = query_write(dbconn, fi->fh, buf, size, offset);
+    if ((dbconn = pool_get()) == NULL) {
+        free(buf);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    /* Make data still buffered by any writer of this inode visible */
+    ret = wbuf_flush_inode(dbconn, FH(fi)->inode);
+    if (ret == 0 && FH(fi)->rahead)
+        ret = rahead_read(FH(fi)->rahead, dbconn, buf, size, offset);
+    else if (ret == 0)
+        ret = query_read(dbconn, FH(fi)->inode, buf, size, offset);
     pool_put(dbconn);
 
-    return ret;
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_buf(req, buf, ret);
+    free(buf);
+}
+
+/** Write through the write-back buffer of an open file, or straight to the database if it has none */
+static int mysqlfs_write_data(MYSQL *dbconn, struct mysqlfs_file *fh, const char *buf,
+                              size_t size, off_t offset)
+{
+    if (fh->wbuf)
+        return wbuf_write(fh->wbuf, dbconn, buf, size, offset);
+    return query_write(dbconn, fh->inode, buf, size, offset);
 }
 
-static int mysqlfs_release(const char *path, struct fuse_file_info *fi)
+static void mysqlfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                          off_t offset, struct fuse_file_info *fi)
 {
     int ret;
     MYSQL *dbconn;
 
-    log_printf(LOG_D_CALL, "mysqlfs_release(\"%s\")\n", path);
+    log_printf(LOG_D_CALL, "mysqlfs_write(%ld %zu@%lld)\n", FH(fi)->inode, size, offset);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    if ((dbconn = pool_get()) == NULL) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-    ret = query_inuse_inc(dbconn, fi->fh, -1);
-    if (ret < 0) {
-        pool_put(dbconn);
-        return ret;
+    rahead_invalidate(FH(fi)->inode);
+    ret = mysqlfs_write_data(dbconn, FH(fi), buf, size, offset);
+    pool_put(dbconn);
+
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_write(req, ret);
+}
+
+/**
+ * FUSE function for write(2) taking the data as libfuse received it.  Data
+ * in memory is handed to the write path segment by segment, in place,
+ * rather than libfuse first gathering it into a buffer of its own.  Data
+ * still in a pipe (spliced from the kernel) has to be read into memory
+ * first: both the write-back buffer and the MySQL client library need it
+ * there.
+ */
+static void mysqlfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                              off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+    const struct fuse_buf *seg;
+    size_t i, skip, done = 0;
+    ssize_t copied;
+    int ret = 0;
+    MYSQL *dbconn;
+
+    log_printf(LOG_D_CALL, "mysqlfs_write_buf(%ld %zu@%lld)\n", FH(fi)->inode, mem.buf[0].size, offset);
+
+    for (i = bufv->idx; i < bufv->count; i++) {
+        if (bufv->buf[i].flags & FUSE_BUF_IS_FD)
+            break;
+    }
+    if (i < bufv->count) {
+        if ((mem.buf[0].mem = malloc(mem.buf[0].size)) == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        copied = fuse_buf_copy(&mem, bufv, 0);
+        if (copied < 0) {
+            free(mem.buf[0].mem);
+            fuse_reply_err(req, -copied);
+            return;
+        }
+        mem.buf[0].size = copied;
+        bufv = &mem;
     }
 
-    ret = query_purge_deleted(dbconn, fi->fh);
-    if (ret < 0) {
-        pool_put(dbconn);
-        return ret;
+    if ((dbconn = pool_get()) == NULL) {
+        free(mem.buf[0].mem);
+        fuse_reply_err(req, EIO);
+        return;
     }
 
+    rahead_invalidate(FH(fi)->inode);
+    for (i = bufv->idx; i < bufv->count; i++) {
+        seg = &bufv->buf[i];
+        skip = (i == bufv->idx) ? bufv->off : 0;
+        ret = mysqlfs_write_data(dbconn, FH(fi), (char *)seg->mem + skip,
+                                 seg->size - skip, offset + done);
+        if (ret < 0)
+            break;
+        done += ret;
+    }
     pool_put(dbconn);
+    free(mem.buf[0].mem);
 
-    return 0;
+    if (ret < 0 && done == 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_write(req, done);
 }
 
-static int mysqlfs_link(const char *from, const char *to)
+/** Write what an open file has buffered; reports errors of writes that were buffered so far */
+static int flush_file(struct mysqlfs_file *fh)
 {
     int ret;
-    long inode, new_parent;
     MYSQL *dbconn;
-    char *tmp, *name, esc_name[PATH_MAX * 2];
 
-    log_printf(LOG_D_CALL, "link(%s, %s)\n", from, to);
+    if (!fh->wbuf)
+        return 0;
 
     if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+      return -EIO;
 
-    inode = query_inode(dbconn, from);
-    if(inode < 0){
-        pool_put(dbconn);
-        return inode;
-    }
+    ret = wbuf_flush(fh->wbuf, dbconn);
+    pool_put(dbconn);
 
-    tmp = strdup(to);
-    name = dirname(tmp);
-    new_parent = query_inode(dbconn, name);
-    free(tmp);
-    if (new_parent < 0) {
-        pool_put(dbconn);
-        return new_parent;
-    }
+    return ret;
+}
 
-    tmp = strdup(to);
-    name = basename(tmp);
-    mysql_real_escape_string(dbconn, esc_name, name, strlen(name));
-    free(tmp);
+/** FUSE function for close(2) of one file descriptor */
+static void mysqlfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_flush(%ld)\n", FH(fi)->inode);
 
-    ret = query_mkdirentry(dbconn, inode, esc_name, new_parent);
-    if(ret < 0){
-        pool_put(dbconn);
-        return ret;
-    }
+    fuse_reply_err(req, -flush_file(FH(fi)));
+}
 
-    pool_put(dbconn);
+static void mysqlfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_fsync(%ld, %d)\n", FH(fi)->inode, datasync);
 
-    return 0;
+    fuse_reply_err(req, -flush_file(FH(fi)));
 }
 
-static int mysqlfs_symlink(const char *from, const char *to)
+/** A close that could not be counted for want of a connection; see mysqlfs_release() */
+struct release_entry {
+    long		inode;		/**< inode of the file closed */
+    struct release_entry *next;		/**< next close not yet counted */
+};
+
+static struct release_entry *release_pending = NULL;
+static pthread_mutex_t release_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Count the closes left in release_pending (see query_release()), so an
+ * unlinked file is still purged once its last close is.  Those that fail
+ * again stay for the next call.
+ */
+static void release_retry(MYSQL *dbconn)
 {
-    int ret;
-    int inode;
+    struct release_entry *list, *r;
+
+    pthread_mutex_lock(&release_mutex);
+    list = release_pending;
+    release_pending = NULL;
+    pthread_mutex_unlock(&release_mutex);
+
+    while ((r = list) != NULL) {
+        if (query_release(dbconn, r->inode) < 0)
+            break;
+        list = r->next;
+        free(r);
+    }
+    if (!list)
+        return;
+
+    pthread_mutex_lock(&release_mutex);
+    for (r = list; r->next; r = r->next)
+        ;
+    r->next = release_pending;
+    release_pending = list;
+    pthread_mutex_unlock(&release_mutex);
+}
+
+/**
+ * FUSE function for the last close of a file handle.  The handle goes
+ * whether or not a connection can be had; without one its buffered writes
+ * are lost and its close is counted by a later release (see
+ * release_retry()).
+ */
+static void mysqlfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int ret, err;
     MYSQL *dbconn;
+    struct mysqlfs_file *fh = FH(fi);
+    struct release_entry *r;
 
-    log_printf(LOG_D_CALL, "%s(\"%s\" -> \"%s\")\n", __func__, from, to);
+    log_printf(LOG_D_CALL, "mysqlfs_release(%ld)\n", fh->inode);
 
-    ret = mysqlfs_mknod(to, S_IFLNK | 0755, 0);
-    if (ret < 0)
-      return ret;
+    dbconn = pool_get();
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    rahead_free(fh->rahead);
+    ret = wbuf_free(fh->wbuf, dbconn);
+    if (ret < 0)
+        log_printf(LOG_ERROR, "Error: buffered writes to inode %ld lost\n", fh->inode);
 
-    inode = query_inode(dbconn, to);
-    if(inode < 0){
+    if (dbconn) {
+        release_retry(dbconn);
+        err = query_release(dbconn, fh->inode);
         pool_put(dbconn);
-        return -ENOENT;
+    } else if ((r = malloc(sizeof(struct release_entry))) != NULL) {
+        r->inode = fh->inode;
+        pthread_mutex_lock(&release_mutex);
+        r->next = release_pending;
+        release_pending = r;
+        pthread_mutex_unlock(&release_mutex);
+        err = -EIO;
+    } else {
+        log_printf(LOG_ERROR, "Error: close of inode %ld not counted\n", fh->inode);
+        err = -EIO;
     }
+    if (ret == 0)
+        ret = err;
+    free(fh);
 
-    ret = query_write(dbconn, inode, from, strlen(from), 0);
-    if (ret > 0) ret = 0;
+    fuse_reply_err(req, ret < 0 ? -ret : 0);
+}
 
-    pool_put(dbconn);
+static void mysqlfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct mysqlfs_dir *dh;
 
-    return ret;
+    log_printf(LOG_D_CALL, "mysqlfs_opendir(%ld)\n", ll_inode(ino));
+
+    dh = calloc(1, sizeof(struct mysqlfs_dir));
+    if (!dh) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    dh->inode = ll_inode(ino);
+    fi->fh = (uintptr_t)dh;
+
+    fuse_reply_open(req, fi);
 }
 
-static int mysqlfs_readlink(const char *path, char *buf, size_t size)
+/** Make room for one more entry of len bytes in the listing of an open directory */
+static int dir_grow(struct mysqlfs_dir *dh, size_t len)
 {
-    int ret;
-    long inode;
-    MYSQL *dbconn;
+    size_t size;
+    char *buf;
+    struct mysqlfs_dirent *ents;
+
+    if (dh->len + len > dh->size) {
+        size = dh->size ? dh->size * 2 : 4096;
+        while (size < dh->len + len)
+            size *= 2;
+        if ((buf = realloc(dh->buf, size)) == NULL)
+            return -ENOMEM;
+        dh->buf = buf;
+        dh->size = size;
+    }
 
-    log_printf(LOG_D_CALL, "%s(\"%s\")\n", __func__, path);
+    if (dh->nents == dh->ents_size) {
+        size = dh->ents_size ? dh->ents_size * 2 : 64;
+        if ((ents = realloc(dh->ents, size * sizeof(*ents))) == NULL)
+            return -ENOMEM;
+        dh->ents = ents;
+        dh->ents_size = size;
+    }
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    return 0;
+}
 
-    inode = query_inode(dbconn, path);
-    if(inode < 0){
-        pool_put(dbconn);
-        return -ENOENT;
+/** query_readdir() filler adding one entry to the listing of an open directory */
+static int dir_fill(void *ctx, const char *name, const struct stat *stbuf)
+{
+    struct mysqlfs_dir *dh = ctx;
+    struct fuse_entry_param e;
+    int dot = name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+    off_t next = dh->first + dh->nents + 1;
+    size_t len;
+
+    memset(&e, 0, sizeof(e));
+    e.attr = *stbuf;
+    wbuf_getattr(&e.attr);
+    e.attr.st_ino = ll_ino(stbuf->st_ino);
+    /* The kernel takes no reference for an entry without an inode */
+    if (!dot) {
+        e.ino = e.attr.st_ino;
+        e.attr_timeout = ATTR_TIMEOUT;
+        e.entry_timeout = ENTRY_TIMEOUT;
+    }
+
+    if (dh->plus)
+        len = fuse_add_direntry_plus(dh->req, NULL, 0, name, NULL, 0);
+    else
+        len = fuse_add_direntry(dh->req, NULL, 0, name, NULL, 0);
+    if ((dh->err = dir_grow(dh, len)) < 0)
+        return 1;
+
+    if (dh->plus)
+        fuse_add_direntry_plus(dh->req, dh->buf + dh->len, len, name, &e, next);
+    else
+        fuse_add_direntry(dh->req, dh->buf + dh->len, len, name, &e.attr, next);
+    dh->len += len;
+    dh->ents[dh->nents].end = dh->len;
+    dh->ents[dh->nents].inode = dot ? 0 : stbuf->st_ino;
+    dh->nents++;
+    snprintf(dh->last, sizeof(dh->last), "%s", dot ? "" : name);
+
+    return 0;
+}
+
+/**
+ * Load the page of the listing of an open directory that starts after
+ * entry number offset.  Following on from the page loaded, it is read by
+ * name; after a seek elsewhere, by position.
+ */
+static int dir_load(fuse_req_t req, struct mysqlfs_dir *dh, off_t offset, int plus)
+{
+    int ret = 0;
+    MYSQL *dbconn;
+    struct stat st;
+    char *after = NULL;
+
+    if (offset > 2 && offset == dh->first + (off_t)dh->nents && dh->last[0] &&
+        (after = strdup(dh->last)) == NULL)
+        return -ENOMEM;
+
+    if ((dbconn = pool_get()) == NULL) {
+        free(after);
+        return -EIO;
     }
 
-    memset (buf, 0, size);
-    ret = query_read(dbconn, inode, buf, size, 0);
-    log_printf(LOG_DEBUG, "readlink(%s): %s [%zd -> %d]\n", path, buf, size, ret);
+    dh->len = 0;
+    dh->nents = 0;
+    dh->last[0] = '\0';
+    dh->plus = plus;
+    dh->err = 0;
+    dh->req = req;
+    if (offset < 2) {
+        dh->first = 0;
+        memset(&st, 0, sizeof st);
+        st.st_ino = dh->inode;
+        st.st_mode = S_IFDIR;
+        if (!dir_fill(dh, ".", &st) && !dir_fill(dh, "..", &st))
+            ret = query_readdir(dbconn, dh->inode, NULL, 0, READDIR_PAGE,
+                                dir_fill, dh);
+    } else {
+        dh->first = offset;
+        ret = query_readdir(dbconn, dh->inode, after, offset - 2, READDIR_PAGE,
+                            dir_fill, dh);
+    }
+    if (dh->err)
+        ret = dh->err;
+    dh->req = NULL;
     pool_put(dbconn);
+    free(after);
 
-    if (ret > 0) ret = 0;
-    return ret;
+    log_printf(LOG_D_CALL, "dir_load(%ld, %lld), %zu entries, return %d\n",
+               dh->inode, (long long)offset, dh->nents, ret);
+    if (ret < 0) {
+        dh->len = 0;
+        dh->nents = 0;
+        dh->eof = 0;
+        return ret;
+    }
+    dh->eof = ret < READDIR_PAGE;
+    return 0;
 }
 
-static int mysqlfs_rename(const char *from, const char *to, unsigned int flags)
+/**
+ * Reply to readdir or readdirplus with the whole entries of the loaded
+ * page that follow entry number offset and fit in size bytes.  Each entry
+ * of a readdirplus reply but "." and ".." hands out a reference to its
+ * inode.
+ */
+static void reply_dir(fuse_req_t req, struct mysqlfs_dir *dh, size_t size, off_t offset)
+{
+    size_t first = offset - dh->first, last = first, i;
+    size_t start = first ? dh->ents[first - 1].end : 0, end = start;
+
+    while (last < dh->nents && dh->ents[last].end - start <= size)
+        end = dh->ents[last++].end;
+
+    if (dh->plus)
+        for (i = first; i < last; i++)
+            if (dh->ents[i].inode)
+                itable_ref(dh->ents[i].inode);
+
+    if (fuse_reply_buf(req, end > start ? dh->buf + start : NULL, end - start) != 0 &&
+        dh->plus)
+        for (i = first; i < last; i++)
+            if (dh->ents[i].inode)
+                itable_forget(dh->ents[i].inode, 1);
+}
+
+/** Serve readdir (plus == 0) and readdirplus (plus == 1) from the listing of an open directory */
+static void read_dir(fuse_req_t req, struct mysqlfs_dir *dh, size_t size,
+                     off_t offset, int plus)
 {
     int ret;
-    MYSQL *dbconn;
+    off_t end = dh->first + dh->nents;
+
+    /* Reading from the start, e.g. after rewinddir(3), lists afresh */
+    if (offset == 0 || offset < dh->first || offset > end ||
+        (offset == end && !dh->eof) || dh->plus != plus) {
+        ret = dir_load(req, dh, offset, plus);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+    }
 
-    log_printf(LOG_D_CALL, "%s(%s -> %s)\n", __func__, from, to);
+    if (offset >= dh->first + (off_t)dh->nents)
+        fuse_reply_buf(req, NULL, 0);
+    else
+        reply_dir(req, dh, size, offset);
+}
 
-    /* We don't handle the EXCHANGE or NOREPLACE flags */
-    if (flags)
-        return -EINVAL;
+static void mysqlfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                            struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_readdir(%ld, %zu@%lld)\n", DH(fi)->inode, size, offset);
 
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
+    read_dir(req, DH(fi), size, offset, 0);
+}
 
-    // FIXME: This should be wrapped in a transaction!!!
-    mysqlfs_unlink(to);
-    ret = query_rename(dbconn, from, to);
+/** FUSE function for readdir with the attributes of every entry, which "ls -l" would otherwise stat one by one */
+static void mysqlfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_readdirplus(%ld, %zu@%lld)\n", DH(fi)->inode, size, offset);
 
-    pool_put(dbconn);
+    read_dir(req, DH(fi), size, offset, 1);
+}
 
-    return ret;
+static void mysqlfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct mysqlfs_dir *dh = DH(fi);
+
+    log_printf(LOG_D_CALL, "mysqlfs_releasedir(%ld)\n", dh->inode);
+
+    free(dh->buf);
+    free(dh->ents);
+    free(dh);
+    fuse_reply_err(req, 0);
 }
 
 /*
  * Set config options for correct operation
  */
-static void *mysqlfs_init(struct fuse_conn_info *conn,
-                          struct fuse_config *cfg)
-{
-    /* Honour inode numbers we pass to getattr etc
-     */ 
-    cfg->use_ino = 1;
-
-    /* 
-     * Pick up changes straight away. This is also necessary for
-     * better hardlink support. When the kernel calls the unlink()
-     * handler, it does not know the inode of the to-be-removed entry
-     * and can therefore not invalidate the cache of the associated
-     * inode -- resulting in an incorrect st_nlink value being
-     * reported for any remaining hardlinks to this inode.
+static void mysqlfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    struct mysqlfs_opt *opt = userdata;
+
+    /*
+     * Every request costs at least one round trip to the database, so
+     * ask for large ones.  libfuse lowers this to what its buffers and
+     * the kernel can take.
      */
-    cfg->entry_timeout = 60;
-    cfg->attr_timeout = 10;
-    cfg->negative_timeout = 10;
+    if (opt->max_write)
+        conn->max_write = opt->max_write;
 
-    cfg->nullpath_ok = 0;
-    return NULL;
+    /*
+     * Listing with readdirplus costs the same query as without, and saves
+     * a getattr per entry, so rather than have the kernel guess when it
+     * pays, always use it.
+     */
+    conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+
+    /* Only now, in the process that stays after fuse_daemonize() */
+    pool_start();
+    gc_start();
+
+    /* The check keeps a connection of its own, and each worker takes one */
+    if (opt->fsck == 1) {
+        if (opt->max_conns > 1)
+            fsck_start(MIN(opt->fsck_workers, opt->max_conns - 1));
+        else
+            log_printf(LOG_WARNING, "fsck needs max_conns of 2 or more; not checking\n");
+    }
 }
 
-/** used below in fuse_main() to define the entry points for a FUSE filesystem; this is the same VMT-like jump table used throughout the UNIX kernel. */
-static struct fuse_operations mysqlfs_oper = {
-    .init       = mysqlfs_init,
+/**
+ * used below in fuse_session_new() to define the entry points for a FUSE
+ * filesystem; this is the same VMT-like jump table used throughout the UNIX
+ * kernel.  Every entry point but lookup works on the inode numbers the
+ * kernel passes in, so paths are never resolved; each replies to its
+ * request itself.
+ */
+static struct fuse_lowlevel_ops mysqlfs_oper = {
+    .init	= mysqlfs_init,
+    .lookup	= mysqlfs_lookup,
+    .forget	= mysqlfs_forget,
+    .forget_multi = mysqlfs_forget_multi,
     .getattr	= mysqlfs_getattr,
-    .readdir	= mysqlfs_readdir,
+    .setattr	= mysqlfs_setattr,
+    .readlink	= mysqlfs_readlink,
     .mknod	= mysqlfs_mknod,
     .mkdir	= mysqlfs_mkdir,
     .unlink	= mysqlfs_unlink,
     .rmdir	= mysqlfs_unlink,
-    .chmod	= mysqlfs_chmod,
-    .chown	= mysqlfs_chown,
-    .truncate	= mysqlfs_truncate,
-    .utimens	= mysqlfs_utime,
+    .symlink	= mysqlfs_symlink,
+    .rename	= mysqlfs_rename,
+    .link	= mysqlfs_link,
     .open	= mysqlfs_open,
+    .create	= mysqlfs_create,
     .read	= mysqlfs_read,
     .write	= mysqlfs_write,
+    .write_buf	= mysqlfs_write_buf,
+    .flush	= mysqlfs_flush,
     .release	= mysqlfs_release,
-    .link	= mysqlfs_link,
-    .symlink	= mysqlfs_symlink,
-    .readlink	= mysqlfs_readlink,
-    .rename	= mysqlfs_rename,
+    .fsync	= mysqlfs_fsync,
+    .opendir	= mysqlfs_opendir,
+    .readdir	= mysqlfs_readdir,
+    .readdirplus = mysqlfs_readdirplus,
+    .releasedir	= mysqlfs_releasedir,
 };
 
+
 /** print out a brief usage aide-memoire to stderr */
 void usage(){
     fprintf(stderr,
@@ -663,32 +1223,51 @@ enum
 /** fuse_opt for use with fuse_opt_parse() */
 static struct fuse_opt mysqlfs_opts[] =
   {
+    MYSQLFS_OPT_KEY(  "acache_size=%u",	acache_size,	0),
+    MYSQLFS_OPT_KEY(  "acache_ttl=%u",	acache_ttl,	0),
     MYSQLFS_OPT_KEY(  "background",	bg,	1),
+    MYSQLFS_OPT_KEY(  "bcache_size=%u",	bcache_size,	0),
+    MYSQLFS_OPT_KEY(  "bcache_ttl=%u",	bcache_ttl,	0),
     MYSQLFS_OPT_KEY(  "database=%s",	db,	1),
     MYSQLFS_OPT_KEY("--database=%s",	db,	1),
     MYSQLFS_OPT_KEY( "-D %s",		db,	1),
+    MYSQLFS_OPT_KEY(  "dcache_size=%u",	dcache_size,	0),
+    MYSQLFS_OPT_KEY(  "dcache_ttl=%u",	dcache_ttl,	0),
     MYSQLFS_OPT_KEY(  "fsck",		fsck,	1),
     MYSQLFS_OPT_KEY(  "fsck=%d",	fsck,	1),
     MYSQLFS_OPT_KEY("--fsck=%d",	fsck,	1),
     MYSQLFS_OPT_KEY("nofsck",		fsck,	0),
+    MYSQLFS_OPT_KEY(  "fsck_workers=%u",	fsck_workers,	0),
+    MYSQLFS_OPT_KEY(  "gc_chunk=%u",	gc_chunk,	0),
+    MYSQLFS_OPT_KEY(  "gc_interval=%u",	gc_interval,	0),
     MYSQLFS_OPT_KEY(  "host=%s",	host,	0),
     MYSQLFS_OPT_KEY("--host=%s",	host,	0),
     MYSQLFS_OPT_KEY( "-h %s",		host,	0),
     MYSQLFS_OPT_KEY(  "logfile=%s",	logfile,	0),
     MYSQLFS_OPT_KEY("--logfile=%s",	logfile,	0),
+    MYSQLFS_OPT_KEY(  "max_conns=%u",	max_conns,	0),
+    MYSQLFS_OPT_KEY(  "max_write=%u",	max_write,	0),
+    MYSQLFS_OPT_KEY(  "compress=%s",	compress,	0),
+    MYSQLFS_OPT_KEY(  "conn_timeout=%u",	conn_timeout,	0),
     MYSQLFS_OPT_KEY(  "mycnf_group=%s",	mycnf_group,	0), /* Read defaults from specified group in my.cnf  -- Command line options still have precedence.  */
     MYSQLFS_OPT_KEY("--mycnf_group=%s",	mycnf_group,	0),
     MYSQLFS_OPT_KEY(  "password=%s",	passwd,	0),
     MYSQLFS_OPT_KEY("--password=%s",	passwd,	0),
+    MYSQLFS_OPT_KEY(  "ping_interval=%u",	ping_interval,	0),
     MYSQLFS_OPT_KEY(  "port=%d",	port,	0),
     MYSQLFS_OPT_KEY("--port=%d",	port,	0),
     MYSQLFS_OPT_KEY( "-P %d",		port,	0),
+    MYSQLFS_OPT_KEY(  "readahead=%u",	readahead,	0),
     MYSQLFS_OPT_KEY(  "socket=%s",	socket,	0),
     MYSQLFS_OPT_KEY("--socket=%s",	socket,	0),
     MYSQLFS_OPT_KEY( "-S %s",		socket,	0),
+    MYSQLFS_OPT_KEY(  "stripe_width=%u",	stripe_width,	0),
+    MYSQLFS_OPT_KEY(  "thread_conns",	thread_conns,	1),
     MYSQLFS_OPT_KEY(  "user=%s",	user,	0),
     MYSQLFS_OPT_KEY("--user=%s",	user,	0),
     MYSQLFS_OPT_KEY( "-u %s",		user,	0),
+    MYSQLFS_OPT_KEY(  "wbuf_size=%u",	wbuf_size,	0),
+    MYSQLFS_OPT_KEY(  "wbuf_max_dirty=%u",	wbuf_max_dirty,	0),
 
     FUSE_OPT_KEY("debug-dnq",	KEY_DEBUG_DNQ),
     FUSE_OPT_KEY("-v",		KEY_VERSION),
@@ -721,9 +1300,21 @@ static int mysqlfs_opt_proc(void *data, const char *arg, int key,
             fprintf (stderr, "connect: mysql://%s:%s@%s:%d/%s\n", opt->user, opt->passwd, opt->host, opt->port, opt->db);
             fprintf (stderr, "connect: sock://%s\n", opt->socket);
             fprintf (stderr, "fsck? %s\n", (opt->fsck ? "yes" : "no"));
+            fprintf (stderr, "fsck: %u workers\n", opt->fsck_workers);
             fprintf (stderr, "group: %s\n", opt->mycnf_group);
             fprintf (stderr, "pool: %d initial connections\n", opt->init_conns);
             fprintf (stderr, "pool: %d idling connections\n", opt->max_idling_conns);
+            fprintf (stderr, "pool: %u connections max, %us timeout, %us ping\n", opt->max_conns, opt->conn_timeout, opt->ping_interval);
+            fprintf (stderr, "pool: connection per thread? %s\n", (opt->thread_conns ? "yes" : "no"));
+            fprintf (stderr, "dcache: %u entries, %us ttl\n", opt->dcache_size, opt->dcache_ttl);
+            fprintf (stderr, "acache: %u entries, %us ttl\n", opt->acache_size, opt->acache_ttl);
+            fprintf (stderr, "bcache: %u bytes, %us ttl\n", opt->bcache_size, opt->bcache_ttl);
+            fprintf (stderr, "wbuf: %u bytes per file, %u bytes total\n", opt->wbuf_size, opt->wbuf_max_dirty);
+            fprintf (stderr, "readahead: %u bytes max window\n", opt->readahead);
+            fprintf (stderr, "max_write: %u bytes\n", opt->max_write);
+            fprintf (stderr, "stripe_width: %u\n", opt->stripe_width);
+            fprintf (stderr, "gc: %u blocks per chunk, %ums apart\n", opt->gc_chunk, opt->gc_interval);
+            fprintf (stderr, "compress: %s\n", opt->compress);
             fprintf (stderr, "logfile: file://%s\n", opt->logfile);
             fprintf (stderr, "bg? %s (debug)\n\n", (opt->bg ? "yes" : "no"));
 
@@ -752,9 +1343,31 @@ static int mysqlfs_opt_proc(void *data, const char *arg, int key,
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts cmdline;
+    struct fuse_session *se;
+    MYSQL *dbconn;
+    int ret = 1;
     struct mysqlfs_opt opt = {
 	.init_conns	= 1,
 	.max_idling_conns = 5,
+	.max_conns	= 32,
+	.conn_timeout	= 30,
+	.ping_interval	= 60,
+	.fsck_workers	= 2,
+	.dcache_size	= 8192,
+	.dcache_ttl	= 60,
+	.acache_size	= 8192,
+	.acache_ttl	= 10,
+	.bcache_size	= 32 * 1024 * 1024,
+	.bcache_ttl	= 60,
+	.wbuf_size	= 1024 * 1024,
+	.wbuf_max_dirty	= 64 * 1024 * 1024,
+	.readahead	= 4 * 1024 * 1024,
+	.max_write	= 1024 * 1024,
+	.stripe_width	= 4,
+	.gc_chunk	= 1024,
+	.gc_interval	= 10,
+	.compress	= "none",
 	.mycnf_group	= "mysqlfs",
 	.logfile	= "mysqlfs.log",
     };
@@ -765,8 +1378,79 @@ int main(int argc, char *argv[])
     fuse_opt_add_arg(&args, "-oallow_other");
     fuse_opt_add_arg(&args, "-odefault_permissions");
 
+    if (fuse_parse_cmdline(&args, &cmdline) != 0) {
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+    if (cmdline.show_help || cmdline.show_version || !cmdline.mountpoint) {
+        if (cmdline.show_version)
+            fuse_lowlevel_version();
+        else
+            usage();
+        ret = !cmdline.show_help && !cmdline.show_version;
+        free(cmdline.mountpoint);
+        fuse_opt_free_args(&args);
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (dcache_init(opt.dcache_size, opt.dcache_ttl) < 0) {
+        log_printf(LOG_ERROR, "Error: dcache_init() failed\n");
+        free(cmdline.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    if (acache_init(opt.acache_size, opt.acache_ttl) < 0) {
+        log_printf(LOG_ERROR, "Error: acache_init() failed\n");
+        free(cmdline.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    wbuf_init(opt.wbuf_size, opt.wbuf_max_dirty);
+    rahead_init(opt.readahead);
+    gc_init(opt.gc_chunk, opt.gc_interval);
+
+    /* Before pool_init(), which checks the codec against the database */
+    data_codec = codec_lookup(opt.compress);
+    if (data_codec < 0 || !codec_available(data_codec)) {
+        log_printf(LOG_ERROR, "Error: compress=%s: no such codec compiled in\n", opt.compress);
+        free(cmdline.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    /* Striping needs the non-blocking client API; before pool_init() sets connections up for it */
+    if (!async_available())
+        opt.stripe_width = 1;
+    stripe_width = MAX(opt.stripe_width, 1);
+
     if (pool_init(&opt) < 0) {
         log_printf(LOG_ERROR, "Error: pool_init() failed\n");
+        free(cmdline.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    /* Sized in blocks, so only now that pool_init() has read the block size */
+    if (bcache_init(opt.bcache_size / data_block_size, opt.bcache_ttl) < 0) {
+        log_printf(LOG_ERROR, "Error: bcache_init() failed\n");
+        pool_cleanup();
+        free(cmdline.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    /* The kernel knows the root as FUSE_ROOT_ID, see ll_inode() */
+    if ((dbconn = pool_get()) != NULL) {
+        root_inode = query_inode(dbconn, "/");
+        pool_put(dbconn);
+    }
+    if (!dbconn || root_inode < 0) {
+        log_printf(LOG_ERROR, "Error: no root directory\n");
+        bcache_cleanup();
+        pool_cleanup();
+        free(cmdline.mountpoint);
         fuse_opt_free_args(&args);
         return EXIT_FAILURE;
     }
@@ -786,10 +1470,43 @@ int main(int argc, char *argv[])
 
     log_file = log_init(opt.logfile, 1);
 
-    fuse_main(args.argc, args.argv, &mysqlfs_oper, NULL);
+    se = fuse_session_new(&args, &mysqlfs_oper, sizeof(mysqlfs_oper), &opt);
+    if (se == NULL)
+        goto out;
+    if (fuse_set_signal_handlers(se) != 0)
+        goto out_destroy;
+    if (fuse_session_mount(se, cmdline.mountpoint) != 0)
+        goto out_signals;
+
+    fuse_daemonize(cmdline.foreground);
+
+    if (cmdline.singlethread)
+        ret = fuse_session_loop(se);
+    else
+        ret = fuse_session_loop_mt(se, cmdline.clone_fd);
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_destroy:
+    fuse_session_destroy(se);
+out:
+    free(cmdline.mountpoint);
     fuse_opt_free_args(&args);
 
+    /* Closes that found no connection, while the pool is still there */
+    if (release_pending && (dbconn = pool_get()) != NULL) {
+        release_retry(dbconn);
+        pool_put(dbconn);
+    }
+
+    fsck_stop();
+    gc_stop();
     pool_cleanup();
+    itable_cleanup();
+    bcache_cleanup();
+    acache_cleanup();
+    dcache_cleanup();
 
-    return EXIT_SUCCESS;
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -12,9 +12,39 @@
 /** maximum length of a full pathname */
 #define PATH_MAX 1024
 
-/** size of a single datablock written to the database; should be less than the size of a "blob" or mysqlfs.sql needs to be altered */
+/** smallest block size, and the block size of a filesystem whose superblock table does not say */
 #define DATA_BLOCK_SIZE	4096
 
+/** largest block size; should be less than the size of a "mediumblob" or schema.sql needs to be altered */
+#define DATA_BLOCK_SIZE_MAX	(1024 * 1024)
+
+/** size of a single datablock written to the database; read from the superblock table on startup by query_superblock() */
+extern size_t data_block_size;
+
+/** largest extent; extents are stored in a "mediumblob" too */
+#define DATA_EXTENT_SIZE_MAX	(8 * 1024 * 1024)
+
+/** largest extent if data is stored in data_extents rather than data_blocks, 0 if not; read along with data_block_size */
+extern size_t data_extent_size;
+
+/** non-zero if data_blocks rows refer by hash to shared, reference-counted rows of block_store; read along with data_block_size */
+extern int data_dedup;
+
+/** largest file kept inline, in the inline_data column of its inodes row, rather than in data_blocks; 0 if none.  At most data_block_size; read along with it */
+extern size_t data_inline_size;
+
+/** codec new data blocks are compressed with (see codec.h), from the compress option */
+extern int data_codec;
+
+/** non-zero if data_blocks has a codec column, so rows may be compressed; checked by query_superblock() */
+extern int data_codecs;
+
+/** most connections one read or write is striped over at once, from the stripe_width option; 1 if the client library cannot (see async.c) */
+extern unsigned int stripe_width;
+
+/** non-zero if the data of deleted and truncated files is left in gc_queue for the collector (see gc.c); checked by query_superblock() */
+extern int data_gc;
+
 /** basic preprocessor-phase maximum macro */
 #define MIN(a,b)	((a) < (b) ? (a) : (b))
 /** basic preprocessor-phase minimum macro */
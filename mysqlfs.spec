@@ -27,6 +27,7 @@ make install DESTDIR=%{buildroot}
 %files
 %defattr(-, root, root, 0755)
 %{_bindir}/mysqlfs
+%{_bindir}/mysqlfs_reblock
 %{_datadir}/%{name}-%{version}/schema.sql
 %{_datadir}/%{name}-%{version}/install.sql
 
@@ -15,7 +15,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <fuse/fuse.h>
 #ifdef HAVE_MYSQL_MYSQL_H
@@ -27,22 +29,68 @@
 
 #include "query.h"
 #include "pool.h"
+#include "async.h"
 #include "log.h"
 
 struct mysqlfs_opt *opt;
 
-/** Used in lifo_put() and lifo_get() to maintain a LIFO list. */
-struct pool_lifo {
-    struct pool_lifo	*next;		/**< next item in list */
-    void		*conn;		/**< payload if this item in the list */
+/**
+ * One pooled connection.  The MYSQL handle is the first member, so the
+ * MYSQL * that pool_get() hands out points at the whole struct and
+ * pool_stmt() can get at the statements prepared on that connection.
+ */
+struct pool_conn {
+    MYSQL		mysql;		/**< the connection itself; must stay first */
+    unsigned long	thread_id;	/**< server thread the statements below were prepared on */
+    MYSQL_STMT		*stmt[STMT_MAX];	/**< prepared statements, NULL until first needed */
+    struct pool_conn	*next;		/**< next idle connection, see lifo_put() */
+    time_t		idle_since;	/**< when the connection was last put back */
+    int			bound;		/**< bound to the thread that has it, see pool_get() */
+    int			busy;		/**< bound and handed out by pool_get() */
 };
 
-/* We have only one pool -> use global variables. */
-struct pool_lifo *lifo_pool = NULL;
-struct pool_lifo *lifo_unused = NULL;
+/**
+ * A thread waiting in pool_get() because all max_conns connections are in
+ * use.  Waiters are served in order of arrival: pool_put() hands its
+ * connection straight to the first one, and a connection closed while
+ * threads wait leaves its place to the first one, to open a new one in.
+ */
+struct pool_waiter {
+    struct pool_waiter	*next;		/**< next waiter, in order of arrival */
+    pthread_cond_t	cond;		/**< signalled once served */
+    struct pool_conn	*conn;		/**< connection handed over; NULL for a place to open one in */
+    int			served;		/**< conn is valid */
+};
+
+/** Counters of the pool, logged by pool_log_stats() */
+struct pool_stats {
+    unsigned long	gets;		/**< calls of pool_get() */
+    unsigned long	waits;		/**< of which had to wait for a connection */
+    unsigned long	timeouts;	/**< of which gave up waiting */
+    unsigned long long	wait_usec;	/**< total time waited, in microseconds */
+    unsigned long long	max_wait_usec;	/**< longest wait, in microseconds */
+    unsigned long	connects;	/**< connections opened */
+    unsigned long	failed_pings;	/**< idle connections found dead by pool_pinger() */
+};
+
+/* We have only one pool -> use global variables, all under lifo_mutex. */
+static struct pool_conn *lifo_pool = NULL;
 static pthread_mutex_t lifo_mutex = PTHREAD_MUTEX_INITIALIZER;
-unsigned int lifo_unused_cnt = 0;
-unsigned int lifo_pool_cnt = 0;
+unsigned int lifo_pool_cnt = 0;		/**< idle connections in lifo_pool */
+static unsigned int pool_open_cnt = 0;	/**< connections open or being opened, idle or not */
+static struct pool_waiter *wait_head = NULL, *wait_tail = NULL;
+static pthread_condattr_t wait_condattr;
+static struct pool_stats stats;
+
+/* With thread_conns: the connection bound to each thread, and their number */
+static pthread_key_t thread_conn_key;
+static int thread_conns_on = 0;
+static unsigned int bound_cnt = 0;
+
+static pthread_t ping_thread;
+static pthread_cond_t ping_cond;
+static int ping_running = 0;
+static int ping_stop = 0;
 
 /*********************************
  * Pool MySQL-specific functions *
@@ -50,24 +98,32 @@ unsigned int lifo_pool_cnt = 0;
 
 static MYSQL *pool_open_mysql_connection()
 {
+    struct pool_conn *conn;
     MYSQL *mysql;
     my_bool reconnect = 1;
 
-    mysql = mysql_init(NULL);
-    if (!mysql) {
+    conn = calloc(1, sizeof(struct pool_conn));
+    if (!conn || !mysql_init(&conn->mysql)) {
 	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	free(conn);
         return NULL;
     }
+    mysql = &conn->mysql;
 
     if (opt->mycnf_group)
 	mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, opt->mycnf_group);
+    if (opt->stripe_width > 1)
+	async_prepare(mysql);
 
+    /* CALLs of stored procedures return their rows as an extra result,
+     * and query_mknod() may send two INSERTs at once */
     if (! mysql_real_connect(mysql, opt->host, opt->user,
-			     opt->passwd, opt->db,
-			     opt->port, opt->socket, 0)) {
+			     opt->passwd, opt->db, opt->port, opt->socket,
+			     CLIENT_MULTI_STATEMENTS | CLIENT_MULTI_RESULTS)) {
         log_printf(LOG_ERROR, "ERROR: mysql_real_connect(): %s\n",
 		   mysql_error(mysql));
 	mysql_close(mysql);
+	free(conn);
         return NULL;
     }
 
@@ -77,10 +133,28 @@ static MYSQL *pool_open_mysql_connection()
     return mysql;
 }
 
+/** Close the statements prepared on a connection, e.g. because a reconnect invalidated them */
+static void pool_close_stmts(struct pool_conn *conn)
+{
+    int i;
+
+    for (i = 0; i < STMT_MAX; i++) {
+	if (conn->stmt[i]) {
+	    mysql_stmt_close(conn->stmt[i]);
+	    conn->stmt[i] = NULL;
+	}
+    }
+}
+
 static void pool_close_mysql_connection(MYSQL *mysql)
 {
-    if (mysql)
-        mysql_close(mysql);
+    struct pool_conn *conn = (struct pool_conn *)mysql;
+
+    if (conn) {
+	pool_close_stmts(conn);
+        mysql_close(&conn->mysql);
+	free(conn);
+    }
 }
 
 static int pool_check_mysql_setup(MYSQL *mysql)
@@ -101,15 +175,20 @@ static int pool_check_mysql_setup(MYSQL *mysql)
 	goto out;
     }
 
+    /* Block size and data layout, before anything touches data. */
+    ret = query_superblock(mysql);
+    if (ret < 0)
+	goto out;
+
     /* Create root directory if it doesn't exist. */
     ret = query_inode_full(mysql, "/", NULL, 0, NULL, NULL, NULL);
     if (ret == -ENOENT)
-	ret = query_mkdir(mysql, "/", 0755, 0);
+	ret = query_mkdir(mysql, "/", 0755, 0, getuid(), getgid());
     if (ret < 0)
 	goto out;
 
-    /* Cleanup. */
-    if (opt->fsck == 1) {
+    /* Cleanup; the online check (fsck == 1) runs after mount, see fsck.c */
+    if (opt->fsck == 2) {
         ret = query_fsck(mysql);
     }
 
@@ -121,64 +200,213 @@ out:
  * Pool DB-independent (almost) functions *
  ******************************************/
 
-static inline int lifo_put(void *conn)
+/** Put an idle connection on top of the LIFO.  Caller holds lifo_mutex. */
+static inline void lifo_put(struct pool_conn *conn)
 {
-    struct pool_lifo *ent;
+    conn->idle_since = time(NULL);
+    conn->next = lifo_pool;
+    lifo_pool = conn;
+    lifo_pool_cnt++;
+}
 
-    log_printf(LOG_D_POOL, "%s() <= %p\n", __func__, conn);
-    pthread_mutex_lock(&lifo_mutex);
-    if (lifo_unused) {
-	ent = lifo_unused;
-	lifo_unused = ent->next;
-	lifo_unused_cnt--;
-    } else {
-	ent = calloc(1, sizeof(struct pool_lifo));
-	if (!ent) {
-	    pthread_mutex_unlock(&lifo_mutex);
-	    return -ENOMEM;
-	}
+/** Take the most recently used idle connection, NULL if none.  Caller holds lifo_mutex. */
+static inline struct pool_conn *lifo_get()
+{
+    struct pool_conn *conn = lifo_pool;
+
+    if (conn) {
+	lifo_pool = conn->next;
+	lifo_pool_cnt--;
+	conn->next = NULL;
     }
-    ent->conn = conn;
-    ent->next = lifo_pool;
-    lifo_pool = ent;
-    lifo_pool_cnt++;
-    pthread_mutex_unlock(&lifo_mutex);
+    return conn;
+}
 
-    return 0;
+/**
+ * Take the least recently used idle connection if it has been idle since
+ * before cutoff, NULL otherwise.  Caller holds lifo_mutex.
+ */
+static struct pool_conn *lifo_get_stale(time_t cutoff)
+{
+    struct pool_conn **pp, **oldest = NULL, *conn;
+
+    for (pp = &lifo_pool; *pp; pp = &(*pp)->next)
+	oldest = pp;
+    if (!oldest || (*oldest)->idle_since >= cutoff)
+	return NULL;
+
+    conn = *oldest;
+    *oldest = NULL;
+    lifo_pool_cnt--;
+    return conn;
+}
+
+/** Hand a connection, or with conn NULL a place to open one in, to the first waiter.  Caller holds lifo_mutex. */
+static void pool_serve_waiter(struct pool_conn *conn)
+{
+    struct pool_waiter *w = wait_head;
+
+    wait_head = w->next;
+    if (!wait_head)
+	wait_tail = NULL;
+    w->conn = conn;
+    w->served = 1;
+    pthread_cond_signal(&w->cond);
+}
+
+/** Give up the place of a connection that was closed or could not be opened.  Caller holds lifo_mutex. */
+static void pool_release_slot()
+{
+    if (wait_head)
+	pool_serve_waiter(NULL);
+    else
+	pool_open_cnt--;
 }
 
-static inline void *lifo_get()
+/** Put a connection back into the shared pool, see pool_put() */
+static void pool_put_shared(struct pool_conn *conn)
 {
-    struct pool_lifo *ent;
-    void *conn;
+    log_printf(LOG_D_POOL, "%s(%p)\n", __func__, conn);
 
     pthread_mutex_lock(&lifo_mutex);
-    if (lifo_pool) {
-	ent = lifo_pool;
-	conn = ent->conn;
-	lifo_pool = ent->next;
-	lifo_pool_cnt--;
-	ent->next = lifo_unused;
-	ent->conn = NULL;
-	lifo_unused = ent;
-	lifo_unused_cnt++;
-    } else
+    if (wait_head) {
+	pool_serve_waiter(conn);
+	conn = NULL;
+    } else if (lifo_pool_cnt < opt->max_idling_conns || pool_open_cnt <= opt->init_conns) {
+	lifo_put(conn);
 	conn = NULL;
+    } else
+	pool_open_cnt--;
     pthread_mutex_unlock(&lifo_mutex);
 
-    return conn;
+    if (conn)
+	pool_close_mysql_connection(&conn->mysql);
+}
+
+/** Open a connection in a place already counted in pool_open_cnt, giving the place up on failure. */
+static struct pool_conn *pool_open_slot()
+{
+    MYSQL *mysql = pool_open_mysql_connection();
+
+    pthread_mutex_lock(&lifo_mutex);
+    if (mysql)
+	stats.connects++;
+    else
+	pool_release_slot();
+    pthread_mutex_unlock(&lifo_mutex);
+
+    log_printf(LOG_D_POOL, "%s(): Allocated new connection = %p\n", __func__, mysql);
+    return (struct pool_conn *)mysql;
+}
+
+/** The timespec of CLOCK_MONOTONIC sec seconds from now, for pthread_cond_timedwait() */
+static struct timespec pool_deadline(unsigned int sec)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += sec;
+    return ts;
+}
+
+/** Log the counters of the pool at the given level */
+static void pool_log_stats(int level)
+{
+    struct pool_stats s;
+    unsigned int open, idle, bound;
+
+    pthread_mutex_lock(&lifo_mutex);
+    s = stats;
+    open = pool_open_cnt;
+    idle = lifo_pool_cnt;
+    bound = bound_cnt;
+    pthread_mutex_unlock(&lifo_mutex);
+
+    log_printf(level, "pool: %u connections (%u idle, %u bound), %lu opened, %lu dead; "
+	       "%lu gets, %lu waited %llu us avg %llu us max, %lu timed out\n",
+	       open, idle, bound, s.connects, s.failed_pings, s.gets, s.waits,
+	       s.waits ? s.wait_usec / s.waits : 0, s.max_wait_usec, s.timeouts);
+}
+
+/**
+ * Thread body that keeps the idle connections alive: every ping_interval
+ * seconds, each connection idle for that long is pinged, which also
+ * reconnects it if the server dropped it; one that stays dead is closed.
+ * Then as many connections are opened as it takes to have init_conns.
+ */
+static void *pool_pinger(void *arg)
+{
+    struct pool_conn *conn;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&lifo_mutex);
+    while (!ping_stop) {
+	deadline = pool_deadline(opt->ping_interval);
+	while (!ping_stop &&
+	       pthread_cond_timedwait(&ping_cond, &lifo_mutex, &deadline) != ETIMEDOUT)
+	    ;
+	if (ping_stop)
+	    break;
+
+	while (!ping_stop && (conn = lifo_get_stale(time(NULL) - opt->ping_interval))) {
+	    pthread_mutex_unlock(&lifo_mutex);
+	    if (mysql_ping(&conn->mysql) == 0) {
+		pool_put_shared(conn);
+		pthread_mutex_lock(&lifo_mutex);
+		continue;
+	    }
+	    log_printf(LOG_WARNING, "%s(): conn=%p: %s, closing it\n", __func__,
+		       conn, mysql_error(&conn->mysql));
+	    pool_close_mysql_connection(&conn->mysql);
+	    pthread_mutex_lock(&lifo_mutex);
+	    stats.failed_pings++;
+	    pool_release_slot();
+	}
+
+	while (!ping_stop && !wait_head && pool_open_cnt < opt->init_conns) {
+	    pool_open_cnt++;
+	    pthread_mutex_unlock(&lifo_mutex);
+	    conn = pool_open_slot();
+	    if (conn)
+		pool_put_shared(conn);
+	    pthread_mutex_lock(&lifo_mutex);
+	    if (!conn)
+		break;		/* server down; try again next round */
+	}
+
+	pthread_mutex_unlock(&lifo_mutex);
+	pool_log_stats(LOG_D_POOL);
+	pthread_mutex_lock(&lifo_mutex);
+    }
+    pthread_mutex_unlock(&lifo_mutex);
+
+    return NULL;
 }
 
 int pool_init(struct mysqlfs_opt *opt_arg)
 {
+    struct pool_conn *conn;
     int i, ret;
 
     log_printf(LOG_D_POOL, "%s()\n", __func__);
     opt = opt_arg;
+    if (opt->max_conns < opt->init_conns)
+	opt->max_conns = opt->init_conns;
+    if (!opt->max_conns)
+	opt->max_conns = 1;
+
+    /* Timeouts of waits must not jump with the wall clock */
+    pthread_condattr_init(&wait_condattr);
+    pthread_condattr_setclock(&wait_condattr, CLOCK_MONOTONIC);
 
     for (i = 0; i < opt->init_conns; i++) {
-	void *conn = pool_open_mysql_connection();
-	lifo_put(conn);
+	pthread_mutex_lock(&lifo_mutex);
+	pool_open_cnt++;
+	pthread_mutex_unlock(&lifo_mutex);
+	conn = pool_open_slot();
+	if (!conn)
+	    break;
+	pool_put_shared(conn);
     }
 
     /* The following check should go to MySQL-specific section
@@ -197,38 +425,291 @@ int pool_init(struct mysqlfs_opt *opt_arg)
     return ret;
 }
 
+/** Destructor of thread_conn_key: a thread exits, its connection goes back to the shared pool */
+static void pool_thread_exit(void *arg)
+{
+    struct pool_conn *conn = arg;
+
+    conn->bound = 0;
+    conn->busy = 0;
+    pthread_mutex_lock(&lifo_mutex);
+    bound_cnt--;
+    pthread_mutex_unlock(&lifo_mutex);
+    pool_put_shared(conn);
+}
+
+/**
+ * Start what the pool does once the filesystem serves requests: binding
+ * connections to the threads that get them, with thread_conns, and the
+ * thread that pings idle connections, unless ping_interval is 0.
+ * Separate from pool_init() so it can wait until the process has forked
+ * into the background, which threads do not survive, and so the thread
+ * that ran main() does not keep a connection bound.
+ */
+void pool_start()
+{
+    pthread_condattr_t attr;
+
+    if (opt->thread_conns && !thread_conns_on) {
+	if (pthread_key_create(&thread_conn_key, pool_thread_exit) == 0)
+	    thread_conns_on = 1;
+	else
+	    log_printf(LOG_WARNING, "%s(): cannot bind connections to threads\n", __func__);
+    }
+
+    if (!opt->ping_interval || ping_running)
+	return;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ping_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&ping_thread, NULL, pool_pinger, NULL) == 0)
+	ping_running = 1;
+    else
+	log_printf(LOG_WARNING, "%s(): cannot start pinging idle connections\n", __func__);
+}
+
 void pool_cleanup()
 {
-    void *conn;
+    struct pool_conn *conn;
+
     log_printf(LOG_D_POOL, "%s()...\n", __func__);
+    if (thread_conns_on && (conn = pthread_getspecific(thread_conn_key))) {
+	pthread_setspecific(thread_conn_key, NULL);
+	pool_thread_exit(conn);
+    }
+    if (ping_running) {
+	pthread_mutex_lock(&lifo_mutex);
+	ping_stop = 1;
+	pthread_cond_signal(&ping_cond);
+	pthread_mutex_unlock(&lifo_mutex);
+	pthread_join(ping_thread, NULL);
+	pthread_cond_destroy(&ping_cond);
+	ping_running = 0;
+    }
+
+    pool_log_stats(LOG_INFO);
+
+    pthread_mutex_lock(&lifo_mutex);
     while ((conn = lifo_get())) {
+	pool_open_cnt--;
+	pthread_mutex_unlock(&lifo_mutex);
 	log_printf(LOG_D_POOL, "%s(): closing conn=%p\n", __func__, conn);
-	pool_close_mysql_connection(conn);
+	pool_close_mysql_connection(&conn->mysql);
+	pthread_mutex_lock(&lifo_mutex);
     }
+    pthread_mutex_unlock(&lifo_mutex);
 }
 
-void *pool_get()
+/**
+ * Get a connection from the shared pool: an idle one if there is one,
+ * else a new one while fewer than max_conns are open.  Otherwise wait,
+ * after the threads that were waiting already, up to conn_timeout seconds
+ * (0: no limit) for one to be put back.
+ *
+ * @return the connection; NULL if none could be opened or the wait timed out (logged)
+ */
+static struct pool_conn *pool_get_shared()
 {
-    void *conn = lifo_get();
-    if (!conn) {
-	conn = pool_open_mysql_connection();
-	log_printf(LOG_D_POOL, "%s(): Allocated new connection = %p\n", __func__, conn);
-    } else
+    struct pool_conn *conn;
+    struct pool_waiter w;
+    struct timespec start, end, deadline;
+    unsigned long long usec;
+    int ret = 0;
+
+    pthread_mutex_lock(&lifo_mutex);
+    stats.gets++;
+    if (!wait_head && (conn = lifo_get())) {
+	pthread_mutex_unlock(&lifo_mutex);
 	log_printf(LOG_D_POOL, "%s(): Reused connection = %p\n", __func__, conn);
+	return conn;
+    }
+    if (!wait_head && pool_open_cnt < opt->max_conns) {
+	pool_open_cnt++;
+	pthread_mutex_unlock(&lifo_mutex);
+	return pool_open_slot();
+    }
 
+    w.next = NULL;
+    w.conn = NULL;
+    w.served = 0;
+    pthread_cond_init(&w.cond, &wait_condattr);
+    if (wait_tail)
+	wait_tail->next = &w;
+    else
+	wait_head = &w;
+    wait_tail = &w;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += opt->conn_timeout;
+    while (!w.served && ret != ETIMEDOUT) {
+	if (opt->conn_timeout)
+	    ret = pthread_cond_timedwait(&w.cond, &lifo_mutex, &deadline);
+	else
+	    pthread_cond_wait(&w.cond, &lifo_mutex);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!w.served) {
+	struct pool_waiter **pp, *prev = NULL;
+
+	for (pp = &wait_head; *pp != &w; pp = &(*pp)->next)
+	    prev = *pp;
+	*pp = w.next;
+	if (wait_tail == &w)
+	    wait_tail = prev;
+	stats.timeouts++;
+    }
+    usec = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+    stats.waits++;
+    stats.wait_usec += usec;
+    if (usec > stats.max_wait_usec)
+	stats.max_wait_usec = usec;
+    pthread_mutex_unlock(&lifo_mutex);
+    pthread_cond_destroy(&w.cond);
+
+    log_printf(LOG_D_POOL, "%s(): waited %llu us for connection = %p\n", __func__, usec, w.conn);
+    if (!w.served) {
+	log_printf(LOG_ERROR, "%s(): all %u connections busy for %us\n", __func__,
+		   opt->max_conns, opt->conn_timeout);
+	return NULL;
+    }
+    if (!w.conn)
+	return pool_open_slot();
+    return w.conn;
+}
+
+/**
+ * Get a connection.  With thread_conns, the first connection a thread gets
+ * stays bound to it, prepared statements and all, and is what its later
+ * calls get, without a lock.  Every thread but one may bind one, so that
+ * at least one connection is left to share among the threads that could
+ * not bind one, or ask for a second one.
+ *
+ * @return the connection; NULL if none could be opened or the wait timed out (logged)
+ */
+void *pool_get()
+{
+    struct pool_conn *conn = NULL;
+    int bind;
+
+    if (thread_conns_on) {
+	conn = pthread_getspecific(thread_conn_key);
+	if (conn && !conn->busy) {
+	    conn->busy = 1;
+	    return conn;
+	}
+    }
+
+    bind = (thread_conns_on && !conn);
+    conn = pool_get_shared();
+    if (!conn || !bind)
+	return conn;
+
+    pthread_mutex_lock(&lifo_mutex);
+    bind = (bound_cnt + 1 < opt->max_conns);
+    if (bind)
+	bound_cnt++;
+    pthread_mutex_unlock(&lifo_mutex);
+
+    if (bind) {
+	if (pthread_setspecific(thread_conn_key, conn) == 0) {
+	    conn->bound = 1;
+	    conn->busy = 1;
+	    log_printf(LOG_D_POOL, "%s(): bound connection = %p\n", __func__, conn);
+	} else {
+	    pthread_mutex_lock(&lifo_mutex);
+	    bound_cnt--;
+	    pthread_mutex_unlock(&lifo_mutex);
+	}
+    }
     return conn;
 }
 
-void pool_put(void *conn)
+/**
+ * Get a connection without waiting, for work that may be skipped, such as
+ * read-ahead, and may run while the caller's caller holds a connection.
+ *
+ * @return the connection; NULL if none is free
+ */
+void *pool_tryget()
 {
-    log_printf(LOG_D_POOL, "%s(%p)\n", __func__, conn);
+    struct pool_conn *conn;
 
-    /* This doesn't have to be mutex-protected.
-     * If we close more conns or don't close some nothing
-     * too bad happens. */
-    if (lifo_pool_cnt >= opt->max_idling_conns)
-	pool_close_mysql_connection(conn);
-    else
-	if (lifo_put(conn) < 0)
-	    pool_close_mysql_connection(conn);
+    pthread_mutex_lock(&lifo_mutex);
+    stats.gets++;
+    if (!wait_head && (conn = lifo_get())) {
+	pthread_mutex_unlock(&lifo_mutex);
+	return conn;
+    }
+    if (!wait_head && pool_open_cnt < opt->max_conns) {
+	pool_open_cnt++;
+	pthread_mutex_unlock(&lifo_mutex);
+	return pool_open_slot();
+    }
+    pthread_mutex_unlock(&lifo_mutex);
+
+    return NULL;
+}
+
+/**
+ * Put a connection back: hand it to the first thread waiting for one,
+ * or keep it idle, or close it if enough are idle.  A connection bound to
+ * the calling thread just becomes free for that thread's next pool_get().
+ */
+void pool_put(void *mysql)
+{
+    struct pool_conn *conn = mysql;
+
+    if (conn->bound) {
+	conn->busy = 0;
+	return;
+    }
+    pool_put_shared(conn);
+}
+
+/**
+ * Get one of the prepared statements of a pooled connection.  Statements are
+ * prepared on first use and then kept for the life of the connection.  When
+ * the client library has reconnected behind our back (MYSQL_OPT_RECONNECT),
+ * all statements prepared on the old session are gone; that shows as a new
+ * server thread id, upon which they are closed and prepared again as needed.
+ *
+ * @return the prepared statement; NULL on error (logged)
+ * @param mysql connection obtained from pool_get()
+ * @param id which statement
+ * @param sql text of the statement, used if it has to be prepared
+ */
+MYSQL_STMT *pool_stmt(MYSQL *mysql, enum pool_stmt_id id, const char *sql)
+{
+    struct pool_conn *conn = (struct pool_conn *)mysql;
+    MYSQL_STMT *stmt;
+
+    if (conn->thread_id != mysql_thread_id(mysql)) {
+	if (conn->thread_id)
+	    log_printf(LOG_D_POOL, "%s(): conn=%p reconnected, re-preparing statements\n",
+		       __func__, conn);
+	pool_close_stmts(conn);
+	conn->thread_id = mysql_thread_id(mysql);
+    }
+
+    if (conn->stmt[id])
+	return conn->stmt[id];
+
+    stmt = mysql_stmt_init(mysql);
+    if (!stmt) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	return NULL;
+    }
+    if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
+	log_printf(LOG_ERROR, "ERROR: mysql_stmt_prepare(): %s\n", mysql_stmt_error(stmt));
+	mysql_stmt_close(stmt);
+	return NULL;
+    }
+    log_printf(LOG_D_SQL, "%s(): conn=%p prepared %s\n", __func__, conn, sql);
+
+    conn->stmt[id] = stmt;
+    return stmt;
 }
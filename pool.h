@@ -20,22 +20,91 @@ struct mysqlfs_opt {
     char *db;                   /**< MySQL database name */
     unsigned int port;		/**< MySQL port */
     char *socket;		/**< MySQL socket */
-    unsigned int fsck;		/**< fsck boolean 1 => do fsck, 0 => don't.  Used in pool_check_mysql_setup() to call query_fsck()  */
+    unsigned int fsck;		/**< fsck 1 => check online after mount (fsck_start()), 2 => check offline before, in pool_check_mysql_setup() with query_fsck(), 0 => don't */
+    unsigned int fsck_workers;	/**< Number of DB connections the online fsck checks over in parallel */
     char *mycnf_group;		/**< Group in my.cnf to read defaults from */
-    unsigned int init_conns;	/**< Number of DB connections to init on startup */
+    unsigned int init_conns;	/**< Number of DB connections to init on startup, and to keep open */
     unsigned int max_idling_conns;	/**< Maximum number of idling DB connections */
+    unsigned int max_conns;	/**< Maximum number of DB connections open at once; pool_get() waits beyond */
+    unsigned int conn_timeout;	/**< Seconds pool_get() waits for a connection; 0 waits for good */
+    unsigned int ping_interval;	/**< Seconds a DB connection idles before it is pinged; 0 never pings */
+    unsigned int stripe_width;	/**< Most DB connections one read or write is striped over at once */
+    unsigned int thread_conns;	/**< 1 => bind a DB connection to each thread that gets one, see pool_get() */
+    unsigned int dcache_size;	/**< Maximum number of (parent, name) -> inode entries cached; 0 disables the dentry cache */
+    unsigned int dcache_ttl;	/**< Seconds a cached directory entry stays valid */
+    unsigned int acache_size;	/**< Maximum number of inode -> struct stat entries cached; 0 disables the attribute cache */
+    unsigned int acache_ttl;	/**< Seconds cached inode attributes stay valid */
+    unsigned int bcache_size;	/**< Bytes of data blocks cached; 0 disables the block cache */
+    unsigned int bcache_ttl;	/**< Seconds a cached data block stays valid */
+    unsigned int wbuf_size;	/**< Bytes of writes buffered per open file before they are flushed; 0 writes through */
+    unsigned int wbuf_max_dirty;	/**< Bytes of writes buffered by all open files together */
+    unsigned int readahead;	/**< Largest read-ahead window in bytes for sequential reads; 0 disables read-ahead */
+    unsigned int max_write;	/**< Largest write request asked of the kernel, in bytes; 0 keeps the libfuse default */
+    unsigned int gc_chunk;	/**< Most blocks of deleted or truncated files the collector drops per statement */
+    unsigned int gc_interval;	/**< Milliseconds the collector pauses between two chunks */
+    char *compress;		/**< codec new data blocks are compressed with: "none", "lz4" or "zstd" */
     char *logfile;		/**< filename to which local debug/log information will be written */
     int bg;			/**< (used for autotest) whether a term-less execution should background */
 };
 
+/**
+ * The statements each pooled connection prepares the first time they are
+ * needed; the SQL of each is in query.c.  Prepared once per connection, they
+ * spare the server the parsing and the client the formatting of the queries
+ * run most often.
+ */
+enum pool_stmt_id {
+    STMT_GETATTR,		/**< attributes and link count of an inode */
+    STMT_LOOKUP,		/**< inode of a name in a directory */
+    STMT_READDIR,		/**< a page of the entries of a directory, by position */
+    STMT_READDIR_AFTER,		/**< a page of the entries of a directory, after a name */
+    STMT_READ_BLOCKS,		/**< a range of data blocks of an inode */
+    STMT_WRITE_BLOCK,		/**< splice data into one data block */
+    STMT_SIZE_GROW,		/**< raise the size of an inode */
+    STMT_INUSE_INC,		/**< change the in-use count of an inode */
+    STMT_READ_EXTENTS,		/**< the parts of the extents of an inode within a range */
+    STMT_EXTENT_MAP,		/**< position and length of the extents of an inode near a range */
+    STMT_EXTENT_INSERT,		/**< add an extent */
+    STMT_EXTENT_APPEND,		/**< append data to an extent */
+    STMT_EXTENT_SPLICE,		/**< overwrite data within an extent */
+    STMT_READ_DEDUP,		/**< a range of data blocks of an inode, shared ones included */
+    STMT_DEDUP_HASH,		/**< hash of one data block */
+    STMT_DEDUP_BLOCK,		/**< hash and data of one data block */
+    STMT_DEDUP_REF,		/**< take a reference to a shared block */
+    STMT_DEDUP_STORE,		/**< store a shared block, or take a reference to it */
+    STMT_DEDUP_MAP,		/**< point a data block at a shared block */
+    STMT_DEDUP_UNREF,		/**< drop a reference to a shared block */
+    STMT_DEDUP_DROP,		/**< delete a shared block no longer referenced */
+    STMT_READ_CODEC,		/**< a range of data blocks of an inode, with their codecs */
+    STMT_CODEC_BLOCK,		/**< data and codec of one data block */
+    STMT_CODEC_WRITE,		/**< replace one data block, compressed or not */
+    STMT_WRITE_RAW,		/**< splice data into one data block unless it is compressed */
+    STMT_GETATTR_INLINE,	/**< attributes, link count and inline data of an inode */
+    STMT_READ_INLINE,		/**< inline data and a range of data blocks of an inode */
+    STMT_READ_INLINE_CODEC,	/**< inline data and a range of data blocks of an inode, with their codecs */
+    STMT_INLINE_WRITE,		/**< splice data into the inline data of an inode */
+    STMT_INLINE_SPILL,		/**< copy the inline data of an inode to its first data block */
+    STMT_INLINE_DROP,		/**< drop the inline data of an inode */
+    STMT_MAX
+};
+
 /** Initalize pool and preallocate connections */
 int pool_init(struct mysqlfs_opt *opt);
 
+/** Start binding connections to threads and pinging idle ones, once serving requests */
+void pool_start();
+
 /** Close all connections and cleanup pool */
 void pool_cleanup();
 
-/** Get DB connection from pool */
+/** Get DB connection from pool, waiting for one if max_conns are in use */
 void *pool_get();
 
+/** Get DB connection from pool if one is free without waiting */
+void *pool_tryget();
+
 /** Put DB connection back to the pool */
 void pool_put(void *conn);
+
+/** Get a statement prepared on a pooled connection, preparing it from sql if needed */
+MYSQL_STMT *pool_stmt(MYSQL *mysql, enum pool_stmt_id id, const char *sql);
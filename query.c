@@ -19,21 +19,328 @@
 #include <fcntl.h>
 #include <time.h>
 #include <libgen.h>
-#include <fuse.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #ifdef HAVE_MYSQL_MYSQL_H
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
 #endif
 #ifdef HAVE_MYSQL_H
 #include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
 #endif
 
 #include "mysqlfs.h"
 #include "query.h"
+#include "pool.h"
+#include "cache.h"
 #include "log.h"
+#include "sha256.h"
+#include "codec.h"
+#include "async.h"
+#include "gc.h"
 
 #define SQL_MAX 10240
 #define INODE_CACHE_MAX 4096
 
+/** maximum number of bytes query_write() sends in one INSERT; escaped, this stays well below the default max_allowed_packet */
+#define WRITE_BATCH_BYTES (1024 * 1024)
+
+/** smallest share of a read that query_read() fetches over a connection of its own; see read_striped() */
+#define READ_STRIPE_BYTES (256 * 1024)
+
+/** version of the stored procedures of schema.sql this code calls; see call_procedure() */
+#define PROCEDURES_VERSION 2
+
+/** number of inode numbers inode_alloc() reserves at a time */
+#define INODE_RANGE 64
+
+/** write_extents() only appends to an extent writes of at least 1/EXTENT_APPEND_RATIO of its length */
+#define EXTENT_APPEND_RATIO 16
+
+size_t data_block_size = DATA_BLOCK_SIZE;
+size_t data_extent_size = 0;
+int data_dedup = 0;
+size_t data_inline_size = 0;
+int data_codec = CODEC_NONE;
+int data_codecs = 0;
+unsigned int stripe_width = 1;
+int data_gc = 0;
+
+/** non-zero while the stored procedures of PROCEDURES_VERSION are installed; see query_superblock() */
+static int procedures = 0;
+
+/** non-zero if inode numbers come from the inode_seq table rather than AUTO_INCREMENT; see query_superblock() */
+static int inode_ranges = 0;
+
+/** the range of inode numbers reserved by inode_alloc(), inode_next up to but not including inode_end */
+static long inode_next, inode_end;
+static pthread_mutex_t inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Splice the data of STMT_WRITE_BLOCK and STMT_WRITE_RAW into an existing row; see write_one_block() */
+#define SPLICE_BLOCK \
+	"CONCAT(RPAD(IFNULL(data, ''), ?, '\\0'), " \
+	    "SUBSTRING(VALUES(data) FROM ?), " \
+	    "SUBSTRING(IFNULL(data, '') FROM ?))"
+
+/** SQL of the per-connection prepared statements (see pool_stmt()) */
+static const char *stmt_sql[STMT_MAX] = {
+    [STMT_GETATTR] =
+	"SELECT mode, uid, gid, ctime, atime, mtime, size, "
+	"(SELECT COUNT(inode) FROM tree WHERE tree.inode=inodes.inode) "
+	"FROM inodes WHERE inode=?",
+    [STMT_LOOKUP] =
+	"SELECT inode FROM tree WHERE parent=? AND name=?",
+    [STMT_READDIR] =
+	"SELECT tree.name, tree.inode, inodes.mode, inodes.uid, inodes.gid, "
+	"inodes.ctime, inodes.atime, inodes.mtime, inodes.size, "
+	"(SELECT COUNT(inode) FROM tree AS links WHERE links.inode=tree.inode) "
+	"FROM tree INNER JOIN inodes ON tree.inode = inodes.inode WHERE tree.parent=? "
+	"ORDER BY tree.name LIMIT ?, ?",
+    [STMT_READDIR_AFTER] =
+	"SELECT tree.name, tree.inode, inodes.mode, inodes.uid, inodes.gid, "
+	"inodes.ctime, inodes.atime, inodes.mtime, inodes.size, "
+	"(SELECT COUNT(inode) FROM tree AS links WHERE links.inode=tree.inode) "
+	"FROM tree INNER JOIN inodes ON tree.inode = inodes.inode "
+	"WHERE tree.parent=? AND tree.name>? ORDER BY tree.name LIMIT ?",
+    [STMT_READ_BLOCKS] =
+	"SELECT seq, data FROM data_blocks "
+	"WHERE inode=? AND seq>=? AND seq<=? ORDER BY seq ASC",
+    [STMT_WRITE_BLOCK] =
+	"INSERT INTO data_blocks (inode, seq, data) "
+	"VALUES (?, ?, CONCAT(REPEAT('\\0', ?), ?)) "
+	"ON DUPLICATE KEY UPDATE data=" SPLICE_BLOCK,
+    [STMT_SIZE_GROW] =
+	"UPDATE inodes SET size=GREATEST(size, ?) WHERE inode=?",
+    [STMT_INUSE_INC] =
+	"UPDATE inodes SET inuse = inuse + ? WHERE inode=?",
+    [STMT_READ_EXTENTS] =
+	"SELECT GREATEST(pos, ?), "
+	"SUBSTRING(data FROM GREATEST(? - pos, 0) + 1 FOR ? - GREATEST(pos, ?)) "
+	"FROM data_extents WHERE inode=? AND pos>? AND pos<? ORDER BY pos ASC",
+    [STMT_EXTENT_MAP] =
+	"SELECT pos, IFNULL(LENGTH(data), 0) FROM data_extents "
+	"WHERE inode=? AND pos>=? AND pos<=? ORDER BY pos ASC",
+    [STMT_EXTENT_INSERT] =
+	"INSERT INTO data_extents (inode, pos, data) VALUES (?, ?, ?)",
+    [STMT_EXTENT_APPEND] =
+	"UPDATE data_extents SET data=CONCAT(data, ?) WHERE inode=? AND pos=?",
+    [STMT_EXTENT_SPLICE] =
+	"UPDATE data_extents SET data=INSERT(data, ?, ?, ?) WHERE inode=? AND pos=?",
+    [STMT_READ_DEDUP] =
+	"SELECT d.seq, IFNULL(d.data, s.data) FROM data_blocks d "
+	"LEFT JOIN block_store s ON s.hash = d.hash "
+	"WHERE d.inode=? AND d.seq>=? AND d.seq<=? ORDER BY d.seq ASC",
+    [STMT_DEDUP_HASH] =
+	"SELECT hash FROM data_blocks WHERE inode=? AND seq=?",
+    [STMT_DEDUP_BLOCK] =
+	"SELECT d.hash, IFNULL(d.data, s.data) FROM data_blocks d "
+	"LEFT JOIN block_store s ON s.hash = d.hash WHERE d.inode=? AND d.seq=?",
+    [STMT_DEDUP_REF] =
+	"UPDATE block_store SET refs=refs+1 WHERE hash=?",
+    [STMT_DEDUP_STORE] =
+	"INSERT INTO block_store (hash, refs, data) VALUES (?, 1, ?) "
+	"ON DUPLICATE KEY UPDATE refs=refs+1",
+    [STMT_DEDUP_MAP] =
+	"INSERT INTO data_blocks (inode, seq, data, hash) VALUES (?, ?, NULL, ?) "
+	"ON DUPLICATE KEY UPDATE data=NULL, hash=VALUES(hash)",
+    [STMT_DEDUP_UNREF] =
+	"UPDATE block_store SET refs=refs-1 WHERE hash=?",
+    [STMT_DEDUP_DROP] =
+	"DELETE FROM block_store WHERE hash=? AND refs<=0",
+    [STMT_READ_CODEC] =
+	"SELECT seq, data, codec FROM data_blocks "
+	"WHERE inode=? AND seq>=? AND seq<=? ORDER BY seq ASC",
+    [STMT_CODEC_BLOCK] =
+	"SELECT data, codec FROM data_blocks WHERE inode=? AND seq=?",
+    [STMT_CODEC_WRITE] =
+	"INSERT INTO data_blocks (inode, seq, data, codec) VALUES (?, ?, ?, ?) "
+	"ON DUPLICATE KEY UPDATE data=VALUES(data), codec=VALUES(codec)",
+    [STMT_WRITE_RAW] =
+	"INSERT INTO data_blocks (inode, seq, data) "
+	"VALUES (?, ?, CONCAT(REPEAT('\\0', ?), ?)) "
+	"ON DUPLICATE KEY UPDATE data=IF(codec=0, " SPLICE_BLOCK ", data)",
+    [STMT_GETATTR_INLINE] =
+	"SELECT mode, uid, gid, ctime, atime, mtime, size, "
+	"(SELECT COUNT(inode) FROM tree WHERE tree.inode=inodes.inode), inline_data "
+	"FROM inodes WHERE inode=?",
+    [STMT_READ_INLINE] =
+	"SELECT 0 AS seq, inline_data AS data FROM inodes "
+	"WHERE inode=? AND inline_data IS NOT NULL UNION ALL "
+	"SELECT seq, data FROM data_blocks "
+	"WHERE inode=? AND seq>=? AND seq<=? ORDER BY seq ASC",
+    [STMT_READ_INLINE_CODEC] =
+	"SELECT 0 AS seq, inline_data AS data, 0 AS codec FROM inodes "
+	"WHERE inode=? AND inline_data IS NOT NULL UNION ALL "
+	"SELECT seq, data, codec FROM data_blocks "
+	"WHERE inode=? AND seq>=? AND seq<=? ORDER BY seq ASC",
+    [STMT_INLINE_WRITE] =
+	"UPDATE inodes SET inline_data=CONCAT(RPAD(inline_data, ?, '\\0'), ?, "
+	    "SUBSTRING(inline_data FROM ?)), size=GREATEST(size, ?) "
+	"WHERE inode=? AND inline_data IS NOT NULL",
+    [STMT_INLINE_SPILL] =
+	"INSERT INTO data_blocks (inode, seq, data) "
+	"SELECT inode, 0, RPAD(inline_data, GREATEST(LENGTH(inline_data), ?), '\\0') "
+	"FROM inodes WHERE inode=? AND LENGTH(inline_data) > 0",
+    [STMT_INLINE_DROP] =
+	"UPDATE inodes SET inline_data=NULL WHERE inode=? AND inline_data IS NOT NULL",
+};
+
+/** Set up b to pass or receive a 64-bit integer in *val */
+static inline void bind_longlong(MYSQL_BIND *b, long long *val)
+{
+    memset(b, 0, sizeof(MYSQL_BIND));
+    b->buffer_type = MYSQL_TYPE_LONGLONG;
+    b->buffer = val;
+}
+
+/** Set up b to pass or receive a string or blob of up to size bytes at buf; *len is its actual length */
+static inline void bind_buffer(MYSQL_BIND *b, enum enum_field_types type,
+			       const char *buf, unsigned long size, unsigned long *len)
+{
+    memset(b, 0, sizeof(MYSQL_BIND));
+    b->buffer_type = type;
+    b->buffer = (char *)buf;
+    b->buffer_length = size;
+    b->length = len;
+}
+
+/**
+ * Run one of the prepared statements of a connection with the given
+ * parameters.  If the connection turns out to be lost, mysql_ping() brings
+ * it back (see MYSQL_OPT_RECONNECT in pool.c) and the statement is prepared
+ * and run once more.  Statements that return rows must be finished with
+ * mysql_stmt_free_result().
+ *
+ * @return the executed statement; NULL on error (logged)
+ * @param mysql handle to connection to the database, from pool_get()
+ * @param id statement to run
+ * @param params bound parameters, one per placeholder
+ */
+static MYSQL_STMT *stmt_execute(MYSQL *mysql, enum pool_stmt_id id, MYSQL_BIND *params)
+{
+    MYSQL_STMT *stmt;
+    unsigned int err;
+    int retry = 1;
+
+    log_printf(LOG_D_SQL, "stmt=%s\n", stmt_sql[id]);
+again:
+    stmt = pool_stmt(mysql, id, stmt_sql[id]);
+    if (!stmt) {
+	if (retry-- && mysql_ping(mysql) == 0)
+	    goto again;
+	return NULL;
+    }
+
+    if (!mysql_stmt_bind_param(stmt, params) && !mysql_stmt_execute(stmt))
+	return stmt;
+
+    err = mysql_stmt_errno(stmt);
+    if (retry-- && (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST) &&
+	mysql_ping(mysql) == 0)
+	goto again;
+
+    log_printf(LOG_ERROR, "ERROR: mysql_stmt_execute()\n");
+    log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+    return NULL;
+}
+
+/**
+ * Run one or more statements, separated by semicolons.  Rows they
+ * return are discarded, e.g. those of a SELECT ... FOR UPDATE run only for
+ * its locks.  The statements after the first fail on their own (see
+ * mysql_next_result()).
+ *
+ * @return 0 on success
+ * @return -EEXIST if a statement ran into a duplicate key
+ * @return -EIO on other errors (logged)
+ * @param mysql handle to connection to the database
+ * @param sql the statements
+ */
+static int run_statements(MYSQL *mysql, const char *sql)
+{
+    MYSQL_RES *result;
+    int next;
+
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql))
+        next = 1;
+    else
+        do {
+            if ((result = mysql_store_result(mysql)) != NULL)
+                mysql_free_result(result);
+        } while ((next = mysql_next_result(mysql)) == 0);
+    if (next > 0) {
+        if (mysql_errno(mysql) == ER_DUP_ENTRY)
+            return -EEXIST;
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * CALL one of the stored procedures of schema.sql, which answer with one
+ * row of integers, and store its first n values into vals.  The status
+ * result that ends every CALL is read too, leaving the connection ready for
+ * the next query.  If the procedure is missing or not allowed (no EXECUTE
+ * grant) the procedures are not used again, and the caller falls back on
+ * the statements they replace.
+ *
+ * @return 0 on success
+ * @return -ENOSYS if the procedures cannot be called
+ * @return -EEXIST if the procedure ran into a duplicate key
+ * @return -EIO on other errors (logged)
+ * @param mysql handle to connection to the database
+ * @param sql the CALL statement
+ * @param vals where to store the values of the row
+ * @param n number of values to store
+ */
+static int call_procedure(MYSQL *mysql, const char *sql, long long *vals, int n)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int i, ret = -EIO, next;
+    unsigned int err;
+
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        err = mysql_errno(mysql);
+        if (err == ER_SP_DOES_NOT_EXIST || err == ER_PROCACCESS_DENIED_ERROR) {
+            log_printf(LOG_WARNING, "Not using the stored procedures: %s\n", mysql_error(mysql));
+            procedures = 0;
+            return -ENOSYS;
+        }
+        if (err == ER_DUP_ENTRY)
+            return -EEXIST;
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+
+    do {
+        result = mysql_store_result(mysql);
+        if (!result)
+            continue;
+        if (ret < 0 && (row = mysql_fetch_row(result)) != NULL &&
+            mysql_num_fields(result) >= (unsigned int)n) {
+            for (i = 0; i < n; i++)
+                vals[i] = row[i] ? strtoll(row[i], NULL, 10) : 0;
+            ret = 0;
+        }
+        mysql_free_result(result);
+    } while ((next = mysql_next_result(mysql)) == 0);
+
+    if (next > 0) {
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    if (ret < 0)
+        log_printf(LOG_ERROR, "ERROR: %s returned no row\n", sql);
+    return ret;
+}
+
 static inline int lock_inode(MYSQL *mysql, long inode)
 {
     // TODO
@@ -49,14 +356,14 @@ static inline int unlock_inode(MYSQL *mysql, long inode)
 static struct data_blocks_info *
 fill_data_blocks_info(struct data_blocks_info *info, size_t size, off_t offset)
 {
-    info->seq_first = offset / DATA_BLOCK_SIZE;
-    info->offset_first = offset % DATA_BLOCK_SIZE;
+    info->seq_first = offset / data_block_size;
+    info->offset_first = offset % data_block_size;
 
-    unsigned long  nr_following_blocks = ((info->offset_first + size) / DATA_BLOCK_SIZE);	
-    info->length_first = nr_following_blocks > 0 ? DATA_BLOCK_SIZE - info->offset_first : size;
+    unsigned long  nr_following_blocks = ((info->offset_first + size) / data_block_size);	
+    info->length_first = nr_following_blocks > 0 ? data_block_size - info->offset_first : size;
 
     info->seq_last = info->seq_first + nr_following_blocks;
-    info->length_last = (info->offset_first + size) % DATA_BLOCK_SIZE;
+    info->length_last = (info->offset_first + size) % data_block_size;
     /* offset in last block (if it's a different one from the first block) 
      * is always 0 */
 
@@ -65,79 +372,184 @@ fill_data_blocks_info(struct data_blocks_info *info, size_t size, off_t offset)
 
 /**
  * Get the attributes of an inode, filling in a struct stat.  This function
- * uses query_inode_full() to get the inode and nlinks of the given path, then
- * reads the inode data from the database, storing this data into the provided
- * structure.
+ * uses query_inode_full() to get the inode of the given path, then returns
+ * its attributes from the attribute cache (see acache_lookup()) or, failing
+ * that, reads the inode data and the number of links from the database with
+ * the STMT_GETATTR prepared statement, caching the result.  Where small files
+ * are kept inline (see data_inline_size) STMT_GETATTR_INLINE fetches the
+ * inline data along with them and enters it in the block cache, so reading
+ * the file after it is looked up needs no query of its own.
  *
  * @return 0 if successful
- * @return -EIO if the result of mysql_query() is non-zero
- * @return -ENOENT if the inode at the give path is not found (actually, if the number of results is not exactly 1)
+ * @return -EIO if the statement fails
+ * @return -ENOENT if the inode is not found
  * @param mysql handle to connection to the database
- * @param path pathname to check
+ * @param inode inode to check
  * @param stbuf struct stat to fill with the inode contents
  */
-int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
+int query_getattr(MYSQL *mysql, long inode, struct stat *stbuf)
 {
-    int ret;
-    long inode, nlinks;
-    char sql[SQL_MAX];
-    MYSQL_RES* result;
-    MYSQL_ROW row;
-    ret = query_inode_full(mysql, path, NULL, 0, &inode, NULL, &nlinks);
-    if (ret < 0)
-      return ret;
-
-    snprintf(sql, SQL_MAX,
-             "SELECT inode, mode, uid, gid, ctime, atime, mtime, size "
-             "FROM inodes WHERE inode=%ld",
-             inode);
+    int ret, i;
+    long long id, val[8];
+    unsigned long inline_len = 0, gen;
+    my_bool inline_null = 1;
+    char *inline_data;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[1], res[9];
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (acache_lookup(inode, stbuf))
+      return 0;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    id = inode;
+    bind_longlong(&param[0], &id);
+    gen = bcache_generation(inode);
+    stmt = stmt_execute(mysql, data_inline_size ? STMT_GETATTR_INLINE : STMT_GETATTR, param);
+    if (!stmt)
         return -EIO;
-    }
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    for (i = 0; i < 8; i++)
+        bind_longlong(&res[i], &val[i]);
+    /* Inline data is fetched below, once its length is known */
+    bind_buffer(&res[8], MYSQL_TYPE_BLOB, NULL, 0, &inline_len);
+    res[8].is_null = &inline_null;
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "ERROR: mysql_stmt_bind_result()\n");
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
         return -EIO;
     }
 
-    if(mysql_num_rows(result) != 1){
-        mysql_free_result(result);
+    ret = mysql_stmt_fetch(stmt);
+    if (ret == MYSQL_NO_DATA) {
+        mysql_stmt_free_result(stmt);
         return -ENOENT;
     }
-    row = mysql_fetch_row(result);
-    if(!row){
-        log_printf(LOG_ERROR, "ERROR: mysql_fetch_row()\n");
+    if (ret && ret != MYSQL_DATA_TRUNCATED) {
+        log_printf(LOG_ERROR, "ERROR: mysql_stmt_fetch()\n");
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
         return -EIO;
     }
 
+    /* Inline data is the whole file, so it makes block 0 */
+    if (!inline_null && inline_len <= data_block_size &&
+        (inline_data = malloc(inline_len + 1)) != NULL) {
+        bind_buffer(&res[8], MYSQL_TYPE_BLOB, inline_data, inline_len, &inline_len);
+        if (!inline_len || !mysql_stmt_fetch_column(stmt, &res[8], 8, 0))
+            bcache_enter(inode, 0, inline_data, inline_len, gen);
+        free(inline_data);
+    }
+    mysql_stmt_free_result(stmt);
+
     stbuf->st_ino = inode;
-    stbuf->st_mode = atoi(row[1]);
-    stbuf->st_uid = atol(row[2]);
-    stbuf->st_gid = atol(row[3]);
-    stbuf->st_ctime = atol(row[4]);
-    stbuf->st_atime = atol(row[5]);
-    stbuf->st_mtime = atol(row[6]);
-    stbuf->st_size = atol(row[7]);
-    stbuf->st_nlink = nlinks;
+    stbuf->st_mode = val[0];
+    stbuf->st_uid = val[1];
+    stbuf->st_gid = val[2];
+    stbuf->st_ctime = val[3];
+    stbuf->st_atime = val[4];
+    stbuf->st_mtime = val[5];
+    stbuf->st_size = val[6];
+    stbuf->st_nlink = val[7];
+    stbuf->st_blksize = data_block_size;
+
+    acache_enter(inode, stbuf);
 
-    mysql_free_result(result);
+    return 0;
+}
+
+/**
+ * Look up one name in a directory with the STMT_LOOKUP prepared statement.
+ *
+ * @return 0 if found, with the inode stored in *inode
+ * @return -ENOENT if there is no such name in the directory
+ * @return -EIO if the statement fails
+ * @param mysql handle to connection to the database
+ * @param parent inode of the directory
+ * @param name name within the directory
+ * @param inode where to store the inode
+ */
+static int lookup_entry(MYSQL *mysql, long parent, const char *name, long *inode)
+{
+    int ret;
+    long long id = parent, val;
+    unsigned long name_len = strlen(name);
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[2], res[1];
+
+    bind_longlong(&param[0], &id);
+    bind_buffer(&param[1], MYSQL_TYPE_STRING, name, name_len, &name_len);
+    stmt = stmt_execute(mysql, STMT_LOOKUP, param);
+    if (!stmt)
+        return -EIO;
+
+    bind_longlong(&res[0], &val);
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
+    }
+
+    ret = mysql_stmt_fetch(stmt);
+    mysql_stmt_free_result(stmt);
+    if (ret == MYSQL_NO_DATA)
+        return -ENOENT;
+    if (ret) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        return -EIO;
+    }
 
+    *inode = val;
     return 0;
 }
 
+/**
+ * Look up one name in a directory, through the dentry cache (see
+ * dcache_lookup()).  On a miss the database is asked and the answer,
+ * positive or negative, is entered into the cache.
+ *
+ * @return 0 if found, with the inode stored in *inode
+ * @return -ENOENT if there is no such name in the directory
+ * @return -ENAMETOOLONG if the name is longer than 255 characters
+ * @return -EIO if the statement fails
+ * @param mysql handle to connection to the database
+ * @param parent inode of the directory
+ * @param name name within the directory
+ * @param inode where to store the inode
+ */
+int query_lookup(MYSQL *mysql, long parent, const char *name, long *inode)
+{
+    int ret;
+
+    if (strlen(name) > 255)
+        return -ENAMETOOLONG;
+
+    ret = dcache_lookup(parent, name, inode);
+    if (ret > 0)
+        return 0;
+    if (ret < 0)
+        return ret;
+
+    ret = lookup_entry(mysql, parent, name, inode);
+    if (ret == -ENOENT)
+        dcache_enter_negative(parent, name);
+    else if (ret == 0)
+        dcache_enter(parent, name, *inode);
+    return ret;
+}
+
 /**
  * Walk the directory tree to find the inode at the given absolute path,
- * storing name, inode, parent inode, and number of links.  Last developer of
- * this function indicates that the pathname may overflow -- sounds like a
- * good testcase :)
+ * storing name, inode, parent inode, and number of links.
+ *
+ * Path components are first resolved through the dentry cache (see
+ * dcache_lookup()); only the part of the path below the deepest cached
+ * directory is sent to the database, as a chain of LEFT JOINs over tree that
+ * returns the inode of every remaining component.  Each of those is entered
+ * into the cache, and the first missing component is cached as a negative
+ * entry, so a warm lookup costs no round trip at all.  The common case of
+ * only the last component missing from the cache is answered by the
+ * STMT_LOOKUP prepared statement instead (see lookup_entry()).  The number of links
+ * is only counted (by a subquery) if nlinks is requested.
  *
  * If any of the name, inode, parent, or nlinks are given, those values will be
  * recorded from the inode data to the given buffers.  The name is written to
@@ -146,6 +558,7 @@ int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
  * @return 0 if successful
  * @return -EIO if the result of mysql_query() is non-zero
  * @return -ENOENT if the file at this path is not found
+ * @return -ENAMETOOLONG if a path component is longer than 255 characters
  * @param mysql handle to connection to the database
  * @param path (absolute) pathname of inode to find
  * @param name destination to record (relative) name of the inode (may be NULL)
@@ -158,86 +571,157 @@ int query_inode_full(MYSQL *mysql, const char *path, char *name, size_t name_len
 		      long *inode, long *parent, long *nlinks)
 {
     long ret;
-    char sql[SQL_MAX*4];
+    char *sql = NULL;
+    size_t sql_len, pos;
     MYSQL_RES* result;
     MYSQL_ROW row;
 
-    int depth = 0;
+    int depth = 0, resolved = -1, base, i;
     char *pathptr = strdup(path), *pathptr_saved = pathptr;
     char *nameptr, *saveptr = NULL;
-    char sql_from[SQL_MAX/3], sql_where[SQL_MAX/3];
-    char *sql_from_end = sql_from, *sql_where_end = sql_where;
+    char **names;	/* names[i] is the i-th path component, names[0] is the root */
+    long *inodes;	/* inodes[i] is the inode names[i] resolves to */
     char esc_name[PATH_MAX];
 
-    // TODO: Handle too long or too nested paths that don't fit in SQL_MAX!!!
-    sql_from_end += snprintf(sql_from_end, SQL_MAX, "tree AS t0");
-    sql_where_end += snprintf(sql_where_end, SQL_MAX, "t0.parent IS NULL");
+    if (!pathptr)
+	return -ENOMEM;
+
+    /* One component per '/' at most, plus the root itself. */
+    for (i = 0, sql_len = 2; path[i]; i++)
+	if (path[i] == '/')
+	    sql_len++;
+    names = malloc(sql_len * (sizeof(char *) + sizeof(long)));
+    if (!names) {
+	free(pathptr_saved);
+	return -ENOMEM;
+    }
+    inodes = (long *)(names + sql_len);
+
+    names[0] = "/";
+    sql_len = 256;
     while ((nameptr = strtok_r(pathptr, "/", &saveptr)) != NULL) {
-        if (depth++ == 0) {
-	  pathptr = NULL;
+	pathptr = NULL;
+	if (strlen(nameptr) > 255) {
+	    ret = -ENAMETOOLONG;
+	    goto out;
 	}
+	names[++depth] = nameptr;
+	sql_len += 128 + 2 * strlen(nameptr);
+    }
 
-        if (strlen(nameptr) > 255) {
-            free(pathptr_saved);
-            return -ENAMETOOLONG;
-        }
+    /* Walk down as far as the dentry cache takes us. */
+    ret = dcache_lookup(DCACHE_ROOT_PARENT, "/", &inodes[0]);
+    if (ret > 0) {
+	resolved = 0;
+	while (resolved < depth &&
+	       (ret = dcache_lookup(inodes[resolved], names[resolved + 1],
+				    &inodes[resolved + 1])) > 0)
+	    resolved++;
+	if (ret < 0)
+	    goto out;
+    }
 
-        mysql_real_escape_string(mysql, esc_name, nameptr, strlen(nameptr));
-	sql_from_end += snprintf(sql_from_end, SQL_MAX, " LEFT JOIN tree AS t%d ON t%d.inode = t%d.parent",
-		 depth, depth-1, depth);
-	sql_where_end += snprintf(sql_where_end, SQL_MAX, " AND t%d.name = '%s'",
-		 depth, esc_name);
+    if (resolved == depth && !nlinks)
+	goto found;
+
+    if (resolved >= 0 && resolved == depth - 1 && !nlinks) {
+	ret = lookup_entry(mysql, inodes[resolved], names[depth], &inodes[depth]);
+	if (ret == -ENOENT)
+	    dcache_enter_negative(inodes[resolved], names[depth]);
+	if (ret < 0)
+	    goto out;
+	dcache_enter(inodes[resolved], names[depth], inodes[depth]);
+	goto found;
     }
-    free(pathptr_saved);
 
-    // TODO: Only run subquery when pointer to nlinks != NULL, otherwise we don't need it.
-    snprintf(sql, SQL_MAX, "SELECT t%d.inode, t%d.name, t%d.parent, "
-	     		   "       (SELECT COUNT(inode) FROM tree AS t%d WHERE t%d.inode=t%d.inode) "
-			   "               AS nlinks "
-	     		   "FROM %s WHERE %s",
-	     depth, depth, depth, 
-	     depth+1, depth+1, depth,
-	     sql_from, sql_where);
+    /* Resolve the rest starting at the deepest known directory. */
+    sql = malloc(sql_len);
+    if (!sql) {
+	ret = -ENOMEM;
+	goto out;
+    }
+    base = resolved < 0 ? 0 : resolved;
+    pos = snprintf(sql, sql_len, "SELECT t%d.inode", base);
+    for (i = base + 1; i <= depth; i++)
+	pos += snprintf(sql + pos, sql_len - pos, ", t%d.inode", i);
+    if (nlinks)
+	pos += snprintf(sql + pos, sql_len - pos,
+			", (SELECT COUNT(inode) FROM tree AS tl WHERE tl.inode = t%d.inode)",
+			depth);
+    pos += snprintf(sql + pos, sql_len - pos, " FROM tree AS t%d", base);
+    for (i = base + 1; i <= depth; i++) {
+	mysql_real_escape_string(mysql, esc_name, names[i], strlen(names[i]));
+	pos += snprintf(sql + pos, sql_len - pos,
+			" LEFT JOIN tree AS t%d ON t%d.parent = t%d.inode AND t%d.name = '%s'",
+			i, i, i - 1, i, esc_name);
+    }
+    if (resolved < 0)
+	snprintf(sql + pos, sql_len - pos, " WHERE t0.parent IS NULL LIMIT 1");
+    else
+	snprintf(sql + pos, sql_len - pos, " WHERE t%d.inode = %ld LIMIT 1",
+		 base, inodes[base]);
+
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     ret = mysql_query(mysql, sql);
     if(ret){
         log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+        ret = -EIO;
+	goto out;
     }
 
     result = mysql_store_result(mysql);
     if(!result){
         log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+        ret = -EIO;
+	goto out;
     }
 
-    if(mysql_num_rows(result) != 1){
+    /* No row at all: the root (or the cached base directory) is gone. */
+    row = mysql_fetch_row(result);
+    if(!row){
         mysql_free_result(result);
-        return -ENOENT;
+        ret = -ENOENT;
+	goto out;
     }
 
-    row = mysql_fetch_row(result);
-    if(!row){
-        log_printf(LOG_ERROR, "ERROR: mysql_fetch_row()\n");
-        return -EIO;
+    for (i = base; i <= depth; i++) {
+	if (!row[i - base]) {
+	    if (i > 0)
+		dcache_enter_negative(inodes[i - 1], names[i]);
+	    mysql_free_result(result);
+	    ret = -ENOENT;
+	    goto out;
+	}
+	inodes[i] = atol(row[i - base]);
+	if (i == 0)
+	    dcache_enter(DCACHE_ROOT_PARENT, "/", inodes[0]);
+	else if (i > resolved)
+	    dcache_enter(inodes[i - 1], names[i], inodes[i]);
     }
-    log_printf(LOG_D_OTHER, "query_inode(path='%s') => %s, %s, %s, %s\n",
-	       path, row[0], row[1], row[2], row[3]);
-    
-    if (inode)
-        *inode = atol(row[0]);
-    if (name)
-        snprintf(name, name_len, "%s", row[1]);
-    if (parent)
-        *parent = row[2] ? atol(row[2]) : -1;	/* parent may be NULL */
     if (nlinks)
-        *nlinks = atol(row[3]);
+        *nlinks = atol(row[depth - base + 1]);
 
     mysql_free_result(result);
 
-    return 0;
+found:
+    log_printf(LOG_D_OTHER, "query_inode(path='%s') => %ld, %s, %ld\n",
+	       path, inodes[depth], names[depth], depth ? inodes[depth - 1] : -1L);
+
+    if (inode)
+        *inode = inodes[depth];
+    if (name)
+        snprintf(name, name_len, "%s", names[depth]);
+    if (parent)
+        *parent = depth ? inodes[depth - 1] : -1;	/* root has no parent */
+    ret = 0;
+
+out:
+    free(sql);
+    free(names);
+    free(pathptr_saved);
+    return ret;
 }
 
 /**
@@ -262,16 +746,26 @@ long query_inode(MYSQL *mysql, const char *path)
     return inode;
 }
 
+static int truncate_dedup(MYSQL *mysql, long inode, const struct data_blocks_info *info);
+static int truncate_codec_block(MYSQL *mysql, long inode, const struct data_blocks_info *info);
+static int inline_maybe(long inode);
+static int inline_spill(MYSQL *mysql, long inode, off_t end);
+
 /**
  * Change the length of a file, truncating any additional data blocks and
  * immediately deleting the data blocks past the truncation length.  Function
  * works by deleting whole blocks past the truncation point, limiting the
- * partially-cleared block, and zeroing the extra part of the buffer.
- * Called by mysqlfs_truncate().
+ * partially-cleared block, and zeroing the extra part of the buffer.  With a
+ * gc_queue table the whole blocks are left for the collector instead, if
+ * the old size reached past the new end (see gc_truncate()), so a truncate
+ * of a large file returns at once.  The
+ * inline data of a file kept inline is cut or padded along with the size,
+ * unless the file grows past data_inline_size, which moves it to data_blocks
+ * first.  Called by mysqlfs_truncate().
  *
  * @see http://linux.die.net/man/2/truncate
  *
- * @return 0 on success; non-zero return of mysql_query() on error
+ * @return 0 on success; -EIO, or another negative errno, on error
  * @param mysql handle to connection to the database
  * @param inode node to operate on
  * @param length new length of file
@@ -279,40 +773,106 @@ long query_inode(MYSQL *mysql, const char *path)
 int query_truncate(MYSQL *mysql, long inode, off_t length)
 {
     int ret;
+    long long end;
     char sql[SQL_MAX];
     struct data_blocks_info info;
+    struct stat st;
 
     fill_data_blocks_info(&info, length, 0);
 
     lock_inode(mysql, inode);
 
-    snprintf(sql, SQL_MAX,
-             "DELETE FROM data_blocks WHERE inode=%ld AND seq > %ld",
-	     inode, info.seq_last);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+    /* Past the new end the collector drops the rows, after any it still
+     * had to drop before the end moves over them.  Only a file that had
+     * rows past the new end is queued: not a grow, nor an O_TRUNC of an
+     * empty file.  The size is read under the inode lock: the acache may
+     * hold an older, smaller one, written over by another mount */
+    if (data_gc) {
+        end = data_extent_size ? length : (long long)info.seq_last + 1;
+        if ((st.st_size = query_size(mysql, inode)) < 0) {
+            ret = st.st_size;
+            goto err_out;
+        }
+        if ((ret = gc_grow(mysql, inode, end, length > st.st_size)))
+            goto err_out;
+        if (st.st_size > (data_extent_size ? end : end * (long long)data_block_size) &&
+            (ret = gc_truncate(mysql, inode, end)))
+            goto err_out;
+    }
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE data_blocks SET data=RPAD(data, %zu, '\\0') "
-	     "WHERE inode=%ld AND seq=%ld",
-             info.length_last, inode, info.seq_last);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+    if (data_inline_size && length > (off_t)data_inline_size && inline_maybe(inode))
+        if ((ret = inline_spill(mysql, inode, length))) goto err_out;
+
+    if (data_extent_size) {
+        /* Drop the extents past the new end, cut back the one across it;
+         * growing a file leaves a hole, which reads as zeroes */
+        if (!data_gc) {
+            snprintf(sql, SQL_MAX,
+                     "DELETE FROM data_extents WHERE inode=%ld AND pos >= %lld",
+                     inode, (long long)length);
+            log_printf(LOG_D_SQL, "sql=%s\n", sql);
+            if ((ret = mysql_query(mysql, sql))) goto err_out;
+        }
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE inodes SET size=%lld, mtime=UNIX_TIMESTAMP(NOW()), ctime=UNIX_TIMESTAMP(NOW()) WHERE inode=%ld",
-             (long long)length, inode);
+        snprintf(sql, SQL_MAX,
+                 "UPDATE data_extents SET data=LEFT(data, %lld - pos) "
+                 "WHERE inode=%ld AND pos < %lld AND pos + LENGTH(data) > %lld",
+                 (long long)length, inode, (long long)length, (long long)length);
+        log_printf(LOG_D_SQL, "sql=%s\n", sql);
+        if ((ret = mysql_query(mysql, sql))) goto err_out;
+    } else if (data_dedup) {
+        if ((ret = truncate_dedup(mysql, inode, &info))) goto err_out;
+    } else {
+        if (!data_gc) {
+            snprintf(sql, SQL_MAX,
+                     "DELETE FROM data_blocks WHERE inode=%ld AND seq > %ld",
+                     inode, info.seq_last);
+            log_printf(LOG_D_SQL, "sql=%s\n", sql);
+            if ((ret = mysql_query(mysql, sql))) goto err_out;
+        }
+
+        if (data_codecs) {
+            if ((ret = truncate_codec_block(mysql, inode, &info))) goto err_out;
+        } else {
+            snprintf(sql, SQL_MAX,
+                     "UPDATE data_blocks SET data=RPAD(data, %zu, '\\0') "
+                     "WHERE inode=%ld AND seq=%ld",
+                     info.length_last, inode, info.seq_last);
+            log_printf(LOG_D_SQL, "sql=%s\n", sql);
+            if ((ret = mysql_query(mysql, sql))) goto err_out;
+        }
+    }
+
+    /* RPAD() leaves the inline data of a file not kept inline NULL */
+    if (data_inline_size && length <= (off_t)data_inline_size)
+        snprintf(sql, SQL_MAX,
+                 "UPDATE inodes SET size=%lld, inline_data=RPAD(inline_data, %lld, '\\0'), "
+                 "mtime=UNIX_TIMESTAMP(NOW()), ctime=UNIX_TIMESTAMP(NOW()) WHERE inode=%ld",
+                 (long long)length, (long long)length, inode);
+    else
+        snprintf(sql, SQL_MAX,
+                 "UPDATE inodes SET size=%lld, mtime=UNIX_TIMESTAMP(NOW()), ctime=UNIX_TIMESTAMP(NOW()) WHERE inode=%ld",
+                 (long long)length, inode);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     if ((ret = mysql_query(mysql, sql))) goto err_out;
 
+    st.st_size = length;
+    st.st_mtime = st.st_ctime = time(NULL);
+    acache_update(inode, ACACHE_SIZE | ACACHE_MTIME | ACACHE_CTIME, &st);
+    /* A block exactly data_inline_size long may be inline data too */
+    bcache_invalidate(inode, data_inline_size && length <= (off_t)data_inline_size ?
+                      0 : info.seq_last, BCACHE_TO_END);
+
     unlock_inode(mysql, inode);
 
     return 0;
 
 err_out:
+    bcache_invalidate(inode, info.seq_last, BCACHE_TO_END);
     unlock_inode(mysql, inode);
     log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-    return ret;
+    /* mysql_query() fails with a positive value */
+    return ret < 0 ? ret : -EIO;
 }
 
 /**
@@ -348,6 +908,9 @@ int query_mkdirentry(MYSQL *mysql, long inode, const char *name, long parent)
       return -EIO;
     }
 
+    dcache_enter(parent, name, inode);
+    acache_invalidate(inode);	/* nlinks changed */
+
     return 0;
 }
 
@@ -385,9 +948,12 @@ int query_rmdirentry(MYSQL *mysql, const char *name, long inode, long parent)
         return -EIO;
     }
 
-    if (mysql_num_rows(result) != 0)
+    if (mysql_num_rows(result) != 0) {
+        mysql_free_result(result);
         return -ENOTEMPTY;
-    
+    }
+    mysql_free_result(result);
+
     mysql_real_escape_string(mysql, esc_name, name, strlen(name));
     snprintf(sql, SQL_MAX,
              "DELETE FROM tree WHERE name='%s' AND parent=%ld",
@@ -400,79 +966,252 @@ int query_rmdirentry(MYSQL *mysql, const char *name, long inode, long parent)
       return -EIO;
     }
 
+    dcache_enter_negative(parent, name);
+    acache_invalidate(inode);	/* nlinks changed */
+
     return 0;
 }
 
+/**
+ * Remove a name from its directory, refusing a directory that is not empty,
+ * and mark the inode deleted once no name is left; an inode no longer open
+ * is purged right away (see query_set_deleted() and query_purge_deleted()).
+ * With the stored procedures of schema.sql installed all of this is one
+ * CALL of mysqlfs_unlink, otherwise one statement per step.
+ *
+ * @return 0 if successful
+ * @return -ENOENT if there is no such name in the directory
+ * @return -ENOTEMPTY if the name is a directory with entries
+ * @return -EIO if a statement fails
+ * @param mysql handle to connection to the database
+ * @param parent inode of the directory
+ * @param name name within the directory
+ */
+int query_unlink(MYSQL *mysql, long parent, const char *name)
+{
+    int ret;
+    long inode;
+    long long val[3];
+    char sql[SQL_MAX];
+    char esc_name[PATH_MAX * 2];
+
+    if (strlen(name) > 255)
+        return -ENAMETOOLONG;
+
+    if (procedures) {
+        /* A name known not to exist costs no round trip */
+        ret = dcache_lookup(parent, name, &inode);
+        if (ret < 0)
+            return ret;
+
+        mysql_real_escape_string(mysql, esc_name, name, strlen(name));
+        snprintf(sql, SQL_MAX, "CALL mysqlfs_unlink(%ld, '%s')", parent, esc_name);
+        ret = call_procedure(mysql, sql, val, 3);
+        if (ret != -ENOSYS) {
+            if (ret < 0)
+                return ret;
+            if (val[0] == 1) {
+                dcache_enter_negative(parent, name);
+                return -ENOENT;
+            }
+            if (val[0] == 2)
+                return -ENOTEMPTY;
+
+            dcache_enter_negative(parent, name);
+            acache_invalidate(val[1]);	/* nlinks changed */
+            if (val[2] > 0) {
+                bcache_invalidate(val[1], 0, BCACHE_TO_END);
+                gc_wake();
+            }
+            return 0;
+        }
+    }
+
+    ret = query_lookup(mysql, parent, name, &inode);
+    if (ret < 0)
+        return ret;
+
+    ret = query_rmdirentry(mysql, name, inode, parent);
+    if (ret < 0)
+        return ret;
+
+    /* query_set_deleted() leaves the flag alone while another name is left */
+    ret = query_set_deleted(mysql, inode);
+    if (ret < 0)
+        return ret;
+
+    return query_purge_deleted(mysql, inode);
+}
+
+/**
+ * Hand out the next inode number of the range this mount reserved from
+ * the inode_seq table, reserving the next INODE_RANGE numbers when it is
+ * used up.  The reservation is one UPDATE, which other mounts wait for
+ * only as long as it takes; numbers left unused at unmount are skipped.
+ *
+ * @return the inode number
+ * @return -EIO if the reservation fails (logged)
+ * @param mysql handle to connection to the database
+ */
+static long inode_alloc(MYSQL *mysql)
+{
+    long inode;
+    char sql[SQL_MAX];
+
+    pthread_mutex_lock(&inode_mutex);
+    if (inode_next == inode_end) {
+        snprintf(sql, SQL_MAX,
+                 "UPDATE inode_seq SET value=LAST_INSERT_ID(value + %d) WHERE name='inode'",
+                 INODE_RANGE);
+        log_printf(LOG_D_SQL, "sql=%s\n", sql);
+        if (mysql_query(mysql, sql)) {
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            pthread_mutex_unlock(&inode_mutex);
+            return -EIO;
+        }
+        if (mysql_affected_rows(mysql) != 1) {
+            log_printf(LOG_ERROR, "ERROR: no inode row in inode_seq\n");
+            pthread_mutex_unlock(&inode_mutex);
+            return -EIO;
+        }
+        inode_end = mysql_insert_id(mysql);
+        inode_next = inode_end - INODE_RANGE;
+    }
+    inode = inode_next++;
+    pthread_mutex_unlock(&inode_mutex);
+
+    return inode;
+}
+
 /**
  * Create an inode.  This function creates a child entry of the specified dev_t
- * type and mode in the "parent" directory given as the "parent".  Any parent
- * directory information (ie "dirname(path)") is stripped out, leaving only
- * the base pathname, but it has to be there (perhaps a bug?) since this
- * function wants to strip out the path information that might conflict with
- * the parent node's pathname.
+ * type and mode, named "name", in the directory given as the "parent".  The
+ * name "/" creates the root directory, which has no parent.  With the stored
+ * procedures of schema.sql installed, the tree and inodes rows are created
+ * by one CALL of mysqlfs_mknod (see call_procedure()); otherwise, if the
+ * inode number comes from a range reserved in advance (see inode_alloc()),
+ * by two INSERTs sent together, and else by an INSERT into tree, numbered
+ * by its AUTO_INCREMENT, and then one into inodes; either way in one
+ * transaction, rolled back if one fails.
  *
  * @see http://linux.die.net/man/2/mknod
  *
- * @return ID of new inode, or -ENOENT if the path contains no parent directory "/"
+ * @return ID of new inode
+ * @return -EINVAL if the name is empty or contains a "/"
+ * @return -EEXIST if the name exists
+ * @return -ENAMETOOLONG if the name is longer than 255 characters
  * @param mysql handle to connection to the database
- * @param path name of directory to create
+ * @param name name (relative) of the inode to create
  * @param mode access mode of new directory
  * @param rdev type of inode to create
  * @param parent inode of directory holding files (parent inode)
- * @param alloc_data (unused)
+ * @param alloc_data whether the inode holds data (files and symlinks), so starts out inline where small files are kept so
+ * @param uid owner of the new inode
+ * @param gid group of the new inode
+ * @param inuse number of opens the new inode starts out with, as if counted by query_inuse_inc()
  */
-long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
-                long parent, int alloc_data)
+long query_mknod(MYSQL *mysql, const char *name, mode_t mode, dev_t rdev,
+                long parent, int alloc_data, uid_t uid, gid_t gid, int inuse)
 {
-    int ret;
+    int ret, len;
+    int root = name[0] == '/' && name[1] == '\0';
     char sql[SQL_MAX];
+    char parent_sql[32];
     long new_inode_number = 0;
-    char *name, esc_name[PATH_MAX * 2];
-
-    if (path[0] == '/' && path[1] == '\0')  {
-        snprintf(sql, SQL_MAX,
-                 "INSERT INTO tree (name, parent) VALUES ('/', NULL)");
+    long long val;
+    char esc_name[PATH_MAX * 2];
+    struct stat st;
 
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        ret = mysql_query(mysql, sql);
-        if(ret)
-          goto err_out;
+    if (root) {
+        strcpy(esc_name, "/");
+        strcpy(parent_sql, "NULL");
+        parent = DCACHE_ROOT_PARENT;
     } else {
-        name = strrchr(path, '/');
-        if (!name || *++name == '\0') 
-            return -ENOENT;
+        if (name[0] == '\0' || strchr(name, '/'))
+            return -EINVAL;
         if (strlen(name) > 255)
             return -ENAMETOOLONG;
 
         mysql_real_escape_string(mysql, esc_name, name, strlen(name));
-        snprintf(sql, SQL_MAX,
-                 "INSERT INTO tree (name, parent) VALUES ('%s', %ld)",
-                 esc_name, parent);
+        snprintf(parent_sql, sizeof(parent_sql), "%ld", parent);
+    }
 
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        ret = mysql_query(mysql, sql);
-        if(ret)
-          goto err_out;
+    if (inode_ranges) {
+        new_inode_number = inode_alloc(mysql);
+        if (new_inode_number < 0)
+            return new_inode_number;
     }
 
-    new_inode_number = mysql_insert_id(mysql);
+    /* Both rows in one round trip */
+    if (procedures && !root) {
+        snprintf(sql, SQL_MAX, "CALL mysqlfs_mknod(%ld, %ld, '%s', %d, %u, %u, %d, %d)",
+                 new_inode_number, parent, esc_name, mode, uid, gid,
+                 data_inline_size && alloc_data, inuse);
+        ret = call_procedure(mysql, sql, &val, 1);
+        if (ret != -ENOSYS) {
+            if (ret < 0)
+                return ret;
+            new_inode_number = val;
+            dcache_enter(parent, name, new_inode_number);
+            goto created;
+        }
+    }
 
-    snprintf(sql, SQL_MAX,
-             "INSERT INTO inodes(inode, mode, uid, gid, atime, ctime, mtime)"
-             "VALUES(%ld, %d, %d, %d, UNIX_TIMESTAMP(NOW()), "
-	            "UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW()))",
-             new_inode_number, mode,
-	     fuse_get_context()->uid, fuse_get_context()->gid);
+    /* Both rows in one transaction, so a failed inodes INSERT leaves no
+     * name behind; with the number known in one round trip too */
+    if (new_inode_number) {
+        len = snprintf(sql, SQL_MAX,
+                       "START TRANSACTION; "
+                       "INSERT INTO tree (inode, name, parent) VALUES (%ld, '%s', %s); ",
+                       new_inode_number, esc_name, parent_sql);
+    } else {
+        if ((ret = run_statements(mysql, "START TRANSACTION")) < 0)
+            return ret;
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-    if(ret)
-      goto err_out;
+        snprintf(sql, SQL_MAX,
+                 "INSERT INTO tree (name, parent) VALUES ('%s', %s)",
+                 esc_name, parent_sql);
+        if ((ret = run_statements(mysql, sql)) < 0)
+            goto rollback;
+
+        new_inode_number = mysql_insert_id(mysql);
+        len = 0;
+    }
+
+    if (data_inline_size && alloc_data)
+        snprintf(sql + len, SQL_MAX - len,
+                 "INSERT INTO inodes(inode, inuse, mode, uid, gid, atime, ctime, mtime, inline_data)"
+                 "VALUES(%ld, %d, %d, %d, %d, UNIX_TIMESTAMP(NOW()), "
+		        "UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW()), ''); COMMIT",
+                 new_inode_number, inuse, mode, uid, gid);
+    else
+        snprintf(sql + len, SQL_MAX - len,
+                 "INSERT INTO inodes(inode, inuse, mode, uid, gid, atime, ctime, mtime)"
+                 "VALUES(%ld, %d, %d, %d, %d, UNIX_TIMESTAMP(NOW()), "
+		        "UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW())); COMMIT",
+                 new_inode_number, inuse, mode, uid, gid);
+
+    ret = run_statements(mysql, sql);
+    if (ret < 0)
+        goto rollback;
+    dcache_enter(parent, name, new_inode_number);
+
+created:
+    /* We know everything about the new inode, so seed the attribute cache */
+    memset(&st, 0, sizeof(st));
+    st.st_ino = new_inode_number;
+    st.st_mode = mode;
+    st.st_uid = uid;
+    st.st_gid = gid;
+    st.st_atime = st.st_mtime = st.st_ctime = time(NULL);
+    st.st_nlink = 1;
+    acache_enter(new_inode_number, &st);
 
     return new_inode_number;
 
-err_out:
-    log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+rollback:
+    /* The statements after the failed one did not run, COMMIT included */
+    run_statements(mysql, "ROLLBACK");
     return ret;
 }
 
@@ -481,64 +1220,107 @@ err_out:
  *
  * @see http://linux.die.net/man/2/mkdir
  *
- * @return ID of new inode, or -ENOENT if the path contains no parent directory "/"
+ * @return ID of new inode, or < 0 as query_mknod()
  * @param mysql handle to connection to the database
- * @param path name of directory to create
+ * @param name name (relative) of directory to create
  * @param mode access mode of new directory
  * @param parent inode of directory holding files (parent inode)
+ * @param uid owner of the new directory
+ * @param gid group of the new directory
  */
-long query_mkdir(MYSQL *mysql, const char *path, mode_t mode, long parent)
+long query_mkdir(MYSQL *mysql, const char *name, mode_t mode, long parent,
+                 uid_t uid, gid_t gid)
 {
-    return query_mknod(mysql, path, S_IFDIR | mode, 0, parent, 0);
+    return query_mknod(mysql, name, S_IFDIR | mode, 0, parent, 0, uid, gid, 0);
 }
 
 /**
- * Read a directory.  This is done by listing the nodes with a given node as
- * parent, calling the filler parameter (pointer-to-function) for each item.
- * The set of results is not ordered, so results would be in the "natural order"
- * of the database.
+ * Read part of a directory.  This is done by listing the nodes with a given
+ * node as parent, in order of name, calling the filler parameter
+ * (pointer-to-function) for each item until it returns non-zero.  At most
+ * limit items are listed, starting after the name "after" if it is given
+ * (STMT_READDIR_AFTER, a range scan of the (parent, name) index, however
+ * far into the directory), or else after skipping the first skip items
+ * (STMT_READDIR).  A directory of any size is so read page by page.
+ *
+ * Each item comes with all the attributes query_getattr() would return,
+ * read by the same statement, and is entered into the dentry and attribute
+ * caches; listing a directory and then stat()ing everything in it, as
+ * "ls -l" does, costs one query instead of one per entry.
  *
  * @see http://linux.die.net/man/2/readdir
  *
- * @return 0 on success; -EIO on failure (non-zero return from mysql_query() function)
+ * @return number of items listed, fewer than limit at the end of the directory
+ * @return -EIO on failure (the statement fails)
  * @param mysql handle to connection to the database
  * @param inode inode of directory holding files (parent inode)
- * @param buf buffer to pass to filler function
- * @param filler fuse_fill_dir_t function-pointer used to process each directory entry
+ * @param after name to list from, exclusive; NULL to start at skip
+ * @param skip number of items to skip if after is NULL
+ * @param limit largest number of items to list
+ * @param filler function called with the name and attributes of each directory entry
+ * @param ctx passed through to filler
  */
-int query_readdir(MYSQL *mysql, long inode, void *buf, fuse_fill_dir_t filler, int flag)
+int query_readdir(MYSQL *mysql, long inode, const char *after, unsigned long skip,
+                  unsigned int limit, query_readdir_filler filler, void *ctx)
 {
-    int ret;
-    char sql[SQL_MAX];
-    MYSQL_RES* result;
-    MYSQL_ROW row;
+    int ret, i, n = 0;
+    long long id = inode, from = skip, count = limit, val[9];
+    char name[PATH_MAX];
+    unsigned long name_len, after_len = after ? strlen(after) : 0;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[3], res[10];
     struct stat st;
 
-    snprintf(sql, sizeof(sql), "SELECT tree.name, tree.inode, inodes.mode FROM tree inner join inodes on tree.inode = inodes.inode WHERE tree.parent = '%ld'",
-             inode);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    bind_longlong(&param[0], &id);
+    if (after) {
+        bind_buffer(&param[1], MYSQL_TYPE_STRING, after, after_len, &after_len);
+        bind_longlong(&param[2], &count);
+        stmt = stmt_execute(mysql, STMT_READDIR_AFTER, param);
+    } else {
+        bind_longlong(&param[1], &from);
+        bind_longlong(&param[2], &count);
+        stmt = stmt_execute(mysql, STMT_READDIR, param);
     }
+    if (!stmt)
+        return -EIO;
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    bind_buffer(&res[0], MYSQL_TYPE_STRING, name, sizeof(name) - 1, &name_len);
+    for (i = 0; i < 9; i++)
+        bind_longlong(&res[i + 1], &val[i]);
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
         return -EIO;
     }
 
     memset(&st, 0, sizeof st);
-    while((row = mysql_fetch_row(result)) != NULL){
-        st.st_ino = atol(row[1]);
-        st.st_mode = atol(row[2]);
-        filler(buf, (char*)basename(row[0]), &st, 0, 0);
+    while ((ret = mysql_stmt_fetch(stmt)) == 0) {
+        name[name_len] = '\0';
+        st.st_ino = val[0];
+        st.st_mode = val[1];
+        st.st_uid = val[2];
+        st.st_gid = val[3];
+        st.st_ctime = val[4];
+        st.st_atime = val[5];
+        st.st_mtime = val[6];
+        st.st_size = val[7];
+        st.st_nlink = val[8];
+        st.st_blksize = data_block_size;
+        dcache_enter(inode, name, st.st_ino);
+        acache_enter(st.st_ino, &st);
+        n++;
+        if (filler(ctx, (char*)basename(name), &st))
+            break;
     }
 
-    mysql_free_result(result);
+    if (ret && ret != MYSQL_NO_DATA) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
+    }
+    mysql_stmt_free_result(stmt);
 
-    return 0;
+    return n;
 }
 
 /**
@@ -557,6 +1339,7 @@ int query_chmod(MYSQL *mysql, long inode, mode_t mode)
 {
     int ret;
     char sql[SQL_MAX];
+    struct stat st;
 
     snprintf(sql, SQL_MAX,
              "UPDATE inodes SET ctime=UNIX_TIMESTAMP(NOW()), mode=%d WHERE inode=%ld",
@@ -571,6 +1354,10 @@ int query_chmod(MYSQL *mysql, long inode, mode_t mode)
         return -EIO;
     }
 
+    st.st_mode = mode;
+    st.st_ctime = time(NULL);
+    acache_update(inode, ACACHE_MODE | ACACHE_CTIME, &st);
+
     return 0;
 }
 
@@ -592,6 +1379,7 @@ int query_chown(MYSQL *mysql, long inode, uid_t uid, gid_t gid)
     int ret;
     char sql[SQL_MAX];
     size_t index;
+    struct stat st;
 
     index = snprintf(sql, SQL_MAX, "UPDATE inodes SET ctime=UNIX_TIMESTAMP(NOW()),");
     if (uid != (uid_t)-1)
@@ -613,6 +1401,13 @@ int query_chown(MYSQL *mysql, long inode, uid_t uid, gid_t gid)
         return -EIO;
     }
 
+    st.st_uid = uid;
+    st.st_gid = gid;
+    st.st_ctime = time(NULL);
+    acache_update(inode, ACACHE_CTIME |
+		  (uid != (uid_t)-1 ? ACACHE_UID : 0) |
+		  (gid != (gid_t)-1 ? ACACHE_GID : 0), &st);
+
     return 0;
 }
 
@@ -633,6 +1428,7 @@ int query_utime(MYSQL *mysql, long inode, const struct timespec tv[2])
 {
     int ret;
     char sql[SQL_MAX];
+    struct stat st;
 
     snprintf(sql, SQL_MAX,
              "UPDATE inodes "
@@ -649,393 +1445,1624 @@ int query_utime(MYSQL *mysql, long inode, const struct timespec tv[2])
         return -EIO;
     }
 
+    st.st_atime = tv[0].tv_sec;
+    st.st_mtime = tv[1].tv_sec;
+    acache_update(inode, ACACHE_ATIME | ACACHE_MTIME, &st);
+
     return 0;
 }
 
 /**
- * Read a number of bytes (perhaps larger than BLOCK_SIZE) at an offset from
- * a file.  The function does this by reading each block in succession, copying
- * the block contents into the target buffer.  The (offset % DATA_BLOCK_SIZE)
- * issue is handled by shifting the copy slightly.
+ * Copy the part of one block that a read wants to the read buffer.  Used by
+ * query_read() for blocks from the block cache and the database alike.
+ * Whole blocks are usually put straight into the read buffer (see
+ * read_block_whole()), in which case data is dst and there is nothing to copy.
  *
- * @return < 0 in case of errors (propagating result of write_one_block() )
- * @return > 0 number of bytes read (should equal size parameter)
- * @param mysql handle to connection to the database
- * @param inode inode of the file in question
- * @param buf the buffer to copy read bytes
- * @param size number of bytes to read
- * @param offset offset within the file to read from
+ * @return number of bytes copied
+ * @return -1 if the read ends here, because the first block does not reach the read offset
+ * @param info blocks covered by the read
+ * @param seq sequence number of the block
+ * @param data contents of the block
+ * @param row_len length of the block
+ * @param dst where to copy to
  */
-int query_read(MYSQL *mysql, long inode, const char *buf, size_t size,
-               off_t offset)
+static long copy_block(const struct data_blocks_info *info, unsigned long seq,
+		       const char *data, size_t row_len, char *dst)
 {
-    int ret;
-    char sql[SQL_MAX];
-    MYSQL_RES* result;
-    MYSQL_ROW row;
-    unsigned long length = 0L, copy_len, seq;
-    struct data_blocks_info info;
-    char *dst = (char *)buf;
-    char *src, *zeroes = alloca(DATA_BLOCK_SIZE);
-
-    fill_data_blocks_info(&info, size, offset);
+    const char *src = data;
+    size_t copy_len;
 
-    /* Read all required blocks */
-    snprintf(sql, SQL_MAX,
-             "SELECT seq, data, LENGTH(data) FROM data_blocks WHERE inode=%ld AND seq>=%lu AND seq <=%lu ORDER BY seq ASC",
-             inode, info.seq_first, info.seq_last);
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
+    if (seq == info->seq_first) {
+	if (row_len < info->offset_first)
+	    return -1;
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+	copy_len = MIN(row_len - info->offset_first, info->length_first);
+	src = data + info->offset_first;
+    } else if (seq == info->seq_last) {
+	copy_len = MIN(info->length_last, row_len);
+    } else {
+	copy_len = MIN(data_block_size, row_len);
     }
 
-    /* This is a bit tricky as we support 'sparse' files now.
-     * It means not all requested blocks must exist in the
-     * database. For those that don't exist we'll return
-     * a block of \0 instead.  */
-    row = mysql_fetch_row(result);
-    memset(zeroes, 0L, DATA_BLOCK_SIZE);
-    for (seq = info.seq_first; seq<=info.seq_last; seq++) {
-        off_t row_seq = -1;
-	size_t row_len = DATA_BLOCK_SIZE;
-	char *data = zeroes;
-
-	if (row && (row_seq = atoll(row[0])) == seq) {
-	    data = row[1];
-	    row_len = atoll(row[2]);
-	}
-	    
-	if (seq == info.seq_first) {
-	    if (row_len < info.offset_first)
-	        goto go_away;
-
-	    copy_len = MIN(row_len - info.offset_first, info.length_first);
-	    src = data + info.offset_first;
-	} else if (seq == info.seq_last) {
-	    copy_len = MIN(info.length_last, row_len);
-	    src = data;
-	} else {
-	    copy_len = MIN(DATA_BLOCK_SIZE, row_len);
-	    src = data;
-	}
-
+    if (src != dst)
 	memcpy(dst, src, copy_len);
-	dst += copy_len;
-	length += copy_len;
-
-	if (row && row_seq == seq)
-	    row = mysql_fetch_row(result);
-    }
-
-go_away:
-    /* Read all remaining rows */
-    while (mysql_fetch_row(result));
-    mysql_free_result(result);
+    return copy_len;
+}
 
-    return length;
+/** Whether a read wants all of block seq, from its start, so that it can go straight into the read buffer */
+static inline int read_block_whole(const struct data_blocks_info *info, unsigned long seq)
+{
+    return seq != info->seq_last && (seq != info->seq_first || info->offset_first == 0);
 }
 
 /**
- * Writes a specific block into the database
- *
- * This function takes an early bail-out if the size to write is zero, or if the total size to write exceeds the block size.
- *
- * This function checks to see if the previous block didn't exist -- in such
- * case, it then writes out a zero-length block.  The function then creates a
- * statement that has a '?' token representing the new data.  If the previous
- * data didn't exist, the function uses a "SET x == y" format; otherwise, a
- * "CONCAT (data, ?)".  The statement is snprintf'd, prepared, and executed; the
- * result produces either a 0 on success, or a -EIO on failure (with an error
- * message logged).
+ * Get the data column of the row STMT_READ_BLOCKS just fetched.  No buffer
+ * is bound for the column when the row is fetched, so its data is only
+ * transferred here, directly to where it is wanted.
  *
  * @return 0 on success; -EIO on failure
- * @param mysql handle to connection to the database
- * @param inode inode to write out the data block on
- * @param seq sequence number of datablock to write
- * @param data buffer of content to write
- * @param size size_t length of data
- * @param offset what offset within the datablock to write the data
+ * @param stmt the executed STMT_READ_BLOCKS statement
+ * @param dst where to put the data
+ * @param len length of the data, as reported by the fetch
  */
-static int write_one_block(MYSQL *mysql, long inode,
-				 unsigned long seq,
-				 const char *data, size_t size,
-				 off_t offset)
+static int fetch_block_data(MYSQL_STMT *stmt, char *dst, unsigned long len)
 {
-    MYSQL_STMT *stmt;
-    MYSQL_BIND bind[1];
-    char sql[SQL_MAX];
-    size_t current_block_size = query_size_block(mysql, inode, seq);
+    MYSQL_BIND col;
+    unsigned long col_len;
 
-    /* Shortcut */
-    if (size == 0) return 0;
+    if (!len)
+	return 0;
 
-    if (offset + size > DATA_BLOCK_SIZE) {
-        log_printf(LOG_ERROR, "%s(): offset(%zu)+size(%zu)>max_block(%d)\n", 
-		   __func__, offset, size, DATA_BLOCK_SIZE);
+    bind_buffer(&col, MYSQL_TYPE_BLOB, dst, len, &col_len);
+    if (mysql_stmt_fetch_column(stmt, &col, 1, 0)) {
+        log_printf(LOG_ERROR, "ERROR: mysql_stmt_fetch_column()\n");
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
 	return -EIO;
     }
 
-    /* We expect the inode is already locked for this thread by caller! */
+    return 0;
+}
 
-    if (current_block_size == -ENXIO) {
-        /* This data block has not yet been allocated */
-        snprintf(sql, SQL_MAX,
-                 "INSERT INTO data_blocks SET inode=%ld, seq=%lu, data=''", inode, seq);
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        if(mysql_query(mysql, sql)){
-            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-            return -EIO;
-        }
+/**
+ * Get the data of the row STMT_READ_BLOCKS or STMT_READ_CODEC just fetched,
+ * like fetch_block_data(), decompressing it if its codec says so.  Compressed
+ * data is fetched into zbuf, allocated on first use and freed by the caller.
+ *
+ * @return length of the data put at dst; -EIO on failure
+ * @param stmt the executed statement
+ * @param dst where to put the data, data_block_size bytes
+ * @param len length of the stored data, as reported by the fetch
+ * @param codec codec of the row
+ * @param zbuf bounce buffer for compressed data
+ */
+static long fetch_codec_data(MYSQL_STMT *stmt, char *dst, unsigned long len,
+			     long long codec, char **zbuf)
+{
+    long n;
 
-        current_block_size = query_size_block(mysql, inode, seq);
-    }
+    if (codec == CODEC_NONE)
+	return fetch_block_data(stmt, dst, len) < 0 ? -EIO : (long)len;
 
-    stmt = mysql_stmt_init(mysql);
-    if (!stmt)
-    {
-        log_printf(LOG_ERROR, "mysql_stmt_init(), out of memory\n");
+    if (!*zbuf && !(*zbuf = malloc(data_block_size)))
+	return -ENOMEM;
+    if (fetch_block_data(stmt, *zbuf, len) < 0)
+	return -EIO;
+    n = codec_decompress(codec, *zbuf, len, dst, data_block_size);
+    if (n < 0) {
+	log_printf(LOG_ERROR, "ERROR: cannot decompress a %s block\n", codec_name(codec));
 	return -EIO;
     }
+    return n;
+}
 
-    memset(bind, 0, sizeof(bind));
-    if (offset == 0 && current_block_size == 0) {
-        snprintf(sql, SQL_MAX,
-                 "UPDATE data_blocks "
-		 "SET data=? "
-		 "WHERE inode=%ld AND seq=%lu",
-		 inode, seq);
-    } else if (offset == current_block_size) {
-        snprintf(sql, sizeof(sql),
-                 "UPDATE data_blocks "
-		 "SET data=CONCAT(data, ?) "
-		 "WHERE inode=%ld AND seq=%lu",
-		 inode, seq);
-    } else {
-        size_t pos;
-        pos = snprintf(sql, sizeof(sql),
-		 "UPDATE data_blocks SET data=CONCAT(");
-	if (offset > 0)
-	    pos += snprintf(sql + pos, sizeof(sql) - pos, "RPAD(IF(ISNULL(data),'', data), %llu, '\\0'),", (long long)offset);
-	pos += snprintf(sql + pos, sizeof(sql) - pos, "?,");
-
-	if (offset + size < current_block_size) {
-	    pos += snprintf(sql + pos, sizeof(sql) - pos, "SUBSTRING(data FROM %llu),", (long long)offset + size + 1);
-	}
-	sql[--pos] = '\0';	/* Remove the trailing comma. */
-	pos += snprintf(sql + pos, sizeof(sql) - pos, ") WHERE inode=%ld AND seq=%lu",
-			inode, seq);
-    }
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+/**
+ * One extent of a file as found by extent_map(): a run of bytes of the file
+ * stored in one data_extents row.
+ */
+struct extent {
+    long long		pos;		/**< file offset of the first byte */
+    long long		len;		/**< number of bytes */
+};
 
-    if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
-	log_printf(LOG_ERROR, "mysql_stmt_prepare() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
+/** Run a statement that returns no rows; for the extent and dedup functions below */
+static int run_query(MYSQL *mysql, const char *sql)
+{
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
     }
+    return 0;
+}
 
-    if (mysql_stmt_param_count(stmt) != 1) {
-      log_printf(LOG_ERROR, "%s(): stmt_param_count=%d, expected 1\n", __func__, mysql_stmt_param_count(stmt));
-      return -EIO;
-    }
-    bind[0].buffer_type= MYSQL_TYPE_LONG_BLOB;
-    bind[0].buffer= (char *)data;
-    bind[0].is_null= 0;
-    bind[0].length= (unsigned long *)(void *)&size;
+/**
+ * Find the extents of an inode that overlap [start, end], or end right at
+ * start, with the STMT_EXTENT_MAP prepared statement.  As no extent is longer
+ * than data_extent_size, only extents starting that far before start need
+ * be looked at, which keeps the index range short.
+ *
+ * @return number of extents in *map, which the caller frees
+ * @return -EIO if the statement fails
+ * @return -ENOMEM if memory runs out
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file
+ * @param start offset of the first byte of the range
+ * @param end offset one past the last byte of the range
+ * @param map where to store the extents, sorted by position
+ */
+static int extent_map(MYSQL *mysql, long inode, off_t start, off_t end,
+		      struct extent **map)
+{
+    long long id = inode, lo = start - (long long)data_extent_size, hi = end, pos, len;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[3], res[2];
+    struct extent *ext = NULL, *tmp;
+    int n = 0, max = 0, ret;
+
+    bind_longlong(&param[0], &id);
+    bind_longlong(&param[1], &lo);
+    bind_longlong(&param[2], &hi);
+    stmt = stmt_execute(mysql, STMT_EXTENT_MAP, param);
+    if (!stmt)
+        return -EIO;
 
-    if (mysql_stmt_bind_param(stmt, bind)) {
-	log_printf(LOG_ERROR, "mysql_stmt_bind_param() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
+    bind_longlong(&res[0], &pos);
+    bind_longlong(&res[1], &len);
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
     }
 
-    /*
-    if (!mysql_stmt_send_long_data(stmt, 0, data, size))
-    {
-        log_printf(" send_long_data failed");
-	goto err_out;
+    while ((ret = mysql_stmt_fetch(stmt)) == 0) {
+        if (pos + len < start)
+            continue;
+        if (n == max) {
+            max = max ? 2 * max : 8;
+            tmp = realloc(ext, max * sizeof(struct extent));
+            if (!tmp) {
+                free(ext);
+                mysql_stmt_free_result(stmt);
+                return -ENOMEM;
+            }
+            ext = tmp;
+        }
+        ext[n].pos = pos;
+        ext[n].len = len;
+        n++;
     }
-    */
-    if (mysql_stmt_execute(stmt)) {
-	log_printf(LOG_ERROR, "mysql_stmt_execute() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
+    mysql_stmt_free_result(stmt);
+    if (ret != MYSQL_NO_DATA) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        free(ext);
+        return -EIO;
     }
 
-    if (mysql_stmt_close(stmt))
-	log_printf(LOG_ERROR, "failed closing the statement: %s\n", mysql_stmt_error(stmt));
+    *map = ext;
+    return n;
+}
 
-    /* Update file size */
-    snprintf(sql, SQL_MAX,
-	     "UPDATE inodes SET size=("
-	     	"SELECT seq*%d + LENGTH(data) FROM data_blocks WHERE inode=%ld AND seq=("
-			"SELECT MAX(seq) FROM data_blocks WHERE inode=%ld"
-		")"
-	     ") "
-	     "WHERE inode=%ld",
-	     DATA_BLOCK_SIZE, inode, inode, inode);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if(mysql_query(mysql, sql)) {
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+/**
+ * Read from a file stored in extents.  Only the part of each extent that
+ * the read wants is sent by the server, straight into buf; bytes no extent
+ * covers are holes and read as zeroes.  Extents do not tell where the file
+ * ends, so the read is cut short at the file size, from the attribute cache
+ * or the inode.
+ *
+ * @return -EIO if the statement fails
+ * @return >= 0 number of bytes read
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param buf the buffer to copy read bytes
+ * @param size number of bytes to read
+ * @param offset offset within the file to read from
+ */
+static int read_extents(MYSQL *mysql, long inode, char *buf, size_t size,
+			off_t offset)
+{
+    long long id = inode, start = offset, end, lo, from;
+    unsigned long data_len, col_len;
+    my_bool data_null;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[7], res[2], col;
+    struct stat st;
+    int ret;
+
+    if (!acache_lookup(inode, &st) && (st.st_size = query_size(mysql, inode)) < 0)
+        return st.st_size;
+    if (offset >= st.st_size)
+        return 0;
+    size = MIN(size, (size_t)(st.st_size - offset));
+    end = offset + size;
+    lo = start - (long long)data_extent_size;
+
+    memset(buf, 0, size);
+
+    bind_longlong(&param[0], &start);
+    bind_longlong(&param[1], &start);
+    bind_longlong(&param[2], &end);
+    bind_longlong(&param[3], &start);
+    bind_longlong(&param[4], &id);
+    bind_longlong(&param[5], &lo);
+    bind_longlong(&param[6], &end);
+    stmt = stmt_execute(mysql, STMT_READ_EXTENTS, param);
+    if (!stmt)
+        return -EIO;
+
+    /* As in query_read(), the data goes straight to where it belongs */
+    bind_longlong(&res[0], &from);
+    bind_buffer(&res[1], MYSQL_TYPE_BLOB, NULL, 0, &data_len);
+    res[1].is_null = &data_null;
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
         return -EIO;
     }
 
-    return size;
+    while ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED) {
+        if (data_null || data_len == 0)
+            continue;
+        bind_buffer(&col, MYSQL_TYPE_BLOB, buf + (from - start),
+                    MIN(data_len, (unsigned long)(end - from)), &col_len);
+        if (mysql_stmt_fetch_column(stmt, &col, 1, 0)) {
+            log_printf(LOG_ERROR, "ERROR: mysql_stmt_fetch_column()\n");
+            log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+            mysql_stmt_free_result(stmt);
+            return -EIO;
+        }
+    }
+    mysql_stmt_free_result(stmt);
+    if (ret != MYSQL_NO_DATA) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        return -EIO;
+    }
 
-err_out:
-	log_printf(LOG_ERROR, " %s\n", mysql_stmt_error(stmt));
-	if (mysql_stmt_close(stmt))
-	    log_printf(LOG_ERROR, "failed closing the statement: %s\n", mysql_stmt_error(stmt));
-	return -EIO;
+    return size;
 }
 
 /**
- * Write a number of bytes (perhaps larger than BLOCK_SIZE) at an offset into
- * a file.  The function does this by writing the first partial block, then
- * writing successive blocks until the full @c size is written.
+ * Write to a file stored in extents.  A write within one extent overwrites
+ * it in place.  Otherwise the extents the write overlaps are cut back,
+ * moved or deleted so that none of them covers the range any more, and the
+ * data goes into the extent ending where the write starts, as long as that
+ * stays within data_extent_size, and new extents for the rest.  Appending
+ * to an extent has the server rewrite it, so an extent is only grown by
+ * writes of at least 1/EXTENT_APPEND_RATIO of its length: small sequential
+ * writes make small extents rather than rewriting a large one over and
+ * over.  The caller updates the file size.
  *
- * @return < 0 in case of errors (propagating result of write_one_block() )
- * @return > 0 number of bytes written (should equal size parameter)
+ * @return size on success
+ * @return -EIO if a statement fails
+ * @return -ENOMEM if memory runs out
  * @param mysql handle to connection to the database
  * @param inode inode of the file in question
  * @param data the buffer of data to write
  * @param size number of bytes to write
  * @param offset offset within the file to write to
  */
-int query_write(MYSQL *mysql, long inode, const char *data, size_t size,
-                off_t offset)
+static int write_extents(MYSQL *mysql, long inode, const char *data, size_t size,
+			 off_t offset)
 {
-    struct data_blocks_info info;
-    unsigned long seq;
-    const char *ptr;
-    int ret, ret_size = 0;
-
-    fill_data_blocks_info(&info, size, offset);
-
-    /* Handle first block */
-    lock_inode(mysql, inode);
-    ret = write_one_block(mysql, inode, info.seq_first, data,
-			  info.length_first, info.offset_first);
-    unlock_inode(mysql, inode);
-    if (ret < 0)
-        return ret;
-    ret_size = ret;
+    long long id = inode, pos, len, xo, xe, end = offset + size;
+    unsigned long data_len;
+    MYSQL_BIND param[5];
+    struct extent *map, *prev = NULL;
+    char sql[SQL_MAX];
+    size_t done = 0;
+    int n, i, ret = 0;
+
+    n = extent_map(mysql, inode, offset, end, &map);
+    if (n < 0)
+        return n;
+
+    for (i = 0; i < n && ret == 0; i++) {
+        xo = map[i].pos;
+        xe = map[i].pos + map[i].len;
+
+        if (xo <= offset && xe >= end) {
+            /* Within one extent: overwrite in place */
+            pos = offset - xo + 1;
+            len = size;
+            data_len = size;
+            bind_longlong(&param[0], &pos);
+            bind_longlong(&param[1], &len);
+            bind_buffer(&param[2], MYSQL_TYPE_BLOB, data, data_len, &data_len);
+            bind_longlong(&param[3], &id);
+            bind_longlong(&param[4], &xo);
+            if (!stmt_execute(mysql, STMT_EXTENT_SPLICE, param))
+                ret = -EIO;
+            free(map);
+            return ret < 0 ? ret : (int)size;
+        }
 
-    /* Shortcut - if last block seq is the same as first block
-     * seq simply go away as it's the same block */
-    if (info.seq_first == info.seq_last)
-        return ret_size;
+        if (xe <= offset) {
+            if (xe == offset)
+                prev = &map[i];
+            continue;
+        }
+        if (xo >= end)
+            continue;
+
+        if (xo < offset) {
+            /* Overlaps the start of the write: cut off its end */
+            snprintf(sql, SQL_MAX,
+                     "UPDATE data_extents SET data=LEFT(data, %lld) WHERE inode=%ld AND pos=%lld",
+                     (long long)offset - xo, inode, xo);
+            map[i].len = offset - xo;
+            prev = &map[i];
+        } else if (xe <= end) {
+            /* Within the write: goes altogether */
+            snprintf(sql, SQL_MAX,
+                     "DELETE FROM data_extents WHERE inode=%ld AND pos=%lld",
+                     inode, xo);
+        } else {
+            /* Overlaps the end of the write: cut off its start */
+            snprintf(sql, SQL_MAX,
+                     "UPDATE data_extents SET data=SUBSTRING(data FROM %lld), pos=%lld "
+                     "WHERE inode=%ld AND pos=%lld",
+                     end - xo + 1, end, inode, xo);
+        }
+        ret = run_query(mysql, sql);
+    }
 
-    ptr = data + info.length_first;
+    if (ret == 0 && prev && prev->len < (long long)data_extent_size &&
+        (long long)size * EXTENT_APPEND_RATIO >= prev->len) {
+        data_len = MIN(size, data_extent_size - prev->len);
+        bind_buffer(&param[0], MYSQL_TYPE_BLOB, data, data_len, &data_len);
+        bind_longlong(&param[1], &id);
+        bind_longlong(&param[2], &prev->pos);
+        if (!stmt_execute(mysql, STMT_EXTENT_APPEND, param))
+            ret = -EIO;
+        done = data_len;
+    }
 
-    /* Handle all full-sized intermediate blocks */
-    for (seq = info.seq_first + 1; seq < info.seq_last; seq++) {
-        lock_inode(mysql, inode);
-        ret = write_one_block(mysql, inode, seq, ptr, DATA_BLOCK_SIZE, 0);
-        unlock_inode(mysql, inode);
-        if (ret < 0)
-            return ret;
-	ptr += DATA_BLOCK_SIZE;
-	ret_size += ret;
+    while (ret == 0 && done < size) {
+        pos = offset + done;
+        data_len = MIN(size - done, data_extent_size);
+        bind_longlong(&param[0], &id);
+        bind_longlong(&param[1], &pos);
+        bind_buffer(&param[2], MYSQL_TYPE_BLOB, data + done, data_len, &data_len);
+        if (!stmt_execute(mysql, STMT_EXTENT_INSERT, param))
+            ret = -EIO;
+        done += data_len;
     }
 
-    /* Handle last block */
-    lock_inode(mysql, inode);
-    ret = write_one_block(mysql, inode, info.seq_last, ptr,
-			  info.length_last, 0);
-    unlock_inode(mysql, inode);
-    if (ret < 0)
-        return ret;
-    ret_size += ret;
+    free(map);
+    return ret < 0 ? ret : (int)size;
+}
 
-    return ret_size;
+/** A run of blocks query_read() fetches with one statement */
+struct read_range {
+    enum pool_stmt_id	id;		/**< the statement */
+    long long		inode;		/**< its parameters */
+    long long		first;
+    long long		last;
+    MYSQL_BIND		param[4];	/**< bound to the above */
+};
+
+/**
+ * Set up the statement that fetches blocks first to last of a file: where
+ * small files are kept inline, one from block 0 returns the inline data,
+ * if any, as block 0.
+ */
+static void read_range_init(struct read_range *r, long inode,
+			    unsigned long first, unsigned long last)
+{
+    r->inode = inode;
+    r->first = first;
+    r->last = last;
+    if (data_inline_size && first == 0) {
+	r->id = data_codecs ? STMT_READ_INLINE_CODEC : STMT_READ_INLINE;
+	bind_longlong(&r->param[0], &r->inode);
+	bind_longlong(&r->param[1], &r->inode);
+	bind_longlong(&r->param[2], &r->first);
+	bind_longlong(&r->param[3], &r->last);
+    } else {
+	r->id = data_dedup ? STMT_READ_DEDUP :
+		data_codecs ? STMT_READ_CODEC : STMT_READ_BLOCKS;
+	bind_longlong(&r->param[0], &r->inode);
+	bind_longlong(&r->param[1], &r->first);
+	bind_longlong(&r->param[2], &r->last);
+    }
 }
 
 /**
- * Check the size of a file.  Check the value by reading the attribute stored
- * in the inode table itself.  The function does not summarize the size "live"
- * by summing the size of each data block; rather this value is updated in
- * query_fsck(), query_truncate(), write_one_block().  This trust in the
- * various write functions optimizes this function's response time and
- * reduces DB load.
+ * Copy blocks seq to last of a read, as the executed statement of
+ * read_range_init() returns their rows, to where the read wants them,
+ * entering each into the block cache.  Sparse files are supported: not
+ * all blocks must exist in the database, and for those that don't a
+ * block of \0 is returned instead.  The statement's result is freed.
  *
- * @return total size of the file at the inode as represented in the inode block
- * @param mysql handle to connection to the database
+ * @return number of bytes copied; -EIO if fetching failed
+ * @param stmt the executed statement
  * @param inode inode of the file in question
+ * @param info the read, from fill_data_blocks_info()
+ * @param seq first block the statement fetches
+ * @param last last block it fetches
+ * @param dst where block seq goes in the read buffer
+ * @param block bounce buffer for the partial blocks at either end of the read
+ * @param zbuf buffer for fetch_codec_data(), allocated there as needed
+ * @param stopped set to 1 if the read ended early, at the end of the file within the first block
+ * @param gen bcache_generation() of the inode before the statement ran
  */
-ssize_t query_size(MYSQL *mysql, long inode)
+static long read_rows(MYSQL_STMT *stmt, long inode, const struct data_blocks_info *info,
+		      unsigned long seq, unsigned long last, char *dst, char *block,
+		      char **zbuf, int *stopped, unsigned long gen)
 {
-    size_t ret;
-    char sql[SQL_MAX];
-    MYSQL_RES *result;
-    MYSQL_ROW row;
-
-    snprintf(sql, SQL_MAX, "SELECT size FROM inodes WHERE inode=%ld",
-             inode);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    long long row_seq, row_codec = CODEC_NONE;
+    unsigned long data_len;
+    long copied, fetched, length = 0;
+    my_bool data_null;
+    MYSQL_BIND res[3];
+    char *data;
+    int ret, have_row;
+
+    /* No buffer for the data: fetching a row only tells its length, and
+     * fetch_codec_data() then gets the data to its destination */
+    bind_longlong(&res[0], &row_seq);
+    bind_buffer(&res[1], MYSQL_TYPE_BLOB, NULL, 0, &data_len);
+    res[1].is_null = &data_null;
+    if (data_codecs && !data_dedup)
+	bind_longlong(&res[2], &row_codec);
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
         return -EIO;
     }
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
+    ret = mysql_stmt_fetch(stmt);
+    have_row = (ret == 0 || ret == MYSQL_DATA_TRUNCATED);
+    for (; seq <= last; seq++) {
+	size_t row_len = data_block_size;
+
+	data = read_block_whole(info, seq) ? dst : block;
+	if (have_row && row_seq == seq) {
+	    row_len = data_null ? 0 : MIN(data_len, data_block_size);
+	    fetched = fetch_codec_data(stmt, data, row_len, row_codec, zbuf);
+	    if (fetched < 0) {
+		mysql_stmt_free_result(stmt);
+		return fetched;
+	    }
+	    row_len = fetched;
+	    bcache_enter(inode, seq, data, row_len, gen);
+	} else {
+	    memset(data, 0, data_block_size);
+	}
 
-    if(mysql_num_rows(result) != 1 || mysql_num_fields(result) != 1){
-        mysql_free_result(result);
-        log_printf(LOG_ERROR, "ERROR: non-unique number of rows for %d\n", inode);
-        return -EIO;
-    }
+	if ((copied = copy_block(info, seq, data, row_len, dst)) < 0) {
+	    *stopped = 1;
+	    break;
+	}
+	dst += copied;
+	length += copied;
 
-    row = mysql_fetch_row(result);
-    if(!row){
-        log_printf(LOG_ERROR, "ERROR: row-fetch failed for %d\n", inode);
-        return -EIO;
+	if (have_row && row_seq == seq) {
+	    ret = mysql_stmt_fetch(stmt);
+	    have_row = (ret == 0 || ret == MYSQL_DATA_TRUNCATED);
+	}
     }
 
-    if (row[0]) {
-        ret = atoll(row[0]);
-    } else {
-        ret = 0;
+    if (ret == 1) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
     }
-    mysql_free_result(result);
+    /* Discard all remaining rows */
+    mysql_stmt_free_result(stmt);
 
-    return ret;
+    return length;
 }
 
 /**
- * Returns the size of the given block (inode and sequence number).  Used only by write_one_block(), which is static, so this one can/should be static?
+ * Read a long run of blocks, from seq to the end of a read, in up to
+ * stripe_width stripes of at least READ_STRIPE_BYTES, each fetched over a
+ * connection of its own at once with async_run_stmts(): the caller's, and
+ * as many more as the pool has free right away (see write_blocks_async()).
+ * Each stripe's rows are stored client side and then copied in order as
+ * read_rows() does; a stripe whose statement failed is fetched again on
+ * its own.
  *
- * @return -ENXIO if the inode/seq pair is not found (zero rows returned, implying that block doesn't exist)
- * @return -EIO if no row is returned (implying an error in the query response, signaled by mysql_fetch_row() returning NULL)
- * @return 0 if the row is NULL (implying no result?)
- * @return 1 - DATA_BLOCK_SIZE (size of the actual block)
+ * @return number of bytes copied; < 0 on failure
  * @param mysql handle to connection to the database
  * @param inode inode of the file in question
- * @param seq sequence number of datablock to check
+ * @param info the read, from fill_data_blocks_info()
+ * @param seq first block to fetch
+ * @param dst where block seq goes in the read buffer
+ * @param block bounce buffer for the partial blocks at either end of the read
+ * @param zbuf buffer for fetch_codec_data(), allocated there as needed
+ * @param gen bcache_generation() of the inode before the read began
  */
-ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq)
+static long read_striped(MYSQL *mysql, long inode, const struct data_blocks_info *info,
+			 unsigned long seq, char *dst, char *block, char **zbuf,
+			 unsigned long gen)
 {
-    size_t ret;
-    char sql[SQL_MAX];
-    MYSQL_RES *result;
-    MYSQL_ROW row;
-
-    snprintf(sql, SQL_MAX, "SELECT LENGTH(data) FROM data_blocks WHERE inode=%ld AND seq=%lu",
+    struct read_range range[ASYNC_MAX_CONNS];
+    struct async_stmt s[ASYNC_MAX_CONNS];
+    MYSQL *conn[ASYNC_MAX_CONNS];
+    MYSQL_STMT *stmt;
+    unsigned long nblocks = info->seq_last - seq + 1, per;
+    long copied, length = 0;
+    int i, n, nconns, stopped = 0;
+
+    n = MIN(MIN(stripe_width, ASYNC_MAX_CONNS),
+	    nblocks * data_block_size / READ_STRIPE_BYTES);
+    conn[0] = mysql;
+    for (nconns = 1; nconns < n; nconns++)
+	if (!(conn[nconns] = pool_tryget()))
+	    break;
+    per = (nblocks + nconns - 1) / nconns;
+    n = (nblocks + per - 1) / per;
+    log_printf(LOG_D_SQL, "%s(): inode %ld: %lu blocks over %d connections\n",
+	       __func__, inode, nblocks, n);
+
+    for (i = 0; i < n; i++) {
+	read_range_init(&range[i], inode, seq + i * per,
+			MIN(seq + (i + 1) * per - 1, info->seq_last));
+	s[i].mysql = conn[i];
+	s[i].stmt = pool_stmt(conn[i], range[i].id, stmt_sql[range[i].id]);
+	if (s[i].stmt && mysql_stmt_bind_param(s[i].stmt, range[i].param))
+	    s[i].stmt = NULL;
+    }
+    async_run_stmts(s, n);
+
+    for (i = 0; i < n; i++) {
+	if (stopped || length < 0) {
+	    /* Rows no longer wanted */
+	    if (!s[i].err)
+		mysql_stmt_free_result(s[i].stmt);
+	    continue;
+	}
+	stmt = s[i].err ? stmt_execute(conn[i], range[i].id, range[i].param) : s[i].stmt;
+	copied = stmt ? read_rows(stmt, inode, info, range[i].first, range[i].last,
+				  dst, block, zbuf, &stopped, gen) : -EIO;
+	if (copied < 0) {
+	    length = copied;
+	    continue;
+	}
+	dst += copied;
+	length += copied;
+    }
+
+    for (i = 1; i < nconns; i++)
+	pool_put(conn[i]);
+    return length;
+}
+
+/**
+ * Read a number of bytes (perhaps larger than BLOCK_SIZE) at an offset from
+ * a file.  The function does this by reading each block in succession, copying
+ * the block contents into the target buffer.  The (offset % data_block_size)
+ * issue is handled by shifting the copy slightly.  Leading blocks found in
+ * the block cache (see bcache_lookup()) are copied from there; the rest are
+ * fetched in binary form with the STMT_READ_BLOCKS prepared statement and
+ * entered into the cache.  Where rows may be compressed STMT_READ_CODEC
+ * fetches each row's codec as well, and compressed blocks are decompressed
+ * on the way (see fetch_codec_data()).  Where small files are kept inline,
+ * a read from block 0 uses STMT_READ_INLINE(_CODEC), which returns the
+ * inline data of the inodes row, if any, as block 0, in the same round trip.
+ * Files stored in extents rather than blocks are read by read_extents()
+ * instead, bypassing the block cache.
+ *
+ * The statement's rows are not stored client side: they are streamed off
+ * the connection one at a time, and the data of blocks the read wants whole
+ * is put straight into buf.  Only the partial blocks at either end of the
+ * read go through a block-sized bounce buffer, so a read takes the same
+ * memory and one copy less whatever its size.  A long read is the exception:
+ * it is split into stripes fetched over several connections at once, whose
+ * rows are stored until their turn comes (see read_striped()).
+ *
+ * @return -EIO if the statement fails
+ * @return > 0 number of bytes read (should equal size parameter)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param buf the buffer to copy read bytes
+ * @param size number of bytes to read
+ * @param offset offset within the file to read from
+ */
+int query_read(MYSQL *mysql, long inode, const char *buf, size_t size,
+               off_t offset)
+{
+    long copied;
+    unsigned long length = 0L, seq, nblocks;
+    MYSQL_STMT *stmt;
+    struct read_range range;
+    struct data_blocks_info info;
+    char *dst = (char *)buf;
+    char *block, *data, *zbuf = NULL;
+    int ret, stopped = 0;
+    unsigned long gen;
+
+    if (data_extent_size)
+        return read_extents(mysql, inode, dst, size, offset);
+
+    fill_data_blocks_info(&info, size, offset);
+
+    /* Before any row is read: a write from now on keeps them out of the cache */
+    gen = bcache_generation(inode);
+
+    /* Bounce buffer for the partial blocks at either end of the read */
+    block = malloc(data_block_size);
+    if (!block)
+        return -ENOMEM;
+
+    /* Leading blocks in the block cache need not be fetched */
+    for (seq = info.seq_first; seq <= info.seq_last; seq++) {
+	data = read_block_whole(&info, seq) ? dst : block;
+	if ((ret = bcache_lookup(inode, seq, data)) < 0)
+	    break;
+	if ((copied = copy_block(&info, seq, data, ret, dst)) < 0)
+	    goto out;
+	dst += copied;
+	length += copied;
+    }
+    if (seq > info.seq_last)
+	goto out;
+
+    /* Read all remaining blocks, a long run of them over several connections */
+    nblocks = info.seq_last - seq + 1;
+    if (stripe_width > 1 && nblocks * data_block_size >= 2 * READ_STRIPE_BYTES) {
+	copied = read_striped(mysql, inode, &info, seq, dst, block, &zbuf, gen);
+    } else {
+	read_range_init(&range, inode, seq, info.seq_last);
+	stmt = stmt_execute(mysql, range.id, range.param);
+	copied = stmt ? read_rows(stmt, inode, &info, seq, info.seq_last,
+				  dst, block, &zbuf, &stopped, gen) : -EIO;
+    }
+    if (copied < 0) {
+	free(block);
+	free(zbuf);
+	return copied;
+    }
+    length += copied;
+
+out:
+    free(block);
+    free(zbuf);
+    return length;
+}
+
+/**
+ * Read one data block of a file, decompressed, for a write that changes
+ * only part of it (see write_codec_block()).
+ *
+ * @return 1 if the block exists; 0 if not; -errno on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of the block
+ * @param block where to put the block, data_block_size bytes
+ * @param len set to the length of the block
+ */
+static int codec_get_block(MYSQL *mysql, long inode, unsigned long seq,
+                           char *block, unsigned long *len)
+{
+    long long id = inode, nr = seq, codec = CODEC_NONE;
+    unsigned long data_len = 0;
+    my_bool data_null = 1;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[2], res[2];
+    char *zbuf = NULL;
+    long n;
+    int ret;
+
+    bind_longlong(&param[0], &id);
+    bind_longlong(&param[1], &nr);
+    stmt = stmt_execute(mysql, STMT_CODEC_BLOCK, param);
+    if (!stmt)
+        return -EIO;
+
+    bind_buffer(&res[0], MYSQL_TYPE_BLOB, NULL, 0, &data_len);
+    res[0].is_null = &data_null;
+    bind_longlong(&res[1], &codec);
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
+    }
+
+    ret = mysql_stmt_fetch(stmt);
+    if (ret == MYSQL_NO_DATA) {
+        ret = 0;
+    } else if (ret != 0 && ret != MYSQL_DATA_TRUNCATED) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        ret = -EIO;
+    } else if (data_null) {
+        *len = 0;
+        ret = 1;
+    } else {
+        MYSQL_BIND col;
+        unsigned long col_len;
+
+        data_len = MIN(data_len, data_block_size);
+        if (codec == CODEC_NONE) {
+            bind_buffer(&col, MYSQL_TYPE_BLOB, block, data_len, &col_len);
+        } else if ((zbuf = malloc(data_block_size)) != NULL) {
+            bind_buffer(&col, MYSQL_TYPE_BLOB, zbuf, data_len, &col_len);
+        } else {
+            mysql_stmt_free_result(stmt);
+            return -ENOMEM;
+        }
+        if (data_len && mysql_stmt_fetch_column(stmt, &col, 0, 0)) {
+            log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+            ret = -EIO;
+        } else if (codec == CODEC_NONE) {
+            *len = data_len;
+            ret = 1;
+        } else if ((n = codec_decompress(codec, zbuf, data_len, block, data_block_size)) < 0) {
+            log_printf(LOG_ERROR, "ERROR: cannot decompress a %s block\n", codec_name(codec));
+            ret = -EIO;
+        } else {
+            *len = n;
+            ret = 1;
+        }
+        free(zbuf);
+    }
+    mysql_stmt_free_result(stmt);
+
+    return ret;
+}
+
+/**
+ * Store one data block of a file, replacing the row, with the
+ * STMT_CODEC_WRITE prepared statement.  Only whole blocks are compressed,
+ * with data_codec, and only if that makes them shorter; so every compressed
+ * row decompresses to data_block_size bytes, which fsck relies on.
+ *
+ * @return 0 on success; -errno on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of the block
+ * @param data contents of the block
+ * @param len length of the block, at most data_block_size
+ */
+static int codec_put_block(MYSQL *mysql, long inode, unsigned long seq,
+                           const char *data, unsigned long len)
+{
+    long long id = inode, nr = seq, codec = CODEC_NONE;
+    unsigned long zlen = 0;
+    MYSQL_BIND param[4];
+    char *zbuf = NULL;
+    int ret = 0;
+
+    if (data_codec != CODEC_NONE && len == data_block_size) {
+        if ((zbuf = malloc(data_block_size)) == NULL)
+            return -ENOMEM;
+        if ((zlen = codec_compress(data_codec, data, len, zbuf, data_block_size)) > 0)
+            codec = data_codec;
+    }
+
+    bind_longlong(&param[0], &id);
+    bind_longlong(&param[1], &nr);
+    if (codec != CODEC_NONE)
+        bind_buffer(&param[2], MYSQL_TYPE_BLOB, zbuf, zlen, &zlen);
+    else
+        bind_buffer(&param[2], MYSQL_TYPE_BLOB, data, len, &len);
+    bind_longlong(&param[3], &codec);
+    if (!stmt_execute(mysql, STMT_CODEC_WRITE, param))
+        ret = -EIO;
+
+    free(zbuf);
+    return ret;
+}
+
+/**
+ * Write part of one block where rows may be compressed (see data_codecs).
+ * A whole block simply replaces the row.  Without compression, part of a
+ * block is spliced in by the server as write_one_block() does, unless the
+ * row turns out to be compressed: STMT_WRITE_RAW then leaves it alone, and
+ * the block is read, changed and stored again here, as it always is when
+ * compressing.
+ *
+ * @return size on success; -errno on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of the block
+ * @param data the data to write
+ * @param size number of bytes to write
+ * @param offset offset of the data within the block
+ * @param param STMT_WRITE_BLOCK parameters, from write_one_block()
+ */
+static int write_codec_block(MYSQL *mysql, long inode, unsigned long seq,
+                             const char *data, size_t size, off_t offset,
+                             MYSQL_BIND *param)
+{
+    MYSQL_STMT *stmt;
+    unsigned long len = 0;
+    char *block;
+    int ret;
+
+    if (offset == 0 && size == data_block_size)
+        return (ret = codec_put_block(mysql, inode, seq, data, size)) < 0 ? ret : (int)size;
+
+    /* Nothing changed also reports no rows affected: a rewrite does no harm then */
+    if (data_codec == CODEC_NONE) {
+        if (!(stmt = stmt_execute(mysql, STMT_WRITE_RAW, param)))
+            return -EIO;
+        if (mysql_stmt_affected_rows(stmt) > 0)
+            return size;
+    }
+
+    block = malloc(data_block_size);
+    if (!block)
+        return -ENOMEM;
+    memset(block, 0, data_block_size);
+    ret = codec_get_block(mysql, inode, seq, block, &len);
+    if (ret >= 0) {
+        memcpy(block + offset, data, size);
+        ret = codec_put_block(mysql, inode, seq, block, MAX(len, offset + size));
+    }
+    free(block);
+
+    return ret < 0 ? ret : (int)size;
+}
+
+/**
+ * Cut back the block across the new end of a file where rows may be
+ * compressed: the server cannot RPAD() a compressed row, so the block is
+ * read and stored again at its new length.
+ *
+ * @return 0 on success; -errno on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param info the blocks of the file up to its new length
+ */
+static int truncate_codec_block(MYSQL *mysql, long inode, const struct data_blocks_info *info)
+{
+    unsigned long len = 0;
+    char *block;
+    int ret;
+
+    block = malloc(data_block_size);
+    if (!block)
+        return -ENOMEM;
+    memset(block, 0, data_block_size);
+    ret = codec_get_block(mysql, inode, info->seq_last, block, &len);
+    if (ret > 0 && len != info->length_last)
+        ret = codec_put_block(mysql, inode, info->seq_last, block, info->length_last);
+    free(block);
+
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Writes part of one block into the database, with the STMT_WRITE_BLOCK
+ * prepared statement; the data is sent as is, in binary.
+ *
+ * The block row is created if it does not exist yet, padded with zeroes up
+ * to offset.  If it does exist, the bytes before offset and after
+ * offset + size are kept and the ones in between replaced; RPAD() both
+ * truncates and zero-pads the head as needed.  Where rows may be
+ * compressed write_codec_block() takes over.  The caller updates the file
+ * size.
+ *
+ * @return size on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode to write out the data block on
+ * @param seq sequence number of datablock to write
+ * @param data buffer of content to write
+ * @param size size_t length of data
+ * @param offset what offset within the datablock to write the data
+ */
+static int write_one_block(MYSQL *mysql, long inode,
+				 unsigned long seq,
+				 const char *data, size_t size,
+				 off_t offset)
+{
+    long long id = inode, block = seq, off = offset, from_new, from_old;
+    unsigned long len = size;
+    MYSQL_BIND param[7];
+
+    /* Shortcut */
+    if (size == 0) return 0;
+
+    if (offset + size > data_block_size) {
+        log_printf(LOG_ERROR, "%s(): offset(%zu)+size(%zu)>max_block(%zu)\n", 
+		   __func__, offset, size, data_block_size);
+	return -EIO;
+    }
+
+    /* We expect the inode is already locked for this thread by caller! */
+
+    from_new = offset + 1;
+    from_old = offset + size + 1;
+    bind_longlong(&param[0], &id);
+    bind_longlong(&param[1], &block);
+    bind_longlong(&param[2], &off);
+    bind_buffer(&param[3], MYSQL_TYPE_BLOB, data, len, &len);
+    bind_longlong(&param[4], &off);
+    bind_longlong(&param[5], &from_new);
+    bind_longlong(&param[6], &from_old);
+
+    if (data_codecs)
+        return write_codec_block(mysql, inode, seq, data, size, offset, param);
+
+    if (!stmt_execute(mysql, STMT_WRITE_BLOCK, param))
+        return -EIO;
+
+    return size;
+}
+
+/**
+ * Build the multi-row INSERT that writes a run of blocks, starting at a
+ * block boundary, into the database.  Every block but possibly the last
+ * is full; an existing row keeps whatever it held past the end of the new
+ * data, which only matters for a short last block.  Where rows may be
+ * compressed (see data_codecs) every block must be full, as rows are
+ * replaced outright; with compression on, each block goes out compressed
+ * if that makes it shorter.
+ *
+ * @return the query, to be freed by the caller; NULL if out of memory
+ * @param mysql handle to connection to the database, for escaping
+ * @param inode inode to write out the data blocks on
+ * @param seq sequence number of the first datablock to write
+ * @param data buffer of content to write
+ * @param size length of data, at most WRITE_BATCH_BYTES
+ * @param sql_len set to the length of the query
+ */
+static char *blocks_sql(MYSQL *mysql, long inode, unsigned long seq,
+			const char *data, size_t size, unsigned long *sql_len)
+{
+    char *sql, *zbuf = NULL;
+    const char *src;
+    size_t pos, len, zlen, done, max_len;
+    int codec;
+
+    max_len = 2 * size + 64 * (size / data_block_size + 1) + 256;
+    sql = malloc(max_len);
+    if (data_codec != CODEC_NONE)
+        zbuf = malloc(data_block_size);
+    if (!sql || (data_codec != CODEC_NONE && !zbuf)) {
+        free(sql);
+        free(zbuf);
+        return NULL;
+    }
+
+    pos = snprintf(sql, max_len, data_codecs ?
+		   "INSERT INTO data_blocks (inode, seq, data, codec) VALUES " :
+		   "INSERT INTO data_blocks (inode, seq, data) VALUES ");
+    for (done = 0; done < size; done += len, seq++) {
+        len = MIN(size - done, data_block_size);
+        src = data + done;
+        codec = CODEC_NONE;
+        if (zbuf && len == data_block_size &&
+            (zlen = codec_compress(data_codec, src, len, zbuf, data_block_size)) > 0) {
+            src = zbuf;
+            codec = data_codec;
+        } else {
+            zlen = len;
+        }
+        pos += snprintf(sql + pos, max_len - pos, "%s(%ld, %lu, _binary'",
+			done ? "," : "", inode, seq);
+        pos += mysql_real_escape_string(mysql, sql + pos, src, zlen);
+        sql[pos++] = '\'';
+        if (data_codecs)
+            pos += snprintf(sql + pos, max_len - pos, ", %d", codec);
+        sql[pos++] = ')';
+    }
+    if (data_codecs)
+        pos += snprintf(sql + pos, max_len - pos,
+                        " ON DUPLICATE KEY UPDATE data=VALUES(data), codec=VALUES(codec)");
+    else
+        pos += snprintf(sql + pos, max_len - pos,
+	                " ON DUPLICATE KEY UPDATE data=CONCAT(VALUES(data), "
+		           "SUBSTRING(IFNULL(data, '') FROM LENGTH(VALUES(data)) + 1))");
+    free(zbuf);
+
+    *sql_len = pos;
+    return sql;
+}
+
+/**
+ * Writes a run of blocks, starting at a block boundary, into the database
+ * as one multi-row INSERT (see blocks_sql()).  The caller updates the file
+ * size.
+ *
+ * @return size on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode to write out the data blocks on
+ * @param seq sequence number of the first datablock to write
+ * @param data buffer of content to write
+ * @param size length of data, at most WRITE_BATCH_BYTES
+ */
+static int write_blocks(MYSQL *mysql, long inode, unsigned long seq,
+			const char *data, size_t size)
+{
+    unsigned long sql_len;
+    char *sql;
+
+    sql = blocks_sql(mysql, inode, seq, data, size, &sql_len);
+    if (!sql)
+        return -ENOMEM;
+
+    log_printf(LOG_D_SQL, "sql=%.*s...\n", 160, sql);
+    if (mysql_real_query(mysql, sql, sql_len)) {
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        free(sql);
+        return -EIO;
+    }
+    free(sql);
+
+    return size;
+}
+
+/**
+ * Writes a long run of blocks, starting at a block boundary, as
+ * WRITE_BATCH_BYTES batches (see blocks_sql()) sent over up to stripe_width
+ * connections at once with async_run(): the caller's, and as many more as
+ * the pool has free right away.  Waiting for more could deadlock, with
+ * every connection held by a writer waiting for another.  The caller
+ * updates the file size.
+ *
+ * @return size on success; < 0 on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode to write out the data blocks on
+ * @param seq sequence number of the first datablock to write
+ * @param data buffer of content to write
+ * @param size length of data; where rows may be compressed, whole blocks
+ */
+static int write_blocks_async(MYSQL *mysql, long inode, unsigned long seq,
+			      const char *data, size_t size)
+{
+    struct async_query q[ASYNC_MAX_CONNS];
+    MYSQL *conn[ASYNC_MAX_CONNS];
+    size_t done = 0, len, batch;
+    int i, n, nconns, ret = size;
+
+    batch = MAX(WRITE_BATCH_BYTES / data_block_size, 1) * data_block_size;
+
+    conn[0] = mysql;
+    for (nconns = 1; nconns < MIN(stripe_width, ASYNC_MAX_CONNS) &&
+                     nconns * batch < size; nconns++)
+        if (!(conn[nconns] = pool_tryget()))
+            break;
+    log_printf(LOG_D_SQL, "%s(): inode %ld: %zu bytes over %d connections\n",
+               __func__, inode, size, nconns);
+
+    while (done < size && ret >= 0) {
+        for (n = 0; n < nconns && done < size; n++) {
+            len = MIN(size - done, batch);
+            q[n].mysql = conn[n];
+            q[n].sql = blocks_sql(conn[n], inode, seq, data + done, len, &q[n].len);
+            if (!q[n].sql) {
+                ret = -ENOMEM;
+                break;
+            }
+            done += len;
+            seq += len / data_block_size;
+        }
+        if (ret >= 0 && async_run(q, n) < 0)
+            ret = -EIO;
+        for (i = 0; i < n; i++)
+            free(q[i].sql);
+    }
+
+    for (i = 1; i < nconns; i++)
+        pool_put(conn[i]);
+    return ret;
+}
+
+/**
+ * Look up one data block of a file in dedup mode: its hash and, with data
+ * given, its contents, which are shared in block_store or, for a block
+ * written before dedup was switched on, still in the data_blocks row.
+ *
+ * @return 1 if the block exists; 0 if not; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of the block
+ * @param hash where to put the hash of the block, SHA256_SIZE bytes
+ * @param hashed set to 1 if the block has a hash, 0 if its data is in the row
+ * @param data where to put the contents, data_block_size bytes; NULL for the hash only
+ * @param len set to the length of the contents, if data is given
+ */
+static int dedup_get_block(MYSQL *mysql, long inode, unsigned long seq,
+                           unsigned char *hash, int *hashed, char *data, unsigned long *len)
+{
+    long long id = inode, nr = seq;
+    unsigned long hash_len = 0, data_len = 0;
+    my_bool hash_null = 1, data_null = 1;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[2], res[2];
+    int ret;
+
+    bind_longlong(&param[0], &id);
+    bind_longlong(&param[1], &nr);
+    stmt = stmt_execute(mysql, data ? STMT_DEDUP_BLOCK : STMT_DEDUP_HASH, param);
+    if (!stmt)
+        return -EIO;
+
+    bind_buffer(&res[0], MYSQL_TYPE_BLOB, (char *)hash, SHA256_SIZE, &hash_len);
+    res[0].is_null = &hash_null;
+    if (data) {
+        bind_buffer(&res[1], MYSQL_TYPE_BLOB, data, data_block_size, &data_len);
+        res[1].is_null = &data_null;
+    }
+    if (mysql_stmt_bind_result(stmt, res)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
+    }
+
+    ret = mysql_stmt_fetch(stmt);
+    if (ret == 0 || ret == MYSQL_DATA_TRUNCATED) {
+        *hashed = !hash_null && hash_len == SHA256_SIZE;
+        if (data)
+            *len = data_null ? 0 : MIN(data_len, data_block_size);
+        ret = 1;
+    } else if (ret == MYSQL_NO_DATA) {
+        ret = 0;
+    } else {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        ret = -EIO;
+    }
+    mysql_stmt_free_result(stmt);
+
+    return ret;
+}
+
+/**
+ * Store one data block of a file in dedup mode.  The block is hashed, and if
+ * block_store holds a block with that hash already only a reference to it is
+ * taken: the data itself is not sent.  The data_blocks row then points at the
+ * hash, and the reference it held before, if any, is dropped.
+ *
+ * References are always taken before they are dropped, so a crash leaves a
+ * block referenced too often, never too rarely; fsck counts them again.  Two
+ * writers storing the same new block both insert it, which STMT_DEDUP_STORE
+ * turns into a second reference.
+ *
+ * @return 0 on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of the block
+ * @param data contents of the block
+ * @param len length of the block, at most data_block_size
+ * @param old_hash hash the row has now; NULL if none
+ */
+static int dedup_put_block(MYSQL *mysql, long inode, unsigned long seq,
+                           const char *data, unsigned long len, const unsigned char *old_hash)
+{
+    unsigned char hash[SHA256_SIZE];
+    unsigned long hash_len = SHA256_SIZE;
+    long long id = inode, nr = seq;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND param[3];
+
+    sha256(data, len, hash);
+    if (old_hash && !memcmp(hash, old_hash, SHA256_SIZE))
+        return 0;
+
+    bind_buffer(&param[0], MYSQL_TYPE_BLOB, (char *)hash, SHA256_SIZE, &hash_len);
+    if (!(stmt = stmt_execute(mysql, STMT_DEDUP_REF, param)))
+        return -EIO;
+    if (mysql_stmt_affected_rows(stmt) == 0) {
+        bind_buffer(&param[1], MYSQL_TYPE_BLOB, data, len, &len);
+        if (!stmt_execute(mysql, STMT_DEDUP_STORE, param))
+            return -EIO;
+    }
+
+    bind_longlong(&param[0], &id);
+    bind_longlong(&param[1], &nr);
+    bind_buffer(&param[2], MYSQL_TYPE_BLOB, (char *)hash, SHA256_SIZE, &hash_len);
+    if (!stmt_execute(mysql, STMT_DEDUP_MAP, param))
+        return -EIO;
+
+    if (!old_hash)
+        return 0;
+    bind_buffer(&param[0], MYSQL_TYPE_BLOB, (char *)old_hash, SHA256_SIZE, &hash_len);
+    if (!stmt_execute(mysql, STMT_DEDUP_UNREF, param) ||
+        !stmt_execute(mysql, STMT_DEDUP_DROP, param))
+        return -EIO;
+
+    return 0;
+}
+
+/**
+ * Write data to a file in dedup mode, block by block with
+ * dedup_put_block().  A block the write covers only in part is read first
+ * and the new data merged into it.
+ *
+ * @return 0 on success; -errno on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param data the buffer of data to write
+ * @param size number of bytes to write
+ * @param offset offset within the file to write to
+ */
+static int write_dedup(MYSQL *mysql, long inode, const char *data, size_t size,
+                       off_t offset)
+{
+    unsigned char old_hash[SHA256_SIZE];
+    unsigned long seq, old_len;
+    size_t done = 0, in, len;
+    char *block = NULL;
+    int ret = 0, found, hashed = 0;
+
+    while (done < size) {
+        seq = (offset + done) / data_block_size;
+        in = (offset + done) % data_block_size;
+        len = MIN(size - done, data_block_size - in);
+
+        if (len == data_block_size) {
+            found = dedup_get_block(mysql, inode, seq, old_hash, &hashed, NULL, NULL);
+            if (found < 0) {
+                ret = found;
+                break;
+            }
+            ret = dedup_put_block(mysql, inode, seq, data + done, len,
+                                  found && hashed ? old_hash : NULL);
+        } else {
+            if (!block && !(block = malloc(data_block_size))) {
+                ret = -ENOMEM;
+                break;
+            }
+            memset(block, 0, data_block_size);
+            found = dedup_get_block(mysql, inode, seq, old_hash, &hashed, block, &old_len);
+            if (found < 0) {
+                ret = found;
+                break;
+            }
+            memcpy(block + in, data + done, len);
+            ret = dedup_put_block(mysql, inode, seq, block,
+                                  MAX(found ? old_len : 0, in + len),
+                                  found && hashed ? old_hash : NULL);
+        }
+        if (ret < 0)
+            break;
+        done += len;
+    }
+
+    free(block);
+    return ret;
+}
+
+/**
+ * Cut a file back in dedup mode: drop the references held by the blocks past
+ * the new end, and those blocks, then store the block across the end again,
+ * cut or padded to its new length.
+ *
+ * @return 0 on success; -errno on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param info the blocks of the file up to its new length
+ */
+static int truncate_dedup(MYSQL *mysql, long inode, const struct data_blocks_info *info)
+{
+    unsigned char old_hash[SHA256_SIZE];
+    unsigned long len;
+    char sql[SQL_MAX];
+    char *block;
+    int ret, hashed = 0;
+
+    /* Left to the collector with a gc_queue table, see query_truncate() */
+    if (!data_gc) {
+        snprintf(sql, SQL_MAX,
+                 "UPDATE block_store JOIN (SELECT hash, COUNT(*) AS n FROM data_blocks "
+                 "WHERE inode=%ld AND seq > %lu AND hash IS NOT NULL GROUP BY hash) AS d "
+                 "ON block_store.hash = d.hash SET block_store.refs = block_store.refs - d.n",
+                 inode, info->seq_last);
+        if ((ret = run_query(mysql, sql)) < 0 ||
+            (ret = run_query(mysql, "DELETE FROM block_store WHERE refs <= 0")) < 0)
+            return ret;
+        snprintf(sql, SQL_MAX, "DELETE FROM data_blocks WHERE inode=%ld AND seq > %lu",
+                 inode, info->seq_last);
+        if ((ret = run_query(mysql, sql)) < 0)
+            return ret;
+    }
+
+    block = malloc(data_block_size);
+    if (!block)
+        return -ENOMEM;
+    memset(block, 0, data_block_size);
+    ret = dedup_get_block(mysql, inode, info->seq_last, old_hash, &hashed, block, &len);
+    if (ret > 0 && len != info->length_last)
+        ret = dedup_put_block(mysql, inode, info->seq_last, block, info->length_last,
+                              hashed ? old_hash : NULL);
+    free(block);
+
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Whether a file may be kept inline.  A file only leaves the inodes row
+ * when it grows past data_inline_size, and never goes back, so one the
+ * attribute cache knows to be larger is in data_blocks; others must be
+ * asked.
+ */
+static int inline_maybe(long inode)
+{
+    struct stat st;
+
+    return !acache_lookup(inode, &st) || st.st_size <= (off_t)data_inline_size;
+}
+
+/**
+ * Number of rows the UPDATE just run matched, changed or not, from
+ * mysql_info(); mysql_affected_rows() counts only rows that changed.
+ */
+static unsigned long rows_matched(MYSQL *mysql)
+{
+    const char *info = mysql_info(mysql);
+    unsigned long matched;
+
+    if (!info || sscanf(info, "Rows matched: %lu", &matched) != 1)
+        return 0;
+    return matched;
+}
+
+/**
+ * Write into a file kept inline, splicing the data into its inline_data
+ * with the STMT_INLINE_WRITE prepared statement, which raises the file
+ * size too.  The write must end within data_inline_size.  Whether the file
+ * is inline at all is only known from whether the statement matched its
+ * row, so it takes no extra round trip.
+ *
+ * @return size if written; 0 if the file is not inline; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param data the buffer of data to write
+ * @param size number of bytes to write
+ * @param offset offset within the file to write to
+ */
+static int write_inline(MYSQL *mysql, long inode, const char *data, size_t size,
+                        off_t offset)
+{
+    long long id = inode, off = offset, from_old = offset + size + 1, end = offset + size;
+    unsigned long len = size;
+    MYSQL_BIND param[5];
+
+    bind_longlong(&param[0], &off);
+    bind_buffer(&param[1], MYSQL_TYPE_BLOB, data, len, &len);
+    bind_longlong(&param[2], &from_old);
+    bind_longlong(&param[3], &end);
+    bind_longlong(&param[4], &id);
+    if (!stmt_execute(mysql, STMT_INLINE_WRITE, param))
+        return -EIO;
+
+    return rows_matched(mysql) ? (int)size : 0;
+}
+
+/**
+ * Move a file kept inline to data_blocks, its inline data becoming block 0,
+ * as it is about to grow past data_inline_size.  Nothing happens to a file
+ * that is not inline.  The row is copied server side, with
+ * STMT_INLINE_SPILL, and only then is the inline data dropped.  Block 0 is
+ * padded with zeroes towards the new end of the file, as a short block
+ * followed by others would not read back right; for the same reason the
+ * short block 0 query_getattr() may have cached goes too.
+ *
+ * @return 0 on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param end new size of the file
+ */
+static int inline_spill(MYSQL *mysql, long inode, off_t end)
+{
+    long long id = inode, pad = MIN(end, (off_t)data_block_size);
+    MYSQL_BIND param[2];
+
+    bind_longlong(&param[0], &pad);
+    bind_longlong(&param[1], &id);
+    if (!stmt_execute(mysql, STMT_INLINE_SPILL, param) ||
+        !stmt_execute(mysql, STMT_INLINE_DROP, &param[1]))
+        return -EIO;
+
+    bcache_invalidate(inode, 0, BCACHE_TO_END);
+    return 0;
+}
+
+/**
+ * Write a number of bytes (perhaps larger than BLOCK_SIZE) at an offset into
+ * a file.  An unaligned first block, or a single block, is written with
+ * write_one_block(); all following blocks go out WRITE_BATCH_BYTES at a time
+ * as one multi-row INSERT each (see write_blocks()), and the file size is
+ * raised once at the end.  A write of up to WRITE_BATCH_BYTES thus costs two or three
+ * round trips instead of several per block; the batches of a longer one go
+ * over several connections at once (see write_blocks_async()).  Files stored in extents rather
+ * than blocks are written by write_extents() instead, and in dedup mode
+ * blocks are written one at a time by write_dedup().  A write that leaves a
+ * file kept inline within data_inline_size goes to the inodes row instead
+ * (see write_inline()); one past it first moves the file to data_blocks.
+ *
+ * @return < 0 in case of errors (propagating result of write_one_block() )
+ * @return > 0 number of bytes written (should equal size parameter)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param data the buffer of data to write
+ * @param size number of bytes to write
+ * @param offset offset within the file to write to
+ */
+int query_write(MYSQL *mysql, long inode, const char *data, size_t size,
+                off_t offset)
+{
+    long long id, new_size;
+    MYSQL_BIND param[2];
+    unsigned long seq = offset / data_block_size;
+    size_t done = 0, len, batch;
+    int ret;
+    struct stat st;
+
+    if (size == 0)
+        return 0;
+
+    batch = MAX(WRITE_BATCH_BYTES / data_block_size, 1);
+
+    lock_inode(mysql, inode);
+
+    /* Rows a truncate left for the collector must not show through */
+    if (data_gc) {
+        ret = gc_grow(mysql, inode, data_extent_size ? (long long)(offset + size) :
+                      (long long)((offset + size - 1) / data_block_size) + 1,
+                      !acache_lookup(inode, &st) || (off_t)(offset + size) > st.st_size);
+        if (ret < 0)
+            goto out;
+    }
+
+    /* Small files may be kept inline, which already sets the size */
+    if (data_inline_size && inline_maybe(inode)) {
+        if (offset + size <= data_inline_size)
+            ret = write_inline(mysql, inode, data, size, offset);
+        else
+            ret = inline_spill(mysql, inode, offset + size);
+        if (ret < 0)
+            goto out;
+        if (ret > 0) {
+            st.st_size = offset + size;
+            acache_update(inode, ACACHE_SIZE_GROW, &st);
+            goto out;
+        }
+    }
+
+    /* Extents have a mapping of their own */
+    if (data_extent_size) {
+        ret = write_extents(mysql, inode, data, size, offset);
+        if (ret < 0)
+            goto out;
+        done = size;
+    } else if (data_dedup) {
+        ret = write_dedup(mysql, inode, data, size, offset);
+        if (ret < 0)
+            goto out;
+        done = size;
+    }
+
+    /* Handle unaligned first block */
+    if (done < size && offset % data_block_size) {
+        len = MIN(size, data_block_size - offset % data_block_size);
+        ret = write_one_block(mysql, inode, seq++, data, len,
+			      offset % data_block_size);
+        if (ret < 0)
+            goto out;
+        done += len;
+    }
+
+    /* A write of several batches sends them over several connections at
+     * once, all but a short last block where rows may be compressed */
+    if (stripe_width > 1 && size - done > batch * data_block_size) {
+        len = size - done;
+        if (data_codecs)
+            len -= len % data_block_size;
+        ret = write_blocks_async(mysql, inode, seq, data + done, len);
+        if (ret < 0)
+            goto out;
+        done += len;
+        seq += len / data_block_size;
+    }
+
+    /* Handle the remaining blocks in batches; a lone block needs no batch.
+     * Where rows may be compressed a short last block goes on its own, as
+     * only write_one_block() keeps the rest of the row */
+    while (done < size) {
+        len = MIN(size - done, batch * data_block_size);
+        if (data_codecs && len > data_block_size)
+            len -= len % data_block_size;
+        if (len <= data_block_size)
+            ret = write_one_block(mysql, inode, seq, data + done, len, 0);
+        else
+            ret = write_blocks(mysql, inode, seq, data + done, len);
+        if (ret < 0)
+            goto out;
+        done += len;
+        seq += len / data_block_size;
+    }
+
+    /* Update file size */
+    id = inode;
+    new_size = offset + size;
+    bind_longlong(&param[0], &new_size);
+    bind_longlong(&param[1], &id);
+    if (!stmt_execute(mysql, STMT_SIZE_GROW, param)) {
+        ret = -EIO;
+        goto out;
+    }
+
+    st.st_size = offset + size;
+    acache_update(inode, ACACHE_SIZE_GROW, &st);
+    ret = size;
+
+out:
+    /* After the write; readers that began before it do not cache what they read (see bcache_generation()) */
+    bcache_invalidate(inode, offset / data_block_size, (offset + size - 1) / data_block_size);
+    unlock_inode(mysql, inode);
+    return ret;
+}
+
+/**
+ * Check the size of a file.  Check the value by reading the attribute stored
+ * in the inode table itself.  The function does not summarize the size "live"
+ * by summing the size of each data block; rather this value is updated in
+ * query_fsck(), query_truncate(), query_write().  This trust in the
+ * various write functions optimizes this function's response time and
+ * reduces DB load.
+ *
+ * @return total size of the file at the inode as represented in the inode block
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ */
+ssize_t query_size(MYSQL *mysql, long inode)
+{
+    size_t ret;
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    snprintf(sql, SQL_MAX, "SELECT size FROM inodes WHERE inode=%ld",
+             inode);
+
+    ret = mysql_query(mysql, sql);
+    if(ret){
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+
+    result = mysql_store_result(mysql);
+    if(!result){
+        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+
+    if(mysql_num_rows(result) != 1 || mysql_num_fields(result) != 1){
+        mysql_free_result(result);
+        log_printf(LOG_ERROR, "ERROR: non-unique number of rows for %d\n", inode);
+        return -EIO;
+    }
+
+    row = mysql_fetch_row(result);
+    if(!row){
+        log_printf(LOG_ERROR, "ERROR: row-fetch failed for %d\n", inode);
+        return -EIO;
+    }
+
+    if (row[0]) {
+        ret = atoll(row[0]);
+    } else {
+        ret = 0;
+    }
+    mysql_free_result(result);
+
+    return ret;
+}
+
+/**
+ * Returns the size of the given block (inode and sequence number).  No longer used by the write path, which lets the server do the padding and splicing (see write_one_block()).
+ *
+ * @return -ENXIO if the inode/seq pair is not found (zero rows returned, implying that block doesn't exist)
+ * @return -EIO if no row is returned (implying an error in the query response, signaled by mysql_fetch_row() returning NULL)
+ * @return 0 if the row is NULL (implying no result?)
+ * @return 1 - data_block_size (size of the actual block)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of datablock to check
+ */
+ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq)
+{
+    size_t ret;
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    snprintf(sql, SQL_MAX, "SELECT LENGTH(data) FROM data_blocks WHERE inode=%ld AND seq=%lu",
              inode, seq);
 
     ret = mysql_query(mysql, sql);
@@ -1074,55 +3101,66 @@ ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq)
 }
 
 /**
- * Rename a file.  Called by mysqlfs_rename()
+ * Rename a file.  A file already named name_to is replaced: its name goes
+ * in the same transaction as the rename, so name_to never goes missing,
+ * and then the file is purged as by query_unlink() if that was its last
+ * name.  Called by mysqlfs_rename()
  *
  * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
+ * @return -ENOENT if there is no name_from in parent_from
+ * @return -EEXIST if name_to in parent_to is a directory
  *
  * @see http://linux.die.net/man/2/rename
  *
  * @param mysql handle to the database
- * @param from name of file before the rename
- * @param to name of file after the rename
+ * @param parent_from inode of the directory holding the file before the rename
+ * @param name_from name of file before the rename
+ * @param parent_to inode of the directory holding the file after the rename
+ * @param name_to name of file after the rename
  */
-int query_rename(MYSQL *mysql, const char *from, const char *to)
+int query_rename(MYSQL *mysql, long parent_from, const char *name_from,
+                 long parent_to, const char *name_to)
 {
     int ret;
-    long inode, parent_to, parent_from;
-    char *tmp, *new_name, *old_name;
+    long inode, to_inode;
     char esc_new_name[PATH_MAX * 2], esc_old_name[PATH_MAX * 2];
     char sql[SQL_MAX];
 
     struct stat to_st;
 
-    
-    if (query_getattr(mysql, to, &to_st) != -ENOENT) {
-        if (S_ISDIR(to_st.st_mode))
+    ret = query_lookup(mysql, parent_from, name_from, &inode);
+    if (ret < 0)
+        return ret;
+
+    ret = query_lookup(mysql, parent_to, name_to, &to_inode);
+    if (ret == 0) {
+        ret = query_getattr(mysql, to_inode, &to_st);
+        if (ret == 0 && S_ISDIR(to_st.st_mode))
             return -EEXIST;
     } else {
-        to_st.st_ino = 0;
+        to_inode = 0;
     }
+    if (ret < 0 && ret != -ENOENT)
+        return ret;
 
-    inode = query_inode(mysql, from);
-
-    /* Lots of strdup()s follow because dirname() & basename()
-     * may modify the original string. */
-    tmp = strdup(from);
-    parent_from = query_inode(mysql, dirname(tmp));
-    free(tmp);
+    /* Two names of one file: nothing to do */
+    if (to_inode == inode)
+        return 0;
 
-    tmp = strdup(from);
-    old_name = basename(tmp);
-    mysql_real_escape_string(mysql, esc_old_name, old_name, strlen(old_name));
-    free(tmp);
+    mysql_real_escape_string(mysql, esc_old_name, name_from, strlen(name_from));
+    mysql_real_escape_string(mysql, esc_new_name, name_to, strlen(name_to));
 
-    tmp = strdup(to);
-    parent_to = query_inode(mysql, dirname(tmp));
-    free(tmp);
+    if (to_inode && run_query(mysql, "START TRANSACTION"))
+        return -EIO;
 
-    tmp = strdup(to);
-    new_name = basename(tmp);
-    mysql_real_escape_string(mysql, esc_new_name, new_name, strlen(new_name));
-    free(tmp);
+    /* The target goes first, (name, parent) is unique */
+    if (to_inode) {
+        snprintf(sql, SQL_MAX, "DELETE FROM tree "
+                 "WHERE inode = %ld and name = '%s' and parent='%ld'",
+                 to_inode, esc_new_name, parent_to);
+        if ((ret = run_query(mysql, sql)))
+            goto rollback;
+    }
 
     snprintf(sql, SQL_MAX,
              "UPDATE tree "
@@ -1130,33 +3168,215 @@ int query_rename(MYSQL *mysql, const char *from, const char *to)
 	     "WHERE inode=%ld AND name='%s' AND parent=%ld ",
              esc_new_name, parent_to,
 	     inode, esc_old_name, parent_from);
+    if ((ret = run_query(mysql, sql)))
+        goto rollback;
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    /* Renamed or removed since the lookup: the target stays */
+    if (mysql_affected_rows(mysql) < 1) {
+        ret = -ENOENT;
+        goto rollback;
+    }
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    if (to_inode && run_query(mysql, "COMMIT"))
         return -EIO;
+
+    dcache_enter_negative(parent_from, name_from);
+    dcache_enter(parent_to, name_to, inode);
+
+    if (to_inode) {
+        acache_invalidate(to_inode);	/* nlinks changed */
+        /* query_set_deleted() leaves the flag alone while another name is left */
+        ret = query_set_deleted(mysql, to_inode);
+        if (ret == 0)
+            ret = query_purge_deleted(mysql, to_inode);
+        if (ret < 0)
+            log_printf(LOG_ERROR, "Error: inode %ld replaced by a rename left to fsck\n", to_inode);
+    }
+
+    return 0;
+
+rollback:
+    if (to_inode)
+        run_query(mysql, "ROLLBACK");
+    dcache_invalidate(parent_from, name_from);
+    return ret;
+}
+
+/**
+ * Read the settings of the filesystem from the superblock table: the block
+ * size into data_block_size, which all block arithmetic uses from then on,
+ * and the largest extent into data_extent_size, which selects the data
+ * layout (see query_read()), whether blocks are deduplicated into
+ * data_dedup, and the largest file kept inline into data_inline_size.
+ * Whether data_blocks rows can be compressed, which needs their
+ * codec column, goes into data_codecs.  The version of the stored procedures
+ * installed decides whether they are called (see call_procedure()), and the
+ * inode_seq table whether inode numbers are reserved from it (see
+ * inode_alloc()), which is moved past the inodes of tree if it is not
+ * already, and the gc_queue table into data_gc.  All are chosen when the database is created
+ * (see schema.sql); the block size can be changed offline with
+ * mysqlfs_reblock.  A database from before the superblock table keeps the
+ * layout and fixed block size of that time, data_blocks rows of
+ * DATA_BLOCK_SIZE.
+ *
+ * @return 0 on success
+ * @return -EIO if the query fails
+ * @return -EINVAL if a stored setting is out of range
+ * @param mysql handle to connection to the database
+ */
+int query_superblock(MYSQL *mysql)
+{
+    unsigned long block_size = DATA_BLOCK_SIZE, extent_size = 0, dedup = 0, inline_size = 0;
+    unsigned long procs = 0;
+    int codecs, ranges;
+    const char *sql = "SELECT name, value FROM superblock";
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        if (mysql_errno(mysql) != ER_NO_SUCH_TABLE) {
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
+        log_printf(LOG_INFO, "No superblock table, using %d-byte blocks\n", DATA_BLOCK_SIZE);
+    } else {
+        result = mysql_store_result(mysql);
+        if (!result) {
+            log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
+        while ((row = mysql_fetch_row(result)) != NULL) {
+            if (!row[0] || !row[1])
+                continue;
+            if (!strcmp(row[0], "block_size"))
+                block_size = strtoul(row[1], NULL, 10);
+            else if (!strcmp(row[0], "extent_size"))
+                extent_size = strtoul(row[1], NULL, 10);
+            else if (!strcmp(row[0], "dedup"))
+                dedup = strtoul(row[1], NULL, 10);
+            else if (!strcmp(row[0], "inline_size"))
+                inline_size = strtoul(row[1], NULL, 10);
+            else if (!strcmp(row[0], "procedures"))
+                procs = strtoul(row[1], NULL, 10);
+        }
+        mysql_free_result(result);
+    }
+
+    if (block_size < DATA_BLOCK_SIZE || block_size > DATA_BLOCK_SIZE_MAX) {
+        log_printf(LOG_ERROR, "ERROR: block size %lu out of range %d-%d\n",
+                   block_size, DATA_BLOCK_SIZE, DATA_BLOCK_SIZE_MAX);
+        return -EINVAL;
+    }
+    if (extent_size && (extent_size < DATA_BLOCK_SIZE || extent_size > DATA_EXTENT_SIZE_MAX)) {
+        log_printf(LOG_ERROR, "ERROR: extent size %lu out of range %d-%d\n",
+                   extent_size, DATA_BLOCK_SIZE, DATA_EXTENT_SIZE_MAX);
+        return -EINVAL;
+    }
+    if (dedup && extent_size) {
+        log_printf(LOG_ERROR, "ERROR: dedup needs the block layout, extent_size 0\n");
+        return -EINVAL;
+    }
+    if (inline_size > block_size) {
+        log_printf(LOG_ERROR, "ERROR: inline size %lu larger than the block size %lu\n",
+                   inline_size, block_size);
+        return -EINVAL;
+    }
+    if (inline_size && (extent_size || dedup)) {
+        log_printf(LOG_ERROR, "ERROR: inline_size needs the block layout without dedup\n");
+        return -EINVAL;
+    }
+
+    /* Files can be kept inline only if inodes has an inline_data column */
+    if (inline_size) {
+        sql = "SELECT inline_data FROM inodes LIMIT 0";
+        log_printf(LOG_D_SQL, "sql=%s\n", sql);
+        if (mysql_query(mysql, sql)) {
+            log_printf(LOG_ERROR, "ERROR: inline_size needs the inline_data column of inodes\n");
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EINVAL;
+        }
+        if ((result = mysql_store_result(mysql)) != NULL)
+            mysql_free_result(result);
+    }
+
+    /* Blocks may be compressed only if data_blocks has a codec column */
+    sql = "SELECT codec FROM data_blocks LIMIT 0";
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        if (mysql_errno(mysql) != ER_BAD_FIELD_ERROR) {
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
+        codecs = 0;
+    } else {
+        if ((result = mysql_store_result(mysql)) != NULL)
+            mysql_free_result(result);
+        codecs = 1;
+    }
+    if (data_codec != CODEC_NONE && (!codecs || dedup || extent_size)) {
+        log_printf(LOG_ERROR, "ERROR: compress=%s needs the block layout without dedup, "
+                   "and the codec column of data_blocks\n", codec_name(data_codec));
+        return -EINVAL;
     }
 
-    if (to_st.st_ino) {
-        snprintf(sql, SQL_MAX, "DELETE FROM tree "
-                 "WHERE inode = %lu and name = '%s' and parent='%ld'",
-                 to_st.st_ino, esc_new_name, parent_to);
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        ret = mysql_query(mysql, sql);
-        if (ret) {
-            log_printf(LOG_ERROR, "Error: mysql_query()\n");
+    data_block_size = block_size;
+    data_extent_size = extent_size;
+    data_dedup = !!dedup;
+    data_inline_size = inline_size;
+    data_codecs = codecs;
+
+    /* Inode numbers come from inode_seq if the database has it */
+    sql = "SELECT value FROM inode_seq WHERE name='inode'";
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        if (mysql_errno(mysql) != ER_NO_SUCH_TABLE) {
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
+        ranges = 0;
+    } else {
+        result = mysql_store_result(mysql);
+        if (!result) {
+            log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
             log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
             return -EIO;
         }
+        ranges = mysql_num_rows(result) > 0;
+        mysql_free_result(result);
+        if (!ranges) {
+            log_printf(LOG_ERROR, "ERROR: inode_seq has no inode row\n");
+            return -EINVAL;
+        }
+        /* A table seeded by hand at or below the inodes in use would make
+           every create fail with -EEXIST; start it past them */
+        if (run_query(mysql, "UPDATE inode_seq SET value=GREATEST(value, "
+                      "(SELECT IFNULL(MAX(inode), 0) + 1 FROM tree)) WHERE name='inode'"))
+            return -EIO;
     }
+    inode_ranges = ranges;
 
-    /*
-    if (mysql_affected_rows(mysql) < 1)
-      return -ETHIS_IS_STRANGE;	/ * Someone deleted the direntry? Do we care? * /
-    */
+    /* Data is left to the collector if the database has a gc_queue */
+    sql = "SELECT inode FROM gc_queue LIMIT 0";
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        if (mysql_errno(mysql) != ER_NO_SUCH_TABLE) {
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
+        data_gc = 0;
+    } else {
+        if ((result = mysql_store_result(mysql)) != NULL)
+            mysql_free_result(result);
+        data_gc = 1;
+    }
+
+    /* Procedures of another version take other arguments */
+    if (procs && procs != PROCEDURES_VERSION)
+        log_printf(LOG_WARNING, "Stored procedures version %lu, not %d; not using them\n",
+                   procs, PROCEDURES_VERSION);
+    procedures = procs == PROCEDURES_VERSION;
 
     return 0;
 }
@@ -1166,29 +3386,20 @@ int query_rename(MYSQL *mysql, const char *from, const char *to)
  * this file so that deletions at the inode level cannot result in purged data
  * while the file is in-use.
  *
- * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
+ * @return 0 on success; -EIO if the STMT_INUSE_INC statement fails (and the error is logged)
  * @param mysql handle to the database
  * @param inode inode of the file that is to be marked deleted 
  * @param increment how many additional "uses" to increment in the file's inode
  */
 int query_inuse_inc(MYSQL *mysql, long inode, int increment)
 {
-    int ret;
-    char sql[SQL_MAX];
+    long long id = inode, inc = increment;
+    MYSQL_BIND param[2];
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE inodes SET inuse = inuse + %d "
-             "WHERE inode=%lu",
-             increment, inode);
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    bind_longlong(&param[0], &inc);
+    bind_longlong(&param[1], &id);
+    if (!stmt_execute(mysql, STMT_INUSE_INC, param))
         return -EIO;
-    }
 
     return 0;
 }
@@ -1219,9 +3430,50 @@ int query_purge_deleted(MYSQL *mysql, long inode)
         return -EIO;
     }
 
+    if (mysql_affected_rows(mysql) > 0) {
+        acache_invalidate(inode);
+        bcache_invalidate(inode, 0, BCACHE_TO_END);
+        gc_wake();
+    }
+
     return 0;
 }
 
+/**
+ * Count a close of the inode (see query_inuse_inc()) and purge it if it was
+ * unlinked and this was its last use (see query_purge_deleted()), in one CALL
+ * of mysqlfs_release with the stored procedures of schema.sql installed.
+ * Called by mysqlfs_release().
+ *
+ * @return 0 on success; -EIO if a statement fails (and the error is logged)
+ * @param mysql handle to the database
+ * @param inode inode of the file closed
+ */
+int query_release(MYSQL *mysql, long inode)
+{
+    int ret;
+    long long purged;
+    char sql[SQL_MAX];
+
+    if (procedures) {
+        snprintf(sql, SQL_MAX, "CALL mysqlfs_release(%ld)", inode);
+        ret = call_procedure(mysql, sql, &purged, 1);
+        if (ret != -ENOSYS) {
+            if (ret == 0 && purged > 0) {
+                acache_invalidate(inode);
+                bcache_invalidate(inode, 0, BCACHE_TO_END);
+                gc_wake();
+            }
+            return ret;
+        }
+    }
+
+    ret = query_inuse_inc(mysql, inode, -1);
+    if (ret < 0)
+        return ret;
+    return query_purge_deleted(mysql, inode);
+}
+
 /**
  * Mark the inode deleted where the name of the tree column is NULL.  This
  * allows files that are still in use to be deleted without wiping out their
@@ -1254,140 +3506,478 @@ int query_set_deleted(MYSQL *mysql, long inode)
 }
 
 /**
- * Clean filesystem.  Only run in pool_check_mysql_setup() if mysqlfs_opt::fsck == 1
- *
- * -# delete inodes with deleted==1
- * -# delete direntries without corresponding inode
- * -# set inuse=0 for all inodes
- * -# delete data without existing inode
- * -# synchronize inodes.size=data.LENGTH(data)
- * -# optimize tables
+ * Delete the data of an inode in the range from up to, not including, to:
+ * data_blocks rows by block number, data_extents rows by byte offset.  At
+ * most chunk blocks' worth are deleted, starting at the first row in the
+ * range, so one call holds the locks of the server only briefly; 0 deletes
+ * the whole range.  With dedup the blocks shared through block_store lose
+ * their references, as in the drop_data trigger, in one transaction with
+ * the delete of the rows, which are locked first: a retry after a failure,
+ * or a drop of the same rows elsewhere, cannot take the references twice.
+ * Called by the collector (see gc.c).
  *
- * @return return from call to mysql_query()
- * @param mysql handle to database connection
+ * @return 1 if rows may have been deleted, and *next is where the rest starts
+ * @return 0 if the range holds no data
+ * @return -EIO if a statement fails (logged)
+ * @param mysql handle to connection to the database
+ * @param inode inode whose data is deleted
+ * @param from first block, or byte offset with extents, to delete
+ * @param to end of the range, past any data for the end of the file
+ * @param chunk most blocks' worth of data to delete; 0 for no limit
+ * @param next where to store the end of what was deleted
  */
-int query_fsck(MYSQL *mysql)
+int query_drop_data(MYSQL *mysql, long inode, long long from, long long to,
+                    unsigned int chunk, long long *next)
 {
+    const char *table = data_extent_size ? "data_extents" : "data_blocks";
+    const char *col = data_extent_size ? "pos" : "seq";
+    long long first, last, width;
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int len = 0;
 
-    /*
-     query_fsck by florian wiessner (f.wiessner@smart-weblications.de)
-    */
-    printf("Starting fsck\n");
+    /* Skip the holes: the range starts at its first row */
+    snprintf(sql, SQL_MAX, "SELECT MIN(%s) FROM %s WHERE inode=%ld AND %s>=%lld AND %s<%lld",
+             col, table, inode, col, from, col, to);
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    result = mysql_store_result(mysql);
+    if (!result) {
+        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    row = mysql_fetch_row(result);
+    if (!row || !row[0]) {
+        mysql_free_result(result);
+        *next = to;
+        return 0;
+    }
+    first = strtoll(row[0], NULL, 10);
+    mysql_free_result(result);
 
-    // 1. delete inodes with deleted==1
-    int ret;
-//    int ret2;
+    width = data_extent_size ? (long long)chunk * data_block_size : chunk;
+    last = chunk && to - first > width ? first + width : to;
+
+    if (data_dedup)
+        len = snprintf(sql, SQL_MAX,
+                       "START TRANSACTION; "
+                       "SELECT seq FROM data_blocks WHERE inode=%ld AND seq>=%lld AND seq<%lld FOR UPDATE; "
+                       "UPDATE block_store JOIN (SELECT hash, COUNT(*) AS n FROM data_blocks "
+                       "WHERE inode=%ld AND seq>=%lld AND seq<%lld AND hash IS NOT NULL GROUP BY hash) AS d "
+                       "ON block_store.hash = d.hash SET block_store.refs = block_store.refs - d.n; "
+                       "DELETE FROM block_store WHERE refs <= 0; ",
+                       inode, first, last, inode, first, last);
+    len += snprintf(sql + len, SQL_MAX - len, "DELETE FROM %s WHERE inode=%ld AND %s>=%lld AND %s<%lld",
+                    table, inode, col, first, col, last);
+    if (data_dedup)
+        snprintf(sql + len, SQL_MAX - len, "; COMMIT");
+    if (run_statements(mysql, sql) < 0) {
+        /* The statements after the failed one did not run, COMMIT included */
+        if (data_dedup)
+            run_query(mysql, "ROLLBACK");
+        return -EIO;
+    }
+
+    *next = last;
+    return 1;
+}
+
+/**
+ * Leave the data of an inode from block from, or byte offset with extents,
+ * on to the collector: the gc_queue row of the inode starts there, or
+ * further back if it did already.
+ *
+ * @return 0 on success; -EIO if the statement fails (logged)
+ * @param mysql handle to connection to the database
+ * @param inode inode whose data is left
+ * @param from first block, or byte offset, of the data left
+ */
+int query_gc_queue(MYSQL *mysql, long inode, long long from)
+{
     char sql[SQL_MAX];
-    printf("Stage 1...\n");
+
     snprintf(sql, SQL_MAX,
-             "DELETE from inodes WHERE inodes.deleted = 1");
+             "INSERT INTO gc_queue (inode, seq) VALUES (%ld, %lld) "
+             "ON DUPLICATE KEY UPDATE seq=LEAST(seq, VALUES(seq))", inode, from);
+    return run_query(mysql, sql);
+}
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+/**
+ * Move the start of the gc_queue row of an inode on from seq, or with next
+ * negative delete the row, because the collector is done with it.  Nothing
+ * happens if the row no longer starts at seq, since a truncate moved it.
+ *
+ * @return 0 on success; -EIO if the statement fails (logged)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the row
+ * @param seq where the row starts
+ * @param next where it starts from now on; < 0 to delete the row
+ */
+int query_gc_advance(MYSQL *mysql, long inode, long long seq, long long next)
+{
+    char sql[SQL_MAX];
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
+    if (next < 0)
+        snprintf(sql, SQL_MAX, "DELETE FROM gc_queue WHERE inode=%ld AND seq=%lld",
+                 inode, seq);
+    else
+        snprintf(sql, SQL_MAX, "UPDATE gc_queue SET seq=%lld WHERE inode=%ld AND seq=%lld",
+                 next, inode, seq);
+    return run_query(mysql, sql);
+}
+
+/**
+ * List the rows of gc_queue, those of inodes that still exist only if
+ * live, calling filler for each until it returns non-zero.  At most limit
+ * rows are listed; 0 lists all.
+ *
+ * @return 0 on success; -EIO if the query fails (logged)
+ * @param mysql handle to connection to the database
+ * @param live whether to list only the rows of inodes that still exist, i.e. were truncated
+ * @param inode the inode whose row to list; 0 for all
+ * @param limit most rows to list; 0 for all
+ * @param filler called with the inode and start of each row
+ * @param ctx passed through to filler
+ */
+int query_gc_list(MYSQL *mysql, int live, long inode, unsigned int limit,
+                  query_gc_filler filler, void *ctx)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int len;
+
+    len = snprintf(sql, SQL_MAX, live ?
+                   "SELECT gc_queue.inode, gc_queue.seq FROM gc_queue "
+                   "INNER JOIN inodes ON inodes.inode = gc_queue.inode" :
+                   "SELECT inode, seq FROM gc_queue");
+    if (inode)
+        len += snprintf(sql + len, SQL_MAX - len, " WHERE gc_queue.inode=%ld", inode);
+    if (limit)
+        snprintf(sql + len, SQL_MAX - len, " LIMIT %u", limit);
+
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
         return -EIO;
     }
-    // 2. - delete direntries without corresponding inode
-    printf("Stage 2...\n");
-    snprintf(sql, SQL_MAX, "delete from tree where tree.inode not in (select inode from inodes);");
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
+    result = mysql_store_result(mysql);
+    if (!result) {
+        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
         return -EIO;
     }
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        if (!row[0] || !row[1])
+            continue;
+        if (filler(ctx, atol(row[0]), strtoll(row[1], NULL, 10)))
+            break;
+    }
+    mysql_free_result(result);
 
+    return 0;
+}
 
+/**
+ * Take or give back a lock of the server, named after the job and the
+ * database, that lets only one mount at a time do the job: the collector,
+ * so two never drop the references of the same deduplicated blocks twice,
+ * or fsck.  The lock belongs to the connection, which must be kept until
+ * it is given back.
+ *
+ * @return 1 if taken (or given back), 0 if another mount holds it
+ * @return -EIO if the query fails (logged)
+ * @param mysql handle to connection to the database
+ * @param name name of the job, e.g. "gc"
+ * @param take whether to take the lock rather than give it back
+ * @param wait seconds to wait for the lock to be free; 0 not to wait
+ */
+int query_lock(MYSQL *mysql, const char *name, int take, unsigned int wait)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int ret;
 
-    // 3. set inuse=0 for all inodes
-    printf("Stage 3...\n");
-    snprintf(sql, SQL_MAX, "UPDATE inodes SET inuse=0;");
+    if (take)
+        snprintf(sql, SQL_MAX, "SELECT GET_LOCK(CONCAT('mysqlfs_%s.', DATABASE()), %u)", name, wait);
+    else
+        snprintf(sql, SQL_MAX, "SELECT RELEASE_LOCK(CONCAT('mysqlfs_%s.', DATABASE()))", name);
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
+    if (mysql_query(mysql, sql)) {
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    result = mysql_store_result(mysql);
+    if (!result) {
+        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
         return -EIO;
     }
+    row = mysql_fetch_row(result);
+    ret = row && row[0] && atoi(row[0]) == 1;
+    mysql_free_result(result);
 
+    return ret;
+}
 
-    // 4. delete data without existing inode
-    printf("Stage 4...\n");
-    snprintf(sql, SQL_MAX, "delete from data_blocks where inode not in (select inode from inodes);");
+/**
+ * The end of the inode numbers fsck checks: one past the highest inode
+ * that has an inodes row, a name or data.  Each is read off an index.
+ *
+ * @return the end; -EIO if the query fails (logged)
+ * @param mysql handle to connection to the database
+ */
+long long query_fsck_end(MYSQL *mysql)
+{
+    char sql[SQL_MAX];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    long long end;
 
+    snprintf(sql, SQL_MAX,
+             "SELECT GREATEST(IFNULL((SELECT MAX(inode) FROM inodes), 0), "
+             "IFNULL((SELECT MAX(inode) FROM tree), 0), "
+             "IFNULL((SELECT MAX(inode) FROM %s), 0)) + 1",
+             data_extent_size ? "data_extents" : "data_blocks");
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
+    if (mysql_query(mysql, sql)) {
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
         return -EIO;
     }
+    result = mysql_store_result(mysql);
+    if (!result) {
+        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    row = mysql_fetch_row(result);
+    end = row && row[0] ? strtoll(row[0], NULL, 10) : 1;
+    mysql_free_result(result);
 
+    return end;
+}
 
-    // 5. synchronize inodes.size=data.LENGTH(data)
-    printf("Stage 5...\n");
-    long int inode;
-    long int size;
-    
-    snprintf(sql, SQL_MAX, "select inode, sum(OCTET_LENGTH(data)) as size from data_blocks group by inode");
+/**
+ * Read where the fsck pass in progress, if any, stands: all inodes below
+ * *next are checked, up to *end.
+ *
+ * @return 1 if a pass is in progress; 0 if not
+ * @return -ENOSYS if the database has no fsck_state table
+ * @return -EIO if the query fails (logged)
+ * @param mysql handle to connection to the database
+ * @param next where to store the first inode not known to be checked
+ * @param end where to store the end of the pass
+ */
+int query_fsck_state(MYSQL *mysql, long long *next, long long *end)
+{
+    const char *sql = "SELECT name, value FROM fsck_state";
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int found = 0;
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        if (mysql_errno(mysql) == ER_NO_SUCH_TABLE)
+            return -ENOSYS;
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    result = mysql_store_result(mysql);
+    if (!result) {
+        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        if (!row[0] || !row[1])
+            continue;
+        if (!strcmp(row[0], "next")) {
+            *next = strtoll(row[1], NULL, 10);
+            found |= 1;
+        } else if (!strcmp(row[0], "end")) {
+            *end = strtoll(row[1], NULL, 10);
+            found |= 2;
+        }
+    }
+    mysql_free_result(result);
 
-    ret = mysql_query(mysql, sql);
-
-    MYSQL_RES* myresult;
-    MYSQL_ROW row;
+    return found == 3;
+}
 
-    myresult = mysql_store_result(mysql);
-    while ((row = mysql_fetch_row(myresult)) != NULL) {
-     inode = atol(row[0]);
-     size = atol(row[1]);
-                     
-      snprintf(sql, SQL_MAX, "update inodes set size=%ld where inode=%ld;", size, inode);
-      log_printf(LOG_D_SQL, "sql=%s\n", sql);
-      mysql_query(mysql, sql);
+/**
+ * Record how far the fsck pass has got, so the next mount resumes there;
+ * with end negative the pass is done, and the next one starts afresh.
+ *
+ * @return 0 on success; -EIO if the statement fails (logged)
+ * @param mysql handle to connection to the database
+ * @param next first inode not known to be checked
+ * @param end end of the pass; < 0 when it is done
+ */
+int query_fsck_save(MYSQL *mysql, long long next, long long end)
+{
+    char sql[SQL_MAX];
 
-/*      if (myresult) { // something has gone wrong.. delete datablocks...
+    if (end < 0)
+        return run_query(mysql, "DELETE FROM fsck_state");
+    snprintf(sql, SQL_MAX, "REPLACE INTO fsck_state VALUES ('next', %lld), ('end', %lld)",
+             next, end);
+    return run_query(mysql, sql);
+}
 
-        snprintf(sql, SQL_MAX, "delete from inodes where inode=%ld;", inode);
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        ret2 = mysql_query(mysql, sql);
+/**
+ * Check and repair the inodes in [lo, hi), with one batch of set-based
+ * statements, each bounded to the range by the inode index of its table:
+ *
+ * -# delete inodes deleted and no longer in use, left by a mount that
+ *    stopped between the two steps
+ * -# delete data without existing inode, or with a gc_queue table leave
+ *    it to the collector.  Deduplicated blocks keep the reference, which
+ *    is only counted again offline (see query_fsck())
+ * -# drop the inline data of files that also have data blocks, left by an
+ *    interrupted inline_spill()
+ * -# raise inodes.size to the end of the last block or extent, left short
+ *    by a write that stopped before its size update.  A size is never
+ *    lowered to the data: holes, such as those a truncate leaves, are part
+ *    of the file.  Files with data left to the collector are skipped, as
+ *    their rows past the end are stale.  The size of a file kept inline is
+ *    that of its inline data, which truncate pads along with the size
+ *
+ * Safe while the filesystem is in use; called by the workers of fsck.c.
+ * Direntries without an inode are left to query_fsck(): an older mysqlfs
+ * commits the tree row of a new file before its inodes row, and a mount of
+ * it in between would lose the file.
+ *
+ * @return 0 on success; -EIO if a statement fails (logged)
+ * @param mysql handle to connection to the database
+ * @param lo first inode to check
+ * @param hi end of the inodes to check
+ */
+int query_fsck_range(MYSQL *mysql, long long lo, long long hi)
+{
+    const char *table = data_extent_size ? "data_extents" : "data_blocks";
+    const char *col = data_extent_size ? "pos" : "seq";
+    char end[SQL_MAX / 8];
+    char sql[SQL_MAX];
+    int len;
+
+    len = snprintf(sql, SQL_MAX,
+                   "DELETE FROM inodes WHERE inode>=%lld AND inode<%lld AND deleted=1 AND inuse=0; ",
+                   lo, hi);
+
+    if (data_gc)
+        len += snprintf(sql + len, SQL_MAX - len,
+                        "INSERT INTO gc_queue (inode, seq) SELECT DISTINCT d.inode, 0 FROM %s AS d "
+                        "LEFT JOIN inodes ON inodes.inode = d.inode "
+                        "WHERE d.inode>=%lld AND d.inode<%lld AND inodes.inode IS NULL "
+                        "ON DUPLICATE KEY UPDATE seq=0; ",
+                        table, lo, hi);
+    else
+        len += snprintf(sql + len, SQL_MAX - len,
+                        "DELETE d FROM %s AS d LEFT JOIN inodes ON inodes.inode = d.inode "
+                        "WHERE d.inode>=%lld AND d.inode<%lld AND inodes.inode IS NULL; ",
+                        table, lo, hi);
+
+    if (data_inline_size)
+        len += snprintf(sql + len, SQL_MAX - len,
+                        "UPDATE inodes JOIN (SELECT DISTINCT inode FROM data_blocks "
+                        "WHERE inode>=%lld AND inode<%lld) AS d ON inodes.inode = d.inode "
+                        "SET inodes.inline_data=NULL WHERE inodes.inline_data IS NOT NULL; "
+                        "UPDATE inodes SET size=LENGTH(inline_data) "
+                        "WHERE inode>=%lld AND inode<%lld AND inline_data IS NOT NULL; ",
+                        lo, hi, lo, hi);
+
+    /* The end of the last row; all rows before it are whole blocks */
+    if (data_extent_size)
+        snprintf(end, sizeof(end), "b.pos + OCTET_LENGTH(b.data)");
+    else if (data_dedup)
+        snprintf(end, sizeof(end), "b.seq * %zu + OCTET_LENGTH(IFNULL(b.data, s.data))",
+                 data_block_size);
+    else if (data_codecs)
+        /* compressed rows always hold whole blocks (see codec_put_block()) */
+        snprintf(end, sizeof(end), "b.seq * %zu + IF(b.codec=0, OCTET_LENGTH(b.data), %zu)",
+                 data_block_size, data_block_size);
+    else
+        snprintf(end, sizeof(end), "b.seq * %zu + OCTET_LENGTH(b.data)", data_block_size);
+
+    snprintf(sql + len, SQL_MAX - len,
+             "UPDATE inodes JOIN (SELECT b.inode, %s AS data_end FROM %s AS b %s"
+             "JOIN (SELECT inode, MAX(%s) AS last FROM %s WHERE inode>=%lld AND inode<%lld "
+             "GROUP BY inode) AS m ON b.inode = m.inode AND b.%s = m.last) AS e "
+             "ON inodes.inode = e.inode %s"
+             "SET inodes.size = e.data_end WHERE inodes.size < e.data_end%s",
+             end, table, data_dedup ? "LEFT JOIN block_store AS s ON s.hash = b.hash " : "",
+             col, table, lo, hi, col,
+             data_gc ? "LEFT JOIN gc_queue AS q ON q.inode = inodes.inode " : "",
+             data_gc ? " AND q.inode IS NULL" : "");
+
+    return run_statements(mysql, sql);
+}
 
-      }
-*/ // skip this for now!
+/**
+ * Clean filesystem offline.  Only run in pool_check_mysql_setup() if
+ * mysqlfs_opt::fsck == 2, before anything is served and with no other
+ * mount running, as it also repairs what cannot be repaired online
+ * (see fsck.c for the check of a filesystem in use):
+ *
+ * -# delete inodes with deleted==1
+ * -# set inuse=0 for all inodes
+ * -# delete direntries without corresponding inode
+ * -# check all inodes as in query_fsck_range()
+ * -# in dedup mode, count the references to shared blocks again
+ *
+ * @return 0 on success; -EIO if a statement fails (logged)
+ * @param mysql handle to database connection
+ */
+int query_fsck(MYSQL *mysql)
+{
+    long long end;
 
-    }
+    /*
+     query_fsck by florian wiessner (f.wiessner@smart-weblications.de)
+    */
+    printf("Starting fsck\n");
 
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-       return -EIO;
-    }
-    mysql_free_result(myresult);
+    // 1. delete inodes with deleted==1
+    printf("Stage 1...\n");
+    if (run_query(mysql, "DELETE FROM inodes WHERE deleted = 1") < 0)
+        return -EIO;
 
-/*    printf("optimizing tables\n");
-    snprintf(sql, SQL_MAX,
-             "OPTIMIZE TABLE inodes;");
+    // 2. set inuse=0 for all inodes
+    printf("Stage 2...\n");
+    if (run_query(mysql, "UPDATE inodes SET inuse=0 WHERE inuse<>0") < 0)
+        return -EIO;
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    // 3. delete direntries without corresponding inode
+    printf("Stage 3...\n");
+    if (run_query(mysql,
+                  "DELETE tree FROM tree LEFT JOIN inodes ON inodes.inode = tree.inode "
+                  "WHERE inodes.inode IS NULL") < 0)
+        return -EIO;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    // 4. everything that is also checked online, in one range
+    printf("Stage 4...\n");
+    end = query_fsck_end(mysql);
+    if (end < 0 || query_fsck_range(mysql, 0, end) < 0)
         return -EIO;
+
+    // 5. count the references to shared blocks again, dropping unused ones
+    if (data_dedup) {
+        printf("Stage 5...\n");
+        if (run_query(mysql,
+                      "UPDATE block_store LEFT JOIN (SELECT hash, COUNT(*) AS n FROM data_blocks "
+                      "WHERE hash IS NOT NULL GROUP BY hash) AS d ON block_store.hash = d.hash "
+                      "SET block_store.refs = IFNULL(d.n, 0)") < 0 ||
+            run_query(mysql, "DELETE FROM block_store WHERE refs <= 0") < 0)
+            return -EIO;
     }
-*/
-    printf("fsck done!\n");
-    return ret;
 
+    printf("fsck done!\n");
+    return 0;
 }
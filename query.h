@@ -25,16 +25,23 @@ struct data_blocks_info {
     off_t		offset_first;	/**< Offset in 1st block.  */
 };
 
+/** Called by query_readdir() for each directory entry; return non-zero to stop */
+typedef int (*query_readdir_filler)(void *ctx, const char *name, const struct stat *stbuf);
+
 long query_inode(MYSQL *mysql, const char* path);
 int query_inode_full(MYSQL *mysql, const char* path, char *name, size_t name_len,
 		     long *inode, long *parent, long *nlinks);
-int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf);
+int query_lookup(MYSQL *mysql, long parent, const char *name, long *inode);
+int query_getattr(MYSQL *mysql, long inode, struct stat *stbuf);
 int query_mkdirentry(MYSQL *mysql, long inode, const char *name, long parent);
 int query_rmdirentry(MYSQL *mysql, const char *name, long inode, long parent);
-long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
-                long parent, int alloc_data);
-long query_mkdir(MYSQL *mysql, const char* path, mode_t mode, long parent);
-int query_readdir(MYSQL *mysql, long inode, void *buf, fuse_fill_dir_t filler, int flag);
+int query_unlink(MYSQL *mysql, long parent, const char *name);
+long query_mknod(MYSQL *mysql, const char *name, mode_t mode, dev_t rdev,
+                long parent, int alloc_data, uid_t uid, gid_t gid, int inuse);
+long query_mkdir(MYSQL *mysql, const char* name, mode_t mode, long parent,
+                 uid_t uid, gid_t gid);
+int query_readdir(MYSQL *mysql, long inode, const char *after, unsigned long skip,
+                  unsigned int limit, query_readdir_filler filler, void *ctx);
 int query_read(MYSQL *mysql, long inode, const char* buf, size_t size, off_t offset);
 int query_write(MYSQL *mysql, long inode, const char* buf, size_t size, off_t offset);
 int query_truncate(MYSQL *mysql, long inode, off_t length);
@@ -42,7 +49,8 @@ int query_truncate(MYSQL *mysql, long inode, off_t length);
 int query_symlink(MYSQL *mysql, const char* from, const char* to);	/**< NOT IMPLEMENTED NOR CALLED */
 int query_readlink(MYSQL *mysql, const char* path);			/**< NOT IMPLEMENTED NOR CALLED */
 
-int query_rename(MYSQL *mysql, const char* from, const char* to);
+int query_rename(MYSQL *mysql, long parent_from, const char *name_from,
+                 long parent_to, const char *name_to);
 
 int query_chmod(MYSQL *mysql, long inode, mode_t mode);
 int query_chown(MYSQL *mysql, long inode, uid_t uid, gid_t gid);
@@ -50,9 +58,26 @@ int query_utime(MYSQL *mysql, long inode, const struct timespec tv[2]);
 
 ssize_t query_size(MYSQL *mysql, long inode);
 ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq);
+int query_superblock(MYSQL *mysql);
 
 int query_inuse_inc(MYSQL *mysql, long inode, int increment);
 int query_set_deleted(MYSQL *mysql, long inode);
 int query_purge_deleted(MYSQL *mysql, long inode);
+int query_release(MYSQL *mysql, long inode);
+
+/** Called by query_gc_list() for each row of gc_queue; return non-zero to stop */
+typedef int (*query_gc_filler)(void *ctx, long inode, long long seq);
+
+int query_drop_data(MYSQL *mysql, long inode, long long from, long long to,
+                    unsigned int chunk, long long *next);
+int query_gc_queue(MYSQL *mysql, long inode, long long from);
+int query_gc_advance(MYSQL *mysql, long inode, long long seq, long long next);
+int query_gc_list(MYSQL *mysql, int live, long inode, unsigned int limit,
+                  query_gc_filler filler, void *ctx);
+int query_lock(MYSQL *mysql, const char *name, int take, unsigned int wait);
 
+long long query_fsck_end(MYSQL *mysql);
+int query_fsck_state(MYSQL *mysql, long long *next, long long *end);
+int query_fsck_save(MYSQL *mysql, long long next, long long end);
+int query_fsck_range(MYSQL *mysql, long long lo, long long hi);
 int query_fsck(MYSQL *mysql);
@@ -0,0 +1,313 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "cache.h"
+#include "rahead.h"
+#include "log.h"
+
+/**
+ * Read-ahead state of one open file.  Reads that pick up where the previous
+ * one ended count as sequential; each one doubles the window (up to
+ * rahead_max_window) and, once less than half a window is left in hand,
+ * starts a background fetch of the next window on a connection of its own.
+ * A read anywhere else shrinks the window back to RAHEAD_MIN_WINDOW.
+ *
+ * Two buffers are used: data holds what the reader is consuming, pf_data
+ * what the background fetch fills.  When the reader gets to the fetched
+ * range the two are swapped.  All state is on a global list so that a write
+ * through any file handle can drop the now stale data (see
+ * rahead_invalidate()).
+ */
+struct rahead {
+    struct rahead	*prev,		/**< previous state on the global list */
+			*next;		/**< next state on the global list */
+    long		inode;		/**< inode the file handle refers to */
+    pthread_mutex_t	lock;		/**< protects everything below but pf_data while pf_busy */
+    pthread_cond_t	cond;		/**< signalled when a background fetch finishes */
+    off_t		next_off;	/**< offset the next sequential read starts at */
+    size_t		window;		/**< current read-ahead window in bytes */
+    char		*data;		/**< data read ahead, ready for the reader */
+    off_t		data_off;	/**< file offset of data */
+    size_t		data_len;	/**< valid bytes in data */
+    char		*pf_data;	/**< buffer the background fetch reads into */
+    off_t		pf_off;		/**< file offset of pf_data */
+    size_t		pf_len;		/**< bytes requested or, once done, valid in pf_data */
+    int			pf_busy;	/**< a background fetch is running */
+    int			pf_stale;	/**< drop the result of the running fetch */
+};
+
+static struct rahead *rahead_list = NULL;
+static pthread_mutex_t rahead_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t rahead_max_window = 0;
+
+/** Thread body of a background fetch: read [pf_off, pf_off + pf_len) on a pooled connection. */
+static void *rahead_worker(void *arg)
+{
+    struct rahead *ra = arg;
+    MYSQL *mysql;
+    int ret = -EAGAIN;
+
+    /* Not pool_get(): the reader may hold the last connection while it waits for us */
+    mysql = pool_tryget();
+    if (mysql) {
+	ret = query_read(mysql, ra->inode, ra->pf_data, ra->pf_len, ra->pf_off);
+	pool_put(mysql);
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    log_printf(LOG_D_OTHER, "%s(): inode %ld: %zu@%lld => %d%s\n", __func__,
+	       ra->inode, ra->pf_len, (long long)ra->pf_off, ret,
+	       ra->pf_stale ? " (stale)" : "");
+    ra->pf_len = (ret < 0 || ra->pf_stale) ? 0 : ret;
+    ra->pf_busy = 0;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+/**
+ * Start fetching len bytes at offset in the background.  The fetch is
+ * clamped to the file size if the attribute cache knows it, so the end of
+ * a file does not cost a window full of zeroes.  Caller holds ra->lock.
+ */
+static void rahead_start(struct rahead *ra, off_t offset, size_t len)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct stat st;
+
+    if (acache_lookup(ra->inode, &st)) {
+	if (offset >= st.st_size)
+	    return;
+	len = MIN(len, (size_t)(st.st_size - offset));
+    }
+
+    if (!ra->pf_data) {
+	ra->data = malloc(rahead_max_window);
+	ra->pf_data = malloc(rahead_max_window);
+	if (!ra->data || !ra->pf_data) {
+	    free(ra->data);
+	    free(ra->pf_data);
+	    ra->data = ra->pf_data = NULL;
+	    return;
+	}
+    }
+
+    ra->pf_off = offset;
+    ra->pf_len = len;
+    ra->pf_busy = 1;
+    ra->pf_stale = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, rahead_worker, ra)) {
+	log_printf(LOG_ERROR, "%s(): pthread_create() failed\n", __func__);
+	ra->pf_busy = 0;
+	ra->pf_len = 0;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * Set the largest read-ahead window.  Each open file may hold up to twice
+ * this much: the window being consumed and the one being fetched.
+ *
+ * @param max_window largest window in bytes; 0 disables read-ahead
+ */
+void rahead_init(size_t max_window)
+{
+    rahead_max_window = max_window ? MAX(max_window, RAHEAD_MIN_WINDOW) : 0;
+}
+
+struct rahead *rahead_new(long inode)
+{
+    struct rahead *ra;
+
+    if (!rahead_max_window)
+	return NULL;
+
+    ra = calloc(1, sizeof(struct rahead));
+    if (!ra)
+	return NULL;
+    ra->inode = inode;
+    ra->window = RAHEAD_MIN_WINDOW;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    pthread_mutex_lock(&rahead_list_mutex);
+    ra->next = rahead_list;
+    if (rahead_list)
+	rahead_list->prev = ra;
+    rahead_list = ra;
+    pthread_mutex_unlock(&rahead_list_mutex);
+
+    return ra;
+}
+
+void rahead_free(struct rahead *ra)
+{
+    if (!ra)
+	return;
+
+    pthread_mutex_lock(&rahead_list_mutex);
+    if (ra->prev)
+	ra->prev->next = ra->next;
+    else
+	rahead_list = ra->next;
+    if (ra->next)
+	ra->next->prev = ra->prev;
+    pthread_mutex_unlock(&rahead_list_mutex);
+
+    pthread_mutex_lock(&ra->lock);
+    while (ra->pf_busy)
+	pthread_cond_wait(&ra->cond, &ra->lock);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra->data);
+    free(ra->pf_data);
+    free(ra);
+}
+
+/**
+ * Read from a file through its read-ahead state.  The request is served
+ * from data read ahead as far as possible, waiting for a background fetch
+ * that covers it, and whatever is left is read with query_read() on the
+ * caller's connection.  Afterwards, if the access was sequential and the
+ * data in hand runs short, the next window is fetched in the background.
+ *
+ * @return < 0 error of query_read()
+ * @return >= 0 number of bytes read
+ * @param ra read-ahead state of the file handle
+ * @param mysql handle to connection to the database
+ * @param buf buffer to read into
+ * @param size number of bytes to read
+ * @param offset offset within the file to read from
+ */
+int rahead_read(struct rahead *ra, MYSQL *mysql, char *buf, size_t size,
+		off_t offset)
+{
+    size_t done = 0, len, ahead;
+    off_t off;
+    int sequential, ret;
+    char *tmp;
+
+    pthread_mutex_lock(&ra->lock);
+
+    sequential = (offset == ra->next_off);
+    if (sequential) {
+	ra->window = MIN(ra->window * 2, rahead_max_window);
+    } else {
+	ra->window = RAHEAD_MIN_WINDOW;
+	ra->data_len = 0;
+	if (ra->pf_busy)
+	    ra->pf_stale = 1;
+	else
+	    ra->pf_len = 0;
+    }
+
+    while (done < size) {
+	off = offset + done;
+	if (off >= ra->data_off && off < ra->data_off + (off_t)ra->data_len) {
+	    len = MIN(size - done, ra->data_off + ra->data_len - off);
+	    memcpy(buf + done, ra->data + (off - ra->data_off), len);
+	    done += len;
+	    continue;
+	}
+
+	if (off < ra->pf_off || off >= ra->pf_off + (off_t)ra->pf_len)
+	    break;
+	while (ra->pf_busy)
+	    pthread_cond_wait(&ra->cond, &ra->lock);
+	if (off >= ra->pf_off + (off_t)ra->pf_len)
+	    break;		/* short or failed fetch */
+
+	tmp = ra->data;
+	ra->data = ra->pf_data;
+	ra->data_off = ra->pf_off;
+	ra->data_len = ra->pf_len;
+	ra->pf_data = tmp;
+	ra->pf_len = 0;
+    }
+
+    if (done < size) {
+	ret = query_read(mysql, ra->inode, buf + done, size - done, offset + done);
+	if (ret < 0) {
+	    pthread_mutex_unlock(&ra->lock);
+	    return ret;
+	}
+	done += ret;
+    }
+    ra->next_off = offset + done;
+
+    if (sequential && done == size && !ra->pf_busy) {
+	off = ra->next_off;
+	if (off >= ra->data_off && off < ra->data_off + (off_t)ra->data_len)
+	    off = ra->data_off + ra->data_len;
+	ahead = off - ra->next_off;
+	if (ahead < ra->window / 2)
+	    rahead_start(ra, off, ra->window);
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+
+    return done;
+}
+
+/**
+ * Drop what every open file of an inode has read ahead, and the result of
+ * any fetch still running.  Called before an inode's data is changed.
+ *
+ * @param inode inode that is about to be written or truncated
+ */
+void rahead_invalidate(long inode)
+{
+    struct rahead *ra;
+
+    if (!rahead_max_window)
+	return;
+
+    pthread_mutex_lock(&rahead_list_mutex);
+    for (ra = rahead_list; ra; ra = ra->next) {
+	if (ra->inode != inode)
+	    continue;
+	pthread_mutex_lock(&ra->lock);
+	ra->data_len = 0;
+	if (ra->pf_busy)
+	    ra->pf_stale = 1;
+	else
+	    ra->pf_len = 0;
+	pthread_mutex_unlock(&ra->lock);
+    }
+    pthread_mutex_unlock(&rahead_list_mutex);
+}
@@ -0,0 +1,30 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** smallest read-ahead window, and the one a file handle starts with; matches the kernel's default max_read */
+#define RAHEAD_MIN_WINDOW	(128 * 1024)
+
+/** Read-ahead state of one open file; see rahead.c */
+struct rahead;
+
+/** Set the largest read-ahead window; 0 disables read-ahead */
+void rahead_init(size_t max_window);
+
+/** Allocate the read-ahead state for a newly opened file, or NULL if read-ahead is disabled */
+struct rahead *rahead_new(long inode);
+
+/** Wait for any read-ahead in progress and release the state */
+void rahead_free(struct rahead *ra);
+
+/** Read through the read-ahead window, starting the next read-ahead if the access is sequential */
+int rahead_read(struct rahead *ra, MYSQL *mysql, char *buf, size_t size, off_t offset);
+
+/** Drop the read-ahead data of every open file of an inode, e.g. because it was written to */
+void rahead_invalidate(long inode);
@@ -0,0 +1,407 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file
+ *
+ * mysqlfs_reblock: change the block size of an existing mysqlfs database.
+ *
+ * The data of all files is copied, in file order, into a new table cut into blocks of the new
+ * size, which then takes the place of data_blocks; the superblock table is updated to match.
+ * Holes stay holes: a new block that no old block overlaps is not stored.  The filesystem must
+ * not be mounted while this runs, or writes made in the meantime are lost.  Filesystems with
+ * dedup on are refused, as their blocks are shared through block_store.  Compressed blocks are
+ * decompressed and stored uncompressed.  Files kept inline stay as they are, so the new block
+ * size must not be smaller than inline_size.  Filesystems with extent_size set have no blocks,
+ * and are refused too, as are those with data still queued in gc_queue: its positions are in
+ * blocks of the old size.  The tool needs the
+ * CREATE, ALTER and DROP privileges on the database besides those mysqlfs itself needs.
+ *
+ * usage: mysqlfs_reblock [-h host] [-u user] [-p password] [-D database] [-P port] [-S socket]
+ *                        [-k] block-size
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#include <mysql/mysqld_error.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#include <mysqld_error.h>
+#endif
+
+#include "mysqlfs.h"
+#include "codec.h"
+
+/** send the pending INSERT once it is this long; stays well below the default max_allowed_packet */
+#define REBLOCK_BATCH_BYTES (2 * 1024 * 1024)
+
+/** The new block being assembled, and the INSERT it goes out with. */
+struct reblock {
+    MYSQL		*mysql;		/**< connection the new blocks are written on */
+    size_t		block_size;	/**< new block size */
+    long long		inode;		/**< inode of the block being assembled; -1 if none */
+    unsigned long	seq;		/**< its sequence number */
+    char		*block;		/**< its contents, block_size bytes */
+    size_t		len;		/**< one past the last byte of block written so far */
+    char		*sql;		/**< pending multi-row INSERT */
+    size_t		sql_len,	/**< bytes used in sql */
+			sql_max;	/**< bytes allocated for sql */
+    unsigned long long	blocks;		/**< new blocks written in all */
+};
+
+/** Run one statement on conn, reporting an error */
+static int run(MYSQL *mysql, const char *sql)
+{
+    if (mysql_query(mysql, sql)) {
+        fprintf(stderr, "%.160s: %s\n", sql, mysql_error(mysql));
+        return -1;
+    }
+    return 0;
+}
+
+/** Send the pending INSERT, if any */
+static int reblock_flush_sql(struct reblock *rb)
+{
+    int ret;
+
+    if (rb->sql_len == 0)
+        return 0;
+
+    ret = mysql_real_query(rb->mysql, rb->sql, rb->sql_len);
+    if (ret)
+        fprintf(stderr, "INSERT INTO data_blocks_new: %s\n", mysql_error(rb->mysql));
+    rb->sql_len = 0;
+
+    return ret ? -1 : 0;
+}
+
+/** Add the block being assembled to the pending INSERT, sending that if it is full */
+static int reblock_flush_block(struct reblock *rb)
+{
+    if (rb->inode < 0)
+        return 0;
+
+    if (rb->sql_len == 0)
+        rb->sql_len = snprintf(rb->sql, rb->sql_max,
+                               "INSERT INTO data_blocks_new (inode, seq, data) VALUES ");
+    else
+        rb->sql[rb->sql_len++] = ',';
+    rb->sql_len += snprintf(rb->sql + rb->sql_len, rb->sql_max - rb->sql_len,
+                            "(%lld, %lu, _binary'", rb->inode, rb->seq);
+    rb->sql_len += mysql_real_escape_string(rb->mysql, rb->sql + rb->sql_len,
+                                            rb->block, rb->len);
+    rb->sql[rb->sql_len++] = '\'';
+    rb->sql[rb->sql_len++] = ')';
+    rb->blocks++;
+    rb->inode = -1;
+
+    if (rb->sql_len >= REBLOCK_BATCH_BYTES)
+        return reblock_flush_sql(rb);
+    return 0;
+}
+
+/**
+ * Cut one old block into the new blocks it overlaps.  Old blocks arrive
+ * sorted by inode and seq, so each new block is complete once a byte of a
+ * later one turns up.
+ */
+static int reblock_add(struct reblock *rb, long long inode, unsigned long long offset,
+                       const char *data, size_t size)
+{
+    size_t done = 0, in, len;
+    unsigned long seq;
+
+    while (done < size) {
+        seq = (offset + done) / rb->block_size;
+        in = (offset + done) % rb->block_size;
+        len = MIN(size - done, rb->block_size - in);
+
+        if (rb->inode != inode || rb->seq != seq) {
+            if (reblock_flush_block(rb) < 0)
+                return -1;
+            rb->inode = inode;
+            rb->seq = seq;
+            rb->len = 0;
+            memset(rb->block, 0, rb->block_size);
+        }
+        memcpy(rb->block + in, data + done, len);
+        rb->len = MAX(rb->len, in + len);
+        done += len;
+    }
+
+    return 0;
+}
+
+/** Read the block size from the superblock table; 0 on error */
+static size_t get_block_size(MYSQL *mysql)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    size_t value = DATA_BLOCK_SIZE;
+
+    if (mysql_query(mysql, "SELECT value FROM superblock WHERE name='block_size'")) {
+        if (mysql_errno(mysql) != ER_NO_SUCH_TABLE) {
+            fprintf(stderr, "superblock: %s\n", mysql_error(mysql));
+            return 0;
+        }
+        if (run(mysql, "CREATE TABLE superblock (name varchar(64) NOT NULL, "
+                "value bigint(20) NOT NULL, PRIMARY KEY (name)) DEFAULT CHARSET=binary"))
+            return 0;
+        return value;
+    }
+
+    if ((result = mysql_store_result(mysql)) == NULL) {
+        fprintf(stderr, "superblock: %s\n", mysql_error(mysql));
+        return 0;
+    }
+    if ((row = mysql_fetch_row(result)) != NULL && row[0])
+        value = strtoul(row[0], NULL, 10);
+    mysql_free_result(result);
+
+    return value;
+}
+
+/** A setting from the superblock table, such as dedup; 0 if it is not there, -1 on error */
+static long get_setting(MYSQL *mysql, const char *name)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    char sql[128];
+    long value = 0;
+
+    snprintf(sql, sizeof(sql), "SELECT value FROM superblock WHERE name='%s'", name);
+    if (run(mysql, sql))
+        return -1;
+    if ((result = mysql_store_result(mysql)) == NULL) {
+        fprintf(stderr, "superblock: %s\n", mysql_error(mysql));
+        return -1;
+    }
+    if ((row = mysql_fetch_row(result)) != NULL && row[0])
+        value = atol(row[0]);
+    mysql_free_result(result);
+
+    return value;
+}
+
+/** Rows in a table that may not exist, such as gc_queue; 0 if it does not, -1 on error */
+static long count_rows(MYSQL *mysql, const char *table)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    char sql[128];
+    long value = 0;
+
+    snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM %s", table);
+    if (mysql_query(mysql, sql)) {
+        if (mysql_errno(mysql) == ER_NO_SUCH_TABLE)
+            return 0;
+        fprintf(stderr, "%s: %s\n", table, mysql_error(mysql));
+        return -1;
+    }
+    if ((result = mysql_store_result(mysql)) == NULL) {
+        fprintf(stderr, "%s: %s\n", table, mysql_error(mysql));
+        return -1;
+    }
+    if ((row = mysql_fetch_row(result)) != NULL && row[0])
+        value = atol(row[0]);
+    mysql_free_result(result);
+
+    return value;
+}
+
+static MYSQL *connect_db(const char *host, const char *user, const char *passwd,
+                         const char *db, unsigned int port, const char *socket)
+{
+    MYSQL *mysql = mysql_init(NULL);
+
+    if (!mysql)
+        return NULL;
+    mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, "mysqlfs");
+    if (!mysql_real_connect(mysql, host, user, passwd, db, port, socket, 0)) {
+        fprintf(stderr, "mysql_real_connect(): %s\n", mysql_error(mysql));
+        mysql_close(mysql);
+        return NULL;
+    }
+    return mysql;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: mysqlfs_reblock [-h host] [-u user] [-p password] [-D database] "
+            "[-P port] [-S socket] [-k] block-size\n\n"
+            "Change the block size of a mysqlfs database to block-size bytes "
+            "(%d to %d).\nThe filesystem must not be mounted.  "
+            "-k keeps the old data as table data_blocks_old.\n",
+            DATA_BLOCK_SIZE, DATA_BLOCK_SIZE_MAX);
+}
+
+/** Copy data_blocks into data_blocks_new, re-blocked, then swap the two and update the superblock. */
+int main(int argc, char *argv[])
+{
+    const char *host = NULL, *user = NULL, *passwd = NULL, *db = NULL, *socket = NULL;
+    unsigned int port = 0;
+    int c, keep = 0;
+    MYSQL *in, *out;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    unsigned long *lengths;
+    unsigned long long rows = 0;
+    struct reblock rb;
+    size_t old_size;
+    char sql[256], *raw;
+    long raw_len, value;
+
+    while ((c = getopt(argc, argv, "h:u:p:D:P:S:k")) != -1) {
+        switch (c) {
+        case 'h': host = optarg; break;
+        case 'u': user = optarg; break;
+        case 'p': passwd = optarg; break;
+        case 'D': db = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'S': socket = optarg; break;
+        case 'k': keep = 1; break;
+        default: usage(); return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    memset(&rb, 0, sizeof(rb));
+    rb.inode = -1;
+    rb.block_size = strtoul(argv[optind], NULL, 10);
+    if (rb.block_size < DATA_BLOCK_SIZE || rb.block_size > DATA_BLOCK_SIZE_MAX) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    /* One connection streams the old blocks, the other writes the new ones */
+    if ((in = connect_db(host, user, passwd, db, port, socket)) == NULL ||
+        (out = connect_db(host, user, passwd, db, port, socket)) == NULL)
+        return EXIT_FAILURE;
+    rb.mysql = out;
+
+    if ((old_size = get_block_size(out)) == 0)
+        return EXIT_FAILURE;
+    if (old_size == rb.block_size) {
+        printf("block size is %zu already\n", old_size);
+        return EXIT_SUCCESS;
+    }
+    if ((value = get_setting(out, "dedup")) != 0) {
+        if (value > 0)
+            fprintf(stderr, "blocks are deduplicated; re-blocking them is not supported\n");
+        return EXIT_FAILURE;
+    }
+    if ((value = get_setting(out, "extent_size")) != 0) {
+        if (value > 0)
+            fprintf(stderr, "file data is kept in extents, not blocks; nothing to re-block\n");
+        return EXIT_FAILURE;
+    }
+    /* The collector of a mount drops these; the rows past them are not file data */
+    if ((value = count_rows(out, "gc_queue")) != 0) {
+        if (value > 0)
+            fprintf(stderr, "%ld files still have data queued for the collector; "
+                    "mount the filesystem until gc_queue is empty\n", value);
+        return EXIT_FAILURE;
+    }
+    if ((value = get_setting(out, "inline_size")) < 0)
+        return EXIT_FAILURE;
+    if ((size_t)value > rb.block_size) {
+        fprintf(stderr, "files of up to %ld bytes are kept inline; "
+                "the block size cannot be smaller\n", value);
+        return EXIT_FAILURE;
+    }
+
+    if (run(out, "DROP TABLE IF EXISTS data_blocks_new") ||
+        run(out, "CREATE TABLE data_blocks_new LIKE data_blocks") ||
+        run(out, "ALTER TABLE data_blocks_new MODIFY data MEDIUMBLOB"))
+        return EXIT_FAILURE;
+
+    rb.block = malloc(rb.block_size);
+    raw = malloc(old_size);
+    /* Room for one more block, escaped, past the flush threshold */
+    rb.sql_max = REBLOCK_BATCH_BYTES + 2 * rb.block_size + 256;
+    rb.sql = malloc(rb.sql_max);
+    if (!rb.block || !rb.sql || !raw) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Rows have a codec only if data_blocks has the column */
+    if (mysql_query(in, "SELECT inode, seq, data, codec FROM data_blocks ORDER BY inode, seq") &&
+        (mysql_errno(in) != ER_BAD_FIELD_ERROR ||
+         run(in, "SELECT inode, seq, data, 0 FROM data_blocks ORDER BY inode, seq"))) {
+        fprintf(stderr, "data_blocks: %s\n", mysql_error(in));
+        return EXIT_FAILURE;
+    }
+    if ((result = mysql_use_result(in)) == NULL) {
+        fprintf(stderr, "data_blocks: %s\n", mysql_error(in));
+        return EXIT_FAILURE;
+    }
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        lengths = mysql_fetch_lengths(result);
+        rows++;
+        if (!row[2])
+            continue;
+        raw_len = codec_decompress(atoi(row[3]), row[2], lengths[2], raw, old_size);
+        if (raw_len < 0) {
+            fprintf(stderr, "inode %s block %s: cannot decompress %s data\n",
+                    row[0], row[1], codec_name(atoi(row[3])));
+            mysql_free_result(result);
+            return EXIT_FAILURE;
+        }
+        if (reblock_add(&rb, atoll(row[0]), strtoull(row[1], NULL, 10) * old_size,
+                        raw, raw_len) < 0) {
+            mysql_free_result(result);
+            return EXIT_FAILURE;
+        }
+    }
+    if (mysql_errno(in)) {
+        fprintf(stderr, "data_blocks: %s\n", mysql_error(in));
+        mysql_free_result(result);
+        return EXIT_FAILURE;
+    }
+    mysql_free_result(result);
+    if (reblock_flush_block(&rb) < 0 || reblock_flush_sql(&rb) < 0)
+        return EXIT_FAILURE;
+
+    if (run(out, "DROP TABLE IF EXISTS data_blocks_old") ||
+        run(out, "RENAME TABLE data_blocks TO data_blocks_old, data_blocks_new TO data_blocks"))
+        return EXIT_FAILURE;
+    snprintf(sql, sizeof(sql),
+             "INSERT INTO superblock (name, value) VALUES ('block_size', %zu) "
+             "ON DUPLICATE KEY UPDATE value=VALUES(value)", rb.block_size);
+    if (run(out, sql)) {
+        fprintf(stderr, "data_blocks now has %zu-byte blocks, but the superblock still says %zu;\n"
+                "set it by hand before mounting, or rename data_blocks_old back\n",
+                rb.block_size, old_size);
+        return EXIT_FAILURE;
+    }
+    if (!keep)
+        run(out, "DROP TABLE data_blocks_old");
+
+    printf("%llu blocks of %zu bytes re-cut into %llu blocks of %zu bytes\n",
+           rows, old_size, rb.blocks, rb.block_size);
+
+    free(rb.block);
+    free(rb.sql);
+    free(raw);
+    mysql_close(in);
+    mysql_close(out);
+    return EXIT_SUCCESS;
+}
@@ -23,10 +23,69 @@ DROP TABLE IF EXISTS `data_blocks`;
 CREATE TABLE `data_blocks` (
   `inode` bigint(20) NOT NULL,
   `seq` int unsigned not null,
-  `data` blob ,
+  `data` mediumblob ,
+  `codec` tinyint NOT NULL default '0',
+  `hash` binary(32) default NULL,
   PRIMARY KEY  (`inode`, `seq`)
 )  DEFAULT CHARSET=binary;
 
+--
+-- Table structure for table `block_store`
+--
+
+DROP TABLE IF EXISTS `block_store`;
+CREATE TABLE `block_store` (
+  `hash` binary(32) NOT NULL,
+  `refs` bigint(20) NOT NULL default '0',
+  `data` mediumblob ,
+  PRIMARY KEY  (`hash`),
+  KEY `refs` (`refs`)
+)  DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `data_extents`
+--
+
+DROP TABLE IF EXISTS `data_extents`;
+CREATE TABLE `data_extents` (
+  `inode` bigint(20) NOT NULL,
+  `pos` bigint(20) NOT NULL,
+  `data` mediumblob ,
+  PRIMARY KEY  (`inode`, `pos`)
+)  DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `superblock`
+--
+
+DROP TABLE IF EXISTS `superblock`;
+CREATE TABLE `superblock` (
+  `name` varchar(64) NOT NULL,
+  `value` bigint(20) NOT NULL,
+  PRIMARY KEY  (`name`)
+) DEFAULT CHARSET=binary;
+
+-- Block size of the filesystem, 4096 to 1048576 bytes.  Choose it here,
+-- before the first mount; mysqlfs_reblock changes it later.
+INSERT INTO `superblock` VALUES ('block_size', 4096);
+
+-- Largest extent, 4096 to 8388608 bytes, to store file data in data_extents
+-- (variable-length byte ranges) instead of data_blocks (one row per block);
+-- 0 keeps data_blocks.  Choose it here, before the first mount.
+INSERT INTO `superblock` VALUES ('extent_size', 0);
+
+-- 1 to store each distinct data block once, in block_store, keyed by its
+-- SHA-256; data_blocks rows then hold only the hash.  Needs extent_size 0.
+-- Can be switched on later: blocks already written stay as they are.
+INSERT INTO `superblock` VALUES ('dedup', 0);
+
+-- Largest file, up to the block size, kept in the inline_data column of its
+-- inodes row instead of in data_blocks; a file moves to data_blocks once it
+-- grows larger.  0 keeps all files in data_blocks.  Needs extent_size 0
+-- and dedup 0.  Can be switched on later, for files created from then on,
+-- but not off again.
+INSERT INTO `superblock` VALUES ('inline_size', 0);
+
 --
 -- Table structure for table `inodes`
 --
@@ -43,6 +102,7 @@ CREATE TABLE `inodes` (
   `mtime` int(10) unsigned NOT NULL default '0',
   `ctime` int(10) unsigned NOT NULL default '0',
   `size` bigint(20) NOT NULL default '0',
+  `inline_data` mediumblob default NULL,
   PRIMARY KEY  (`inode`),
   KEY `inode` (`inode`,`inuse`,`deleted`)
 ) DEFAULT CHARSET=binary;
@@ -50,7 +110,7 @@ CREATE TABLE `inodes` (
 /*!50003 SET @OLD_SQL_MODE=@@SQL_MODE*/;
 DELIMITER ;;
 /*!50003 SET SESSION SQL_MODE="" */;;
-/*!50003 CREATE */ /*!50017 DEFINER=`root`@`localhost` */ /*!50003 TRIGGER `drop_data` AFTER DELETE ON `inodes` FOR EACH ROW BEGIN DELETE FROM data_blocks WHERE inode=OLD.inode; END */;;
+/*!50003 CREATE */ /*!50017 DEFINER=`root`@`localhost` */ /*!50003 TRIGGER `drop_data` AFTER DELETE ON `inodes` FOR EACH ROW BEGIN INSERT INTO gc_queue (inode, seq) VALUES (OLD.inode, 0) ON DUPLICATE KEY UPDATE seq=0; END */;;
 
 DELIMITER ;
 /*!50003 SET SESSION SQL_MODE=@OLD_SQL_MODE */;
@@ -66,8 +126,51 @@ CREATE TABLE `tree` (
   `name` varchar(255) NOT NULL,
   UNIQUE KEY `name` (`name`,`parent`),
   KEY `inode` (`inode`),
-  KEY `parent` (`parent`)
+  KEY `parent` (`parent`,`name`)
 ) DEFAULT CHARSET=utf8;
+
+--
+-- Table structure for table `inode_seq`
+--
+
+DROP TABLE IF EXISTS `inode_seq`;
+CREATE TABLE `inode_seq` (
+  `name` varchar(64) NOT NULL,
+  `value` bigint(20) NOT NULL,
+  PRIMARY KEY  (`name`)
+) DEFAULT CHARSET=binary;
+
+-- Next inode number not yet handed out.  Each mount reserves a range of
+-- numbers at a time from here instead of numbering by tree's AUTO_INCREMENT.
+INSERT INTO `inode_seq` VALUES ('inode', 1);
+
+--
+-- Table structure for table `gc_queue`
+--
+
+-- Data left for the collector of a mount to drop, a chunk at a time: that
+-- of each deleted inode, queued by the drop_data trigger, and that past the
+-- end of each truncated file.  seq is the first block, or byte offset with
+-- extents, still to drop.
+DROP TABLE IF EXISTS `gc_queue`;
+CREATE TABLE `gc_queue` (
+  `inode` bigint(20) NOT NULL,
+  `seq` bigint(20) NOT NULL,
+  PRIMARY KEY  (`inode`)
+) DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `fsck_state`
+--
+
+-- Progress of the online fsck (-ofsck), for the next mount to resume: the
+-- inodes below next are checked, up to end.  Empty between passes.
+DROP TABLE IF EXISTS `fsck_state`;
+CREATE TABLE `fsck_state` (
+  `name` varchar(64) NOT NULL,
+  `value` bigint(20) NOT NULL,
+  PRIMARY KEY  (`name`)
+) DEFAULT CHARSET=binary;
 /*!40103 SET TIME_ZONE=@OLD_TIME_ZONE */;
 
 /*!40101 SET SQL_MODE=@OLD_SQL_MODE */;
@@ -78,3 +181,68 @@ CREATE TABLE `tree` (
 /*!40101 SET COLLATION_CONNECTION=@OLD_COLLATION_CONNECTION */;
 /*!40111 SET SQL_NOTES=@OLD_SQL_NOTES */;
 
+
+--
+-- Stored procedures, which do the compound metadata operations in one
+-- CALL each.  mysqlfs uses them while the procedures row of superblock
+-- holds the version it expects, and the statements they replace otherwise.
+-- This section can be loaded on its own into an existing database.
+--
+
+REPLACE INTO `superblock` VALUES ('procedures', 2);
+
+/*!50003 SET @OLD_SQL_MODE=@@SQL_MODE*/;
+DELIMITER ;;
+/*!50003 SET SESSION SQL_MODE="" */;;
+
+-- Remove the name from its directory, unless it is a directory that is not
+-- empty, and the inode with it once no name and no open is left.  Returns
+-- one row: status (0 done, 1 no such name, 2 directory not empty), inode,
+-- and whether the inode was purged.
+DROP PROCEDURE IF EXISTS `mysqlfs_unlink`;;
+CREATE PROCEDURE `mysqlfs_unlink`(IN p_parent bigint, IN p_name varchar(255))
+BEGIN
+  DECLARE v_inode bigint;
+  SET v_inode = (SELECT inode FROM tree WHERE parent=p_parent AND name=p_name);
+  IF v_inode IS NULL THEN
+    SELECT 1, 0, 0;
+  ELSEIF EXISTS (SELECT inode FROM tree WHERE parent=v_inode) THEN
+    SELECT 2, v_inode, 0;
+  ELSE
+    DELETE FROM tree WHERE parent=p_parent AND name=p_name;
+    UPDATE inodes LEFT JOIN tree ON inodes.inode = tree.inode SET inodes.deleted=1
+      WHERE inodes.inode=v_inode AND tree.name IS NULL;
+    DELETE FROM inodes WHERE inode=v_inode AND inuse=0 AND deleted=1;
+    SELECT 0, v_inode, ROW_COUNT();
+  END IF;
+END ;;
+
+-- Create a name in a directory and its inode p_inode, or one numbered by
+-- AUTO_INCREMENT if 0, with inline data if p_inline, counted as opened
+-- p_inuse times.  Returns the new inode.
+DROP PROCEDURE IF EXISTS `mysqlfs_mknod`;;
+CREATE PROCEDURE `mysqlfs_mknod`(IN p_inode bigint, IN p_parent bigint, IN p_name varchar(255),
+                                 IN p_mode int, IN p_uid int unsigned, IN p_gid int unsigned,
+                                 IN p_inline tinyint, IN p_inuse int)
+BEGIN
+  DECLARE v_inode bigint;
+  DECLARE v_now int unsigned DEFAULT UNIX_TIMESTAMP(NOW());
+  INSERT INTO tree (inode, name, parent) VALUES (NULLIF(p_inode, 0), p_name, p_parent);
+  SET v_inode = IF(p_inode, p_inode, LAST_INSERT_ID());
+  INSERT INTO inodes (inode, inuse, mode, uid, gid, atime, ctime, mtime, inline_data)
+    VALUES (v_inode, p_inuse, p_mode, p_uid, p_gid, v_now, v_now, v_now, IF(p_inline, '', NULL));
+  SELECT v_inode;
+END ;;
+
+-- Count a close of the inode, and purge it if that was the last use of a
+-- file already unlinked.  Returns whether it was purged.
+DROP PROCEDURE IF EXISTS `mysqlfs_release`;;
+CREATE PROCEDURE `mysqlfs_release`(IN p_inode bigint)
+BEGIN
+  UPDATE inodes SET inuse = inuse - 1 WHERE inode=p_inode;
+  DELETE FROM inodes WHERE inode=p_inode AND inuse=0 AND deleted=1;
+  SELECT ROW_COUNT();
+END ;;
+
+DELIMITER ;
+/*!50003 SET SESSION SQL_MODE=@OLD_SQL_MODE */;
@@ -0,0 +1,15 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** length of a SHA-256 digest in bytes */
+#define SHA256_SIZE	32
+
+/** Compute the SHA-256 digest of len bytes at data into digest (SHA256_SIZE bytes) */
+void sha256(const void *data, size_t len, unsigned char *digest);
@@ -0,0 +1,187 @@
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../codec.h"
+
+/** @file
+ *
+ * Codec benchmark: compression ratio and throughput of each block codec compiled in.
+ *
+ * Data is cut into blocks and each block compressed and decompressed on its own, the way
+ * query_write() and query_read() do, so the figures are per block, not per stream; a block
+ * that does not shrink counts at full size, as it would be stored uncompressed, and is left out
+ * of the decompression figure.  Without files,
+ * a few generated samples are used: log lines, JSON, random bytes and zeroes.
+ *
+ * usage: bench_codec [block-size [file...]]
+ */
+
+/** one set of data to compress */
+struct sample {
+    const char *name;
+    char *data;
+    size_t len;
+};
+
+static double now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** make one of the generated samples, len bytes */
+static char *generate (const char *kind, size_t len)
+{
+    char *data = malloc (len + 256);
+    size_t pos = 0;
+    unsigned long n = 0;
+
+    if (!data)
+        return NULL;
+    while (pos < len) {
+        if (!strcmp (kind, "log"))
+            pos += sprintf (data + pos, "2009-07-12 22:%02lu:%02lu %5lu INFO: request %lu from 10.0.%lu.%lu served in %d ms\n",
+                            n / 60 % 60, n % 60, 4000 + n % 7, n, n % 13, n % 251, rand () % 400);
+        else if (!strcmp (kind, "json"))
+            pos += sprintf (data + pos, "{\"id\":%lu,\"name\":\"user%lu\",\"active\":%s,\"score\":%d,\"tags\":[\"a\",\"b%lu\"]},\n",
+                            n, n % 1000, n % 3 ? "true" : "false", rand () % 1000, n % 17);
+        else if (!strcmp (kind, "random"))
+            data[pos++] = rand ();
+        else
+            data[pos++] = 0;
+        n++;
+    }
+    return data;
+}
+
+/** read a whole file */
+static char *slurp (const char *path, size_t *len)
+{
+    FILE *f = fopen (path, "rb");
+    char *data = NULL;
+    long size;
+
+    if (!f)
+        return NULL;
+    if (fseek (f, 0, SEEK_END) == 0 && (size = ftell (f)) > 0 &&
+        fseek (f, 0, SEEK_SET) == 0 && (data = malloc (size)) != NULL &&
+        fread (data, 1, size, f) != (size_t) size) {
+        free (data);
+        data = NULL;
+    }
+    *len = data ? (size_t) size : 0;
+    fclose (f);
+    return data;
+}
+
+/** compress and decompress s block by block with codec, and print the figures */
+static int bench (const struct sample *s, int codec, size_t block_size)
+{
+    char *out = malloc (block_size);
+    size_t done, len, stored = 0, unpacked = 0, *zlen;
+    size_t nblocks = (s->len + block_size - 1) / block_size, i;
+    double t0, t1, t2;
+    long n;
+    int ret = 0;
+
+    /* keep the compressed blocks, so decompression is timed on its own */
+    char *packed = malloc (s->len + 1);
+    zlen = calloc (nblocks, sizeof (*zlen));
+    if (!out || !packed || !zlen) {
+        fprintf (stderr, "out of memory\n");
+        return -1;
+    }
+
+    t0 = now ();
+    for (done = 0, i = 0; done < s->len; done += len, i++) {
+        len = s->len - done < block_size ? s->len - done : block_size;
+        zlen[i] = codec_compress (codec, s->data + done, len, packed + done, len);
+        stored += zlen[i] ? zlen[i] : len;
+    }
+    t1 = now ();
+    for (done = 0, i = 0; done < s->len; done += len, i++) {
+        len = s->len - done < block_size ? s->len - done : block_size;
+        if (zlen[i] == 0)
+            continue;
+        unpacked += len;
+        n = codec_decompress (codec, packed + done, zlen[i], out, block_size);
+        if (n != (long) len || memcmp (out, s->data + done, len)) {
+            fprintf (stderr, "%s: %s block %zu does not decompress to what went in\n",
+                     s->name, codec_name (codec), i);
+            ret = -1;
+            break;
+        }
+    }
+    t2 = now ();
+
+    printf ("%-10s %-5s %7zu-byte blocks: ratio %5.2f, compress %8.1f MiB/s, decompress %8.1f MiB/s\n",
+            s->name, codec_name (codec), block_size, (double) s->len / stored,
+            t1 > t0 ? s->len / 1048576.0 / (t1 - t0) : 0.0,
+            t2 > t1 ? unpacked / 1048576.0 / (t2 - t1) : 0.0);
+
+    free (out);
+    free (packed);
+    free (zlen);
+    return ret;
+}
+
+int main (int argc, char *argv[])
+{
+    static const char *kinds[] = { "log", "json", "random", "zeroes" };
+    struct sample samples[64];
+    size_t block_size = 4096, nsamples = 0, i;
+    int codec, ncodecs = 0, ret = EXIT_SUCCESS;
+
+    if (argc > 1)
+        block_size = strtoul (argv[1], NULL, 10);
+    if (block_size == 0) {
+        fprintf (stderr, "usage: %s [block-size [file...]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 2) {
+        for (i = 2; i < (size_t) argc && nsamples < 64; i++) {
+            samples[nsamples].name = argv[i];
+            if ((samples[nsamples].data = slurp (argv[i], &samples[nsamples].len)) == NULL) {
+                fprintf (stderr, "%s: cannot read\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            nsamples++;
+        }
+    } else {
+        srand (1);
+        for (i = 0; i < sizeof (kinds) / sizeof (kinds[0]); i++) {
+            samples[nsamples].name = kinds[i];
+            samples[nsamples].len = 16 * 1024 * 1024;
+            if ((samples[nsamples].data = generate (kinds[i], samples[nsamples].len)) == NULL) {
+                fprintf (stderr, "out of memory\n");
+                return EXIT_FAILURE;
+            }
+            nsamples++;
+        }
+    }
+
+    for (codec = CODEC_NONE + 1; codec < CODEC_MAX; codec++) {
+        if (!codec_available (codec))
+            continue;
+        ncodecs++;
+        for (i = 0; i < nsamples; i++)
+            if (bench (&samples[i], codec, block_size) < 0)
+                ret = EXIT_FAILURE;
+    }
+    if (ncodecs == 0)
+        printf ("no codec compiled in\n");
+
+    for (i = 0; i < nsamples; i++)
+        free (samples[i].data);
+    return ret;
+}
@@ -0,0 +1,144 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "../mysqlfs.h"
+#include "../query.h"
+#include "../pool.h"
+#include "../log.h"
+
+/** @file
+ *
+ * Write benchmark: how many statements (round trips) query_write() needs per MiB written.
+ *
+ * The file is written straight through query_write(), bypassing FUSE and the write-back buffer,
+ * so the numbers show the cost of one write() of the given size with buffering disabled
+ * (-owbuf_size=0).  Statements are counted with the server's per-session "Questions" counter,
+ * so the figure is what the server saw, not what we think we sent.
+ *
+ * usage: bench_write host user password database [MiB [write-size...]]
+ */
+
+/** read the server's count of statements received on this session */
+static unsigned long questions (MYSQL *mysql)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    unsigned long n = 0;
+
+    if (mysql_query (mysql, "SHOW SESSION STATUS LIKE 'Questions'"))
+        return 0;
+    if ((result = mysql_store_result (mysql)) == NULL)
+        return 0;
+    if ((row = mysql_fetch_row (result)) != NULL)
+        n = atol (row[1]);
+    mysql_free_result (result);
+
+    return n;
+}
+
+/** Create a scratch inode (no directory entry), time writes to it, then drop it and its data. */
+int main (int argc, char *argv[])
+{
+    static const size_t default_sizes[] = { 4096, 131072, 1048576 };
+    struct mysqlfs_opt opt;
+    MYSQL *mysql;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    char sql[256], *buf;
+    long inode;
+    unsigned int mib = 8;
+    size_t write_size, i, nsizes;
+    off_t off, total;
+    unsigned long before, after;
+    struct timeval t0, t1;
+    double secs;
+    int ret = EXIT_SUCCESS;
+
+    log_file = stderr;
+
+    if (argc < 5) {
+        fprintf (stderr, "usage: %s host user password database [MiB [write-size...]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 5)
+        mib = atoi (argv[5]);
+    nsizes = argc > 6 ? argc - 6 : sizeof (default_sizes) / sizeof (default_sizes[0]);
+    total = (off_t) mib * 1024 * 1024;
+
+    /* query.c needs a pooled connection: it keeps its prepared statements there */
+    memset (&opt, 0, sizeof (opt));
+    opt.host = argv[1];
+    opt.user = argv[2];
+    opt.passwd = argv[3];
+    opt.db = argv[4];
+    opt.init_conns = 1;
+    opt.max_idling_conns = 1;
+    if (pool_init (&opt) < 0 || (mysql = pool_get ()) == NULL) {
+        fprintf (stderr, "cannot connect to mysql://%s@%s/%s\n", opt.user, opt.host, opt.db);
+        return EXIT_FAILURE;
+    }
+
+    if (mysql_query (mysql, "SELECT IFNULL(MAX(inode), 0) + 1 FROM inodes") ||
+        (result = mysql_store_result (mysql)) == NULL ||
+        (row = mysql_fetch_row (result)) == NULL) {
+        fprintf (stderr, "cannot pick a scratch inode: %s\n", mysql_error (mysql));
+        return EXIT_FAILURE;
+    }
+    inode = atol (row[0]);
+    mysql_free_result (result);
+
+    buf = malloc (1024 * 1024);
+    memset (buf, 'x', 1024 * 1024);
+
+    for (i = 0; i < nsizes; i++) {
+        write_size = argc > 6 ? (size_t) atol (argv[6 + i]) : default_sizes[i];
+        if (write_size == 0 || write_size > 1024 * 1024)
+            continue;
+
+        snprintf (sql, sizeof (sql), "INSERT INTO inodes (inode, mode) VALUES (%ld, %d)", inode, S_IFREG | 0644);
+        if (mysql_query (mysql, sql)) {
+            fprintf (stderr, "%s: %s\n", sql, mysql_error (mysql));
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        before = questions (mysql);
+        gettimeofday (&t0, NULL);
+        for (off = 0; off < total; off += write_size)
+            if (query_write (mysql, inode, buf, write_size, off) < 0) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+        gettimeofday (&t1, NULL);
+        after = questions (mysql) - 1;	/* the SHOW itself */
+
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        printf ("%7zu-byte writes: %6lu statements for %u MiB, %8.1f per MiB, %7.1f MiB/s\n",
+                write_size, after - before, mib, (double) (after - before) / mib,
+                secs > 0 ? mib / secs : 0.0);
+
+        snprintf (sql, sizeof (sql), "DELETE FROM inodes WHERE inode=%ld", inode);
+        mysql_query (mysql, sql);
+        if (ret != EXIT_SUCCESS)
+            break;
+    }
+
+    free (buf);
+    pool_put (mysql);
+    pool_cleanup ();
+    return ret;
+}
@@ -0,0 +1,401 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "wbuf.h"
+#include "log.h"
+
+/**
+ * One dirty data block.  Only the bytes in [lo, hi) are valid; a write that
+ * would leave a hole in that range flushes the block first, so the range is
+ * always contiguous and can be handed to query_write() as is.
+ */
+struct wbuf_block {
+    struct wbuf_block	*next;		/**< block with the next higher seq */
+    unsigned long	seq;		/**< sequence number of the block within the file */
+    size_t		lo,		/**< first dirty byte in data */
+			hi;		/**< one past the last dirty byte in data */
+    char		data[];		/**< block contents, data_block_size bytes */
+};
+
+/**
+ * Write-back buffer of one open file: the dirty blocks sorted by seq.  All
+ * buffers are on a global list so that memory pressure, reads and truncates
+ * can find the dirty data of an inode regardless of the file handle that
+ * wrote it.
+ */
+struct wbuf {
+    struct wbuf		*prev,		/**< previous buffer on the global list */
+			*next;		/**< next buffer on the global list */
+    long		inode;		/**< inode the file handle refers to */
+    pthread_mutex_t	lock;		/**< protects the block list */
+    struct wbuf_block	*head,		/**< dirty block with the lowest seq */
+			*tail;		/**< dirty block with the highest seq */
+    size_t		dirty;		/**< bytes held by the block list */
+    int			error;		/**< first failed flush done for another file, returned by the next wbuf_flush() */
+};
+
+static struct wbuf *wbuf_list = NULL;
+static pthread_mutex_t wbuf_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** bytes held by all buffers; updated atomically so writers need not take wbuf_list_mutex */
+static size_t wbuf_dirty = 0;
+static size_t wbuf_per_file = 0;
+static size_t wbuf_max_dirty = 0;
+
+/**
+ * Write the block list out as a series of query_write() calls, one per run
+ * of contiguous dirty bytes, and empty it.  Data that could not be written
+ * is dropped and the error returned, much like the kernel reports a failed
+ * writeback on the next fsync(); a flush done for another file keeps the
+ * error in wb->error for that (see wbuf_flush_for()).  With no connection
+ * the data is dropped as well, with -EIO.  Caller holds wb->lock.
+ *
+ * @return 0 on success, < 0 result of query_write() on failure
+ */
+static int wbuf_flush_locked(struct wbuf *wb, MYSQL *mysql)
+{
+    struct wbuf_block *run, *blk, *next;
+    char *buf;
+    size_t len;
+    int ret = 0, err;
+
+    run = wb->head;
+    while (run) {
+	/* A run continues while blocks are dirty up to their end and the
+	 * next one is adjacent and dirty from its start. */
+	len = run->hi - run->lo;
+	for (blk = run; blk->hi == data_block_size && blk->next &&
+	     blk->next->seq == blk->seq + 1 && blk->next->lo == 0; blk = blk->next)
+	    len += blk->next->hi;
+
+	if (run == blk) {
+	    buf = run->data + run->lo;
+	} else if (mysql && (buf = malloc(len)) != NULL) {
+	    size_t pos = 0;
+
+	    for (next = run; next != blk->next; next = next->next) {
+		memcpy(buf + pos, next->data + next->lo, next->hi - next->lo);
+		pos += next->hi - next->lo;
+	    }
+	}
+
+	if (!mysql) {
+	    err = -EIO;
+	} else if (!buf) {
+	    err = -ENOMEM;
+	} else {
+	    err = query_write(mysql, wb->inode, buf,
+			      len, run->seq * data_block_size + run->lo);
+	    if (buf != run->data + run->lo)
+		free(buf);
+	}
+	if (err < 0) {
+	    log_printf(LOG_ERROR, "%s(): inode %ld: %zu bytes at seq %lu lost: %d\n",
+		       __func__, wb->inode, len, run->seq, err);
+	    if (!ret)
+		ret = err;
+	}
+
+	next = blk->next;
+	for (blk = run; blk != next; blk = run) {
+	    run = blk->next;
+	    free(blk);
+	    __sync_fetch_and_sub(&wbuf_dirty, data_block_size);
+	    wb->dirty -= data_block_size;
+	}
+    }
+    wb->head = wb->tail = NULL;
+
+    return ret;
+}
+
+/**
+ * Flush the buffer of a file on behalf of another one, keeping an error for
+ * the next wbuf_flush() of its own.  Caller holds wb->lock.
+ *
+ * @return 0 on success, < 0 result of query_write() on failure
+ */
+static int wbuf_flush_for(struct wbuf *wb, MYSQL *mysql)
+{
+    int ret = wbuf_flush_locked(wb, mysql);
+
+    if (ret < 0 && !wb->error)
+	wb->error = ret;
+    return ret;
+}
+
+/**
+ * Flush buffers of other files until the global dirty limit is met again.
+ * Called by a writer before it takes its own buffer's lock; buffers that are
+ * busy are skipped rather than waited for.
+ */
+static void wbuf_relieve_pressure(struct wbuf *self, MYSQL *mysql)
+{
+    struct wbuf *wb;
+
+    pthread_mutex_lock(&wbuf_list_mutex);
+    for (wb = wbuf_list; wb && wbuf_dirty >= wbuf_max_dirty; wb = wb->next) {
+	if (wb == self || !wb->dirty || pthread_mutex_trylock(&wb->lock))
+	    continue;
+	log_printf(LOG_D_OTHER, "%s(): flushing inode %ld, %zu bytes\n",
+		   __func__, wb->inode, wb->dirty);
+	wbuf_flush_for(wb, mysql);
+	pthread_mutex_unlock(&wb->lock);
+    }
+    pthread_mutex_unlock(&wbuf_list_mutex);
+}
+
+/**
+ * Set the limits of the write-back buffers.  Each open file buffers up to
+ * per_file bytes of dirty blocks before it flushes them; once all files
+ * together hold max_dirty bytes, a writer first flushes its own buffer and
+ * then those of other files, so a burst of writers cannot grow memory
+ * without bound.
+ *
+ * @param per_file bytes one open file may buffer; 0 disables buffering
+ * @param max_dirty bytes all open files may buffer together
+ */
+void wbuf_init(size_t per_file, size_t max_dirty)
+{
+    wbuf_per_file = per_file;
+    wbuf_max_dirty = MAX(max_dirty, per_file);
+}
+
+struct wbuf *wbuf_new(long inode)
+{
+    struct wbuf *wb;
+
+    if (!wbuf_per_file)
+	return NULL;
+
+    wb = calloc(1, sizeof(struct wbuf));
+    if (!wb)
+	return NULL;
+    wb->inode = inode;
+    pthread_mutex_init(&wb->lock, NULL);
+
+    pthread_mutex_lock(&wbuf_list_mutex);
+    wb->next = wbuf_list;
+    if (wbuf_list)
+	wbuf_list->prev = wb;
+    wbuf_list = wb;
+    pthread_mutex_unlock(&wbuf_list_mutex);
+
+    return wb;
+}
+
+int wbuf_free(struct wbuf *wb, MYSQL *mysql)
+{
+    int ret;
+
+    if (!wb)
+	return 0;
+
+    ret = wbuf_flush(wb, mysql);
+
+    pthread_mutex_lock(&wbuf_list_mutex);
+    if (wb->prev)
+	wb->prev->next = wb->next;
+    else
+	wbuf_list = wb->next;
+    if (wb->next)
+	wb->next->prev = wb->prev;
+    pthread_mutex_unlock(&wbuf_list_mutex);
+
+    pthread_mutex_destroy(&wb->lock);
+    free(wb);
+
+    return ret;
+}
+
+/**
+ * Buffer a write.  The data is copied into dirty blocks; nothing is sent to
+ * the database unless a block would get a hole in its dirty range (that
+ * block is flushed first), the file's buffer exceeds its limit, or the
+ * global limit is hit.  Writes larger than the per-file limit bypass the
+ * buffer after flushing it, since they are already as large as anything the
+ * buffer would produce.
+ *
+ * @return size on success, < 0 error of the flush that made room
+ * @param wb write-back buffer of the file handle
+ * @param mysql handle to connection to the database
+ * @param buf data to write
+ * @param size number of bytes to write
+ * @param offset offset within the file to write to
+ */
+int wbuf_write(struct wbuf *wb, MYSQL *mysql, const char *buf, size_t size,
+	       off_t offset)
+{
+    struct wbuf_block **pp, *blk, *prev;
+    unsigned long seq;
+    size_t lo, len, done = 0;
+    int ret = 0;
+
+    if (wbuf_dirty + size > wbuf_max_dirty)
+	wbuf_relieve_pressure(wb, mysql);
+
+    pthread_mutex_lock(&wb->lock);
+
+    if (size > wbuf_per_file) {
+	ret = wbuf_flush_locked(wb, mysql);
+	if (ret == 0)
+	    ret = query_write(mysql, wb->inode, buf, size, offset);
+	pthread_mutex_unlock(&wb->lock);
+	return ret;
+    }
+
+    while (done < size) {
+	seq = (offset + done) / data_block_size;
+	lo = (offset + done) % data_block_size;
+	len = MIN(size - done, data_block_size - lo);
+
+	/* Sequential writes append, so try the tail before walking the list. */
+	prev = NULL;
+	if (wb->tail && wb->tail->seq <= seq) {
+	    prev = wb->tail;
+	    pp = &wb->tail->next;
+	} else {
+	    for (pp = &wb->head; *pp && (*pp)->seq < seq; pp = &(*pp)->next)
+		prev = *pp;
+	}
+	if (*pp && (*pp)->seq == seq) {
+	    blk = *pp;
+	} else if (prev && prev->seq == seq) {
+	    blk = prev;
+	} else {
+	    blk = malloc(sizeof(struct wbuf_block) + data_block_size);
+	    if (!blk) {
+		ret = -ENOMEM;
+		break;
+	    }
+	    blk->seq = seq;
+	    blk->lo = lo;
+	    blk->hi = lo;
+	    blk->next = *pp;
+	    *pp = blk;
+	    if (!blk->next)
+		wb->tail = blk;
+	    wb->dirty += data_block_size;
+	    __sync_fetch_and_add(&wbuf_dirty, data_block_size);
+	}
+
+	if (lo > blk->hi || lo + len < blk->lo) {
+	    /* Would leave a hole: write what we have, restart the block. */
+	    ret = query_write(mysql, wb->inode, blk->data + blk->lo,
+			      blk->hi - blk->lo, seq * data_block_size + blk->lo);
+	    if (ret < 0)
+		break;
+	    blk->lo = blk->hi = lo;
+	}
+
+	memcpy(blk->data + lo, buf + done, len);
+	blk->lo = MIN(blk->lo, lo);
+	blk->hi = MAX(blk->hi, lo + len);
+	done += len;
+    }
+
+    if (ret >= 0 && (wb->dirty > wbuf_per_file || wbuf_dirty > wbuf_max_dirty))
+	ret = wbuf_flush_locked(wb, mysql);
+
+    pthread_mutex_unlock(&wb->lock);
+
+    return ret < 0 ? ret : size;
+}
+
+int wbuf_flush(struct wbuf *wb, MYSQL *mysql)
+{
+    int ret;
+
+    if (!wb)
+	return 0;
+
+    pthread_mutex_lock(&wb->lock);
+    ret = wbuf_flush_locked(wb, mysql);
+    if (!ret)
+	ret = wb->error;
+    wb->error = 0;
+    pthread_mutex_unlock(&wb->lock);
+
+    return ret;
+}
+
+/**
+ * Write out the buffers of every open file of an inode.  Used before the
+ * inode's data is read or truncated, so those see (and are not later
+ * overwritten by) what was written through any file handle.
+ *
+ * @return 0 on success, < 0 first error of the flushes
+ * @param mysql handle to connection to the database
+ * @param inode inode whose buffers are flushed
+ */
+int wbuf_flush_inode(MYSQL *mysql, long inode)
+{
+    struct wbuf *wb;
+    int ret = 0, err;
+
+    if (!wbuf_dirty)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_list_mutex);
+    for (wb = wbuf_list; wb; wb = wb->next) {
+	if (wb->inode != inode || !wb->dirty)
+	    continue;
+	pthread_mutex_lock(&wb->lock);
+	err = wbuf_flush_for(wb, mysql);
+	pthread_mutex_unlock(&wb->lock);
+	if (!ret)
+	    ret = err;
+    }
+    pthread_mutex_unlock(&wbuf_list_mutex);
+
+    return ret;
+}
+
+void wbuf_getattr(struct stat *stbuf)
+{
+    struct wbuf *wb;
+    off_t end;
+
+    if (!wbuf_dirty)
+	return;
+
+    pthread_mutex_lock(&wbuf_list_mutex);
+    for (wb = wbuf_list; wb; wb = wb->next) {
+	if (wb->inode != (long)stbuf->st_ino)
+	    continue;
+	pthread_mutex_lock(&wb->lock);
+	if (wb->tail) {
+	    end = (off_t)wb->tail->seq * data_block_size + wb->tail->hi;
+	    if (end > stbuf->st_size)
+		stbuf->st_size = end;
+	}
+	pthread_mutex_unlock(&wb->lock);
+    }
+    pthread_mutex_unlock(&wbuf_list_mutex);
+}
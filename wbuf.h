@@ -0,0 +1,33 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Write-back buffer of one open file; see wbuf.c */
+struct wbuf;
+
+/** Set the per-file and global limits of buffered data; per_file == 0 disables buffering */
+void wbuf_init(size_t per_file, size_t max_dirty);
+
+/** Allocate the write-back buffer for a newly opened file, or NULL if buffering is disabled */
+struct wbuf *wbuf_new(long inode);
+
+/** Flush and release a write-back buffer, returning the error of any flush of it that failed; with mysql NULL the data is lost */
+int wbuf_free(struct wbuf *wb, MYSQL *mysql);
+
+/** Buffer a write, flushing whatever is needed to stay within limits */
+int wbuf_write(struct wbuf *wb, MYSQL *mysql, const char *buf, size_t size, off_t offset);
+
+/** Write all buffered data of one open file to the database; also fails if a flush of it by another file did */
+int wbuf_flush(struct wbuf *wb, MYSQL *mysql);
+
+/** Write all buffered data of every open file of an inode to the database */
+int wbuf_flush_inode(MYSQL *mysql, long inode);
+
+/** Extend stbuf->st_size to cover data that is buffered but not yet written */
+void wbuf_getattr(struct stat *stbuf);